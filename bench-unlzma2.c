@@ -0,0 +1,376 @@
+/*
+ * Benchmark driver for LZMA2 simplified decompressor
+ *
+ * Copyright 2020 TAKAI Kousuke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * bench-unlzma2 [-c] [-r RUNS] FILE...
+ *	decodes each raw LZMA2 FILE RUNS times with uncompress_lzma2_slack()
+ *	(into a buffer with UNCOMPRESS_LZMA2_OUTPUT_SLACK), and prints
+ *	one tab-separated line per FILE: compressed and uncompressed
+ *	sizes, median/min/max throughput in MB/s
+ *	(10^6 bytes per second of output), TSC cycles per output byte
+ *	(median; 0 if not available), and spread ((max - min) / median
+ *	of run times, in percent).  With -c, caches are flushed before
+ *	each run ("cold"); otherwise the first run is discarded ("warm").
+ *
+ * bench-unlzma2 -g KIND [-n SIZE]
+ *	writes SIZE bytes of reproducible sample data to standard output,
+ *	for KIND of text, binary, random (incompressible, as already
+ *	compressed data) or repeat (highly repetitive).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+
+#include "uncompress_lzma2.h"
+
+int verbosity;
+
+void __attribute__((format(printf, 1, 2)))
+dbg_printf (const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+/* Size of memory written to flush caches before cold runs */
+#define FLUSH_SIZE	(64 << 20)
+
+static uint64_t
+read_tsc (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* xorshift64*: reproducible across platforms */
+static uint64_t
+next_random (uint64_t *const state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * UINT64_C(2685821657736338717);
+}
+
+static void
+generate (const char *const kind, size_t const size)
+{
+  static const char *const words[] =
+    {
+      "the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+      "with", "was", "on", "by", "be", "this", "are", "from", "at", "or",
+      "decoder", "buffer", "stream", "chunk", "range", "error", "window",
+      "dictionary", "length", "distance", "literal", "match", "state",
+      "2020-01-01", "INFO", "WARN", "request", "response", "id=", "\n",
+    };
+  uint8_t *const buf = malloc(size ? size : 1);
+  uint64_t seed = UINT64_C(0x9E3779B97F4A7C15);
+  size_t pos = 0;
+
+  if (!buf)
+    errx(1, "Memory exhausted");
+  if (!strcmp(kind, "text"))
+    while (pos < size)
+      {
+	/* Words with a skewed distribution, like log files */
+	uint64_t const r = next_random(&seed);
+	unsigned int const n = sizeof(words) / sizeof(words[0]);
+	const char *const w = words[(r % n) * ((r >> 32) % n) / n];
+	size_t len = strlen(w);
+
+	if (len > size - pos)
+	  len = size - pos;
+	memcpy(&buf[pos], w, len);
+	pos += len;
+	if (pos < size && w[0] != '\n')
+	  buf[pos++] = ' ';
+      }
+  else if (!strcmp(kind, "binary"))
+    {
+      /* Records of 32-bit little-endian fields with small deltas,
+	 and occasional opcode-like bytes */
+      uint32_t fields[4] = { 0x1000, 0, 0x400000, 7 };
+
+      while (pos < size)
+	{
+	  uint64_t const r = next_random(&seed);
+
+	  for (unsigned int i = 0; i < 4 && pos < size; i++)
+	    {
+	      fields[i] += (r >> (i * 8)) & 0x0F;
+	      for (unsigned int j = 0; j < 4 && pos < size; j++)
+		buf[pos++] = fields[i] >> (j * 8);
+	    }
+	  for (unsigned int i = 0; i < ((r >> 40) & 7) && pos < size; i++)
+	    buf[pos++] = 0xE8 + ((r >> (44 + i)) & 3);
+	}
+    }
+  else if (!strcmp(kind, "random"))
+    while (pos < size)
+      {
+	uint64_t const r = next_random(&seed);
+
+	for (unsigned int i = 0; i < 8 && pos < size; i++)
+	  buf[pos++] = r >> (i * 8);
+      }
+  else if (!strcmp(kind, "repeat"))
+    {
+      /* A short pattern repeated, with rare mutations */
+      static const char pattern[] = "ABCDABCDEFGHabcd0123";
+
+      while (pos < size)
+	{
+	  buf[pos] = pattern[pos % (sizeof(pattern) - 1)];
+	  if ((next_random(&seed) & 0x3FF) == 0)
+	    buf[pos] ^= 0x20;
+	  pos++;
+	}
+    }
+  else
+    errx(2, "Unknown kind `%s'", kind);
+
+  for (pos = 0; pos < size; )
+    {
+      ssize_t const nwritten = write(STDOUT_FILENO, &buf[pos], size - pos);
+
+      if (nwritten < 0)
+	err(1, "(standard output)");
+      pos += nwritten;
+    }
+  free(buf);
+}
+
+static int
+compare_double (const void *const a, const void *const b)
+{
+  double const x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void *
+read_file (const char *const filename, size_t *const sizep)
+{
+  FILE *const fp = fopen(filename, "rb");
+  char *buf = NULL;
+  size_t size = 0, alloc = 0;
+
+  if (!fp)
+    err(1, "%s", filename);
+  for (;;)
+    {
+      if (size == alloc &&
+	  !(buf = realloc(buf, (alloc = alloc ? alloc * 2 : 1 << 20))))
+	errx(1, "Memory exhausted");
+
+      size_t const nread = fread(&buf[size], 1, alloc - size, fp);
+      if (nread == 0)
+	break;
+      size += nread;
+    }
+  if (ferror(fp))
+    err(1, "%s", filename);
+  fclose(fp);
+  *sizep = size;
+  return buf;
+}
+
+static int
+bench (const char *const filename, unsigned int const runs, _Bool const cold,
+       uint8_t *const flushbuf)
+{
+  size_t insize, outtotal, nchunks = 0;
+  void *const inbuf = read_file(filename, &insize);
+  size_t scansize = insize;
+  enum uncompress_status status
+    = uncompress_lzma2_scan(inbuf, &scansize, NULL, &nchunks, &outtotal);
+
+  if (status != UNCOMPRESS_OK && status != UNCOMPRESS_OUTLIMIT)
+    {
+      warnx("%s: Broken chunk headers", filename);
+      free(inbuf);
+      return 1;
+    }
+
+  size_t const outbufsize = outtotal + UNCOMPRESS_LZMA2_OUTPUT_SLACK;
+  void *const outbuf = malloc(outbufsize);
+  void *const workspace
+    = aligned_alloc(UNCOMPRESS_LZMA2_WORKSPACE_ALIGN,
+		    ((uncompress_lzma2_workspace_size()
+		      + UNCOMPRESS_LZMA2_WORKSPACE_ALIGN - 1)
+		     & -UNCOMPRESS_LZMA2_WORKSPACE_ALIGN));
+  double seconds[runs];
+  double cycles[runs];
+
+  if (!outbuf || !workspace)
+    errx(1, "Memory exhausted");
+  /* Touch the output buffer once */
+  memset(outbuf, 0, outbufsize);
+
+  /* Run -1 (only for warm runs) warms up caches. */
+  for (int i = cold ? 0 : -1; i < (int) runs; i++)
+    {
+      size_t isize = insize, osize = outtotal;
+
+      if (cold)
+	for (size_t j = 0; j < FLUSH_SIZE; j += 64)
+	  flushbuf[j]++;
+
+      uint64_t const tsc0 = read_tsc();
+      double const t0 = now();
+      status = uncompress_lzma2_slack(inbuf, &isize, outbuf, &osize,
+				      workspace, UNCOMPRESS_LZMA2_OUTPUT_SLACK);
+      double const t1 = now();
+      uint64_t const tsc1 = read_tsc();
+
+      if (status != UNCOMPRESS_OK || osize != outtotal)
+	{
+	  warnx("%s: uncompress_lzma2_slack() = %d, %zu bytes", filename,
+		(int) status, osize);
+	  free(workspace);
+	  free(outbuf);
+	  free(inbuf);
+	  return 1;
+	}
+      if (i >= 0)
+	{
+	  seconds[i] = t1 - t0;
+	  cycles[i] = (double) (tsc1 - tsc0);
+	}
+    }
+
+  qsort(seconds, runs, sizeof(seconds[0]), compare_double);
+  qsort(cycles, runs, sizeof(cycles[0]), compare_double);
+
+  double const median = seconds[runs / 2];
+  printf("%s\t%zu\t%zu\t%s\t%u\t%.1f\t%.1f\t%.1f\t%.2f\t%.1f\n",
+	 filename, insize, outtotal, cold ? "cold" : "warm", runs,
+	 outtotal / median / 1e6,
+	 outtotal / seconds[runs - 1] / 1e6,
+	 outtotal / seconds[0] / 1e6,
+	 outtotal ? cycles[runs / 2] / outtotal : 0.0,
+	 (seconds[runs - 1] - seconds[0]) / median * 100);
+  fflush(stdout);
+
+  free(workspace);
+  free(outbuf);
+  free(inbuf);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int optc;
+  unsigned int runs = 10;
+  _Bool cold = 0;
+  const char *kind = NULL;
+  size_t size = 8 << 20;
+  uint8_t *flushbuf = NULL;
+  int ret = 0;
+
+  while ((optc = getopt(argc, argv, "cg:n:r:")) >= 0)
+    switch (optc)
+      {
+      case 'c':
+	cold = 1;
+	break;
+      case 'g':
+	kind = optarg;
+	break;
+      case 'n':
+      case 'r':
+	{
+	  char *end;
+
+	  errno = 0;
+	  unsigned long const ulval = strtoul(optarg, &end, 0);
+	  if (errno || end == optarg || *end ||
+	      (optc == 'r' && (ulval == 0 || ulval > 10000)))
+	    errx(2, "Invalid number `%s'", optarg);
+	  if (optc == 'n')
+	    size = ulval;
+	  else
+	    runs = ulval;
+	}
+	break;
+      default:
+	errx(2, "usage: %s [-c] [-r RUNS] FILE...\n"
+	     "       %s -g {text|binary|random|repeat} [-n SIZE]",
+	     argv[0], argv[0]);
+	return 2;
+      }
+
+  if (kind)
+    {
+      generate(kind, size);
+      return 0;
+    }
+
+  if (cold && !(flushbuf = calloc(FLUSH_SIZE, 1)))
+    errx(1, "Memory exhausted");
+
+  /* Build variant, so that results of several builds can be told apart
+     (this file is compiled with the same flags as the decoder) */
+  printf("#decoder\t%s\t%s\t%s\n", uncompress_lzma2_isa(),
+#ifdef UNCOMPRESS_LZMA2_RC64
+	 "rc64",
+#else
+	 "rc32",
+#endif
+#ifdef UNCOMPRESS_LZMA2_PROBS_GROUPED
+	 "probs-grouped"
+#else
+	 "probs-flat"
+#endif
+	 );
+  printf("#file\tcompressed\tuncompressed\tcache\truns\t"
+	 "MB/s\tMB/s(min)\tMB/s(max)\tcycles/byte\tspread%%\n");
+  for (int i = optind; i < argc; i++)
+    ret |= bench(argv[i], runs, cold, flushbuf);
+  free(flushbuf);
+  return ret;
+}
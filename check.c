@@ -0,0 +1,433 @@
+/*
+ * Integrity checks of .xz format for the test bench
+ *
+ * Copyright 2020 TAKAI Kousuke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * CRC32 and CRC64 are computed 8 bytes at a time with 8 tables
+ * ("slicing-by-8").  On x86-64 with PCLMULQDQ, CRC32 of longer data is
+ * computed by folding 64 bytes at a time with carry-less multiplication
+ * (as described in Intel's "Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ Instruction"), which is selected at runtime.
+ * On ARMv8 with CRC32 extension (at compile time), its instructions
+ * are used instead.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+# include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+# include <arm_acle.h>
+#endif
+
+#include "check.h"
+
+#define CRC32_POLY	UINT32_C(0xEDB88320)
+#define CRC64_POLY	UINT64_C(0xC96C5795D7870F42)
+
+static uint_least32_t crc32_table[8][256];
+static uint_least64_t crc64_table[8][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+#if defined(__x86_64__)
+static _Bool have_pclmul;
+#endif
+
+static void
+init_tables (void)
+{
+  for (unsigned int i = 0; i < 256; i++)
+    {
+      uint_fast32_t c32 = i;
+      uint_fast64_t c64 = i;
+
+      for (unsigned int j = 0; j < 8; j++)
+	{
+	  c32 = (c32 >> 1) ^ ((c32 & 1) ? CRC32_POLY : 0);
+	  c64 = (c64 >> 1) ^ ((c64 & 1) ? CRC64_POLY : 0);
+	}
+      crc32_table[0][i] = c32;
+      crc64_table[0][i] = c64;
+    }
+  for (unsigned int k = 1; k < 8; k++)
+    for (unsigned int i = 0; i < 256; i++)
+      {
+	crc32_table[k][i] = ((crc32_table[k - 1][i] >> 8) ^
+			     crc32_table[0][crc32_table[k - 1][i] & 0xFF]);
+	crc64_table[k][i] = ((crc64_table[k - 1][i] >> 8) ^
+			     crc64_table[0][crc64_table[k - 1][i] & 0xFF]);
+      }
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  have_pclmul = (__builtin_cpu_supports("pclmul") &&
+		 __builtin_cpu_supports("sse4.1"));
+#endif
+}
+
+static uint_fast32_t
+read_le32 (const uint8_t *const p)
+{
+  return ((uint_fast32_t) p[0]       |
+	  (uint_fast32_t) p[1] <<  8 |
+	  (uint_fast32_t) p[2] << 16 |
+	  (uint_fast32_t) p[3] << 24);
+}
+
+static uint_fast64_t
+read_le64 (const uint8_t *const p)
+{
+  return read_le32(p) | (uint_fast64_t) read_le32(p + 4) << 32;
+}
+
+#if defined(__x86_64__)
+/* CRC32 (not inverted) of P[0..SIZE), where SIZE is a multiple of 16
+   and at least 64. */
+static __attribute__((target("pclmul,sse4.1"))) uint_fast32_t
+crc32_pclmul (uint_fast32_t crc, const uint8_t *p, size_t size)
+{
+  __m128i const k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  __m128i const k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  __m128i const k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+  __m128i const poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  __m128i const mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x1, x2, x3, x4, x5;
+
+  x1 = _mm_loadu_si128((const __m128i *) (p + 0x00));
+  x2 = _mm_loadu_si128((const __m128i *) (p + 0x10));
+  x3 = _mm_loadu_si128((const __m128i *) (p + 0x20));
+  x4 = _mm_loadu_si128((const __m128i *) (p + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  p += 64;
+  size -= 64;
+
+#define FOLD(X, K, Y)							\
+  ((X) = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128((X), (K), 0x00), \
+				     _mm_clmulepi64_si128((X), (K), 0x11)), \
+		       (Y)))
+
+  /* Fold 64 bytes at a time. */
+  for (; size >= 64; p += 64, size -= 64)
+    {
+      FOLD(x1, k1k2, _mm_loadu_si128((const __m128i *) (p + 0x00)));
+      FOLD(x2, k1k2, _mm_loadu_si128((const __m128i *) (p + 0x10)));
+      FOLD(x3, k1k2, _mm_loadu_si128((const __m128i *) (p + 0x20)));
+      FOLD(x4, k1k2, _mm_loadu_si128((const __m128i *) (p + 0x30)));
+    }
+
+  /* Fold into 128 bits, then 16 bytes at a time. */
+  FOLD(x1, k3k4, x2);
+  FOLD(x1, k3k4, x3);
+  FOLD(x1, k3k4, x4);
+  for (; size >= 16; p += 16, size -= 16)
+    FOLD(x1, k3k4, _mm_loadu_si128((const __m128i *) p));
+#undef FOLD
+
+  /* Fold 128 bits into 64 bits. */
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /* Barrett reduction into 32 bits */
+  x5 = _mm_and_si128(x1, mask32);
+  x5 = _mm_clmulepi64_si128(x5, poly, 0x10);
+  x5 = _mm_and_si128(x5, mask32);
+  x5 = _mm_clmulepi64_si128(x5, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x5);
+  return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+#endif
+
+uint_fast32_t
+crc32 (uint_fast32_t crc, const void *const buf, size_t size)
+{
+  const uint8_t *p = buf;
+
+  pthread_once(&tables_once, init_tables);
+  crc = ~crc & UINT32_C(0xFFFFFFFF);
+
+#if defined(__x86_64__)
+  if (have_pclmul && size >= 64)
+    {
+      crc = crc32_pclmul(crc, p, size & -16);
+      p += size & -16;
+      size &= 15;
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+  for (; size >= 8; p += 8, size -= 8)
+    crc = __crc32d(crc, read_le64(p));
+#endif
+
+  for (; size >= 8; p += 8, size -= 8)
+    {
+      uint_fast32_t const lo = read_le32(p) ^ crc;
+      uint_fast32_t const hi = read_le32(p + 4);
+
+      crc = (crc32_table[7][lo & 0xFF] ^
+	     crc32_table[6][(lo >> 8) & 0xFF] ^
+	     crc32_table[5][(lo >> 16) & 0xFF] ^
+	     crc32_table[4][lo >> 24] ^
+	     crc32_table[3][hi & 0xFF] ^
+	     crc32_table[2][(hi >> 8) & 0xFF] ^
+	     crc32_table[1][(hi >> 16) & 0xFF] ^
+	     crc32_table[0][hi >> 24]);
+    }
+  for (; size > 0; size--)
+    crc = (crc >> 8) ^ crc32_table[0][(crc & 0xFF) ^ *p++];
+  return ~crc & UINT32_C(0xFFFFFFFF);
+}
+
+uint_fast64_t
+crc64 (uint_fast64_t crc, const void *const buf, size_t size)
+{
+  const uint8_t *p = buf;
+
+  pthread_once(&tables_once, init_tables);
+  crc = ~crc & UINT64_C(0xFFFFFFFFFFFFFFFF);
+  for (; size >= 8; p += 8, size -= 8)
+    {
+      uint_fast64_t const x = read_le64(p) ^ crc;
+
+      crc = (crc64_table[7][x & 0xFF] ^
+	     crc64_table[6][(x >> 8) & 0xFF] ^
+	     crc64_table[5][(x >> 16) & 0xFF] ^
+	     crc64_table[4][(x >> 24) & 0xFF] ^
+	     crc64_table[3][(x >> 32) & 0xFF] ^
+	     crc64_table[2][(x >> 40) & 0xFF] ^
+	     crc64_table[1][(x >> 48) & 0xFF] ^
+	     crc64_table[0][x >> 56]);
+    }
+  for (; size > 0; size--)
+    crc = (crc >> 8) ^ crc64_table[0][(crc & 0xFF) ^ *p++];
+  return ~crc & UINT64_C(0xFFFFFFFFFFFFFFFF);
+}
+
+static const uint_least32_t sha256_k[64] =
+  {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+  };
+
+#define ROTR32(X, N)	(((X) >> (N)) | ((X) << (32 - (N))))
+
+static void
+sha256_block (uint_least32_t *const state, const uint8_t *const p)
+{
+  uint_fast32_t w[64];
+  uint_fast32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint_fast32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  unsigned int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = ((uint_fast32_t) p[i * 4] << 24 |
+	    (uint_fast32_t) p[i * 4 + 1] << 16 |
+	    (uint_fast32_t) p[i * 4 + 2] << 8 |
+	    (uint_fast32_t) p[i * 4 + 3]);
+  for (; i < 64; i++)
+    {
+      uint32_t const w15 = w[i - 15], w2 = w[i - 2];
+      uint32_t const s0 = ROTR32(w15, 7) ^ ROTR32(w15, 18) ^ (w15 >> 3);
+      uint32_t const s1 = ROTR32(w2, 17) ^ ROTR32(w2, 19) ^ (w2 >> 10);
+
+      w[i] = (uint32_t) (w[i - 16] + s0 + w[i - 7] + s1);
+    }
+
+  for (i = 0; i < 64; i++)
+    {
+      uint32_t const e32 = e, a32 = a;
+      uint32_t const t1 = (h + (ROTR32(e32, 6) ^ ROTR32(e32, 11) ^
+				ROTR32(e32, 25)) +
+			   ((e & f) ^ (~e & g)) + sha256_k[i] + w[i]);
+      uint32_t const t2 = ((ROTR32(a32, 2) ^ ROTR32(a32, 13) ^
+			    ROTR32(a32, 22)) +
+			   ((a & b) ^ (a & c) ^ (b & c)));
+
+      h = g;
+      g = f;
+      f = e;
+      e = (uint32_t) (d + t1);
+      d = c;
+      c = b;
+      b = a;
+      a = (uint32_t) (t1 + t2);
+    }
+
+  state[0] = (uint32_t) (state[0] + a);
+  state[1] = (uint32_t) (state[1] + b);
+  state[2] = (uint32_t) (state[2] + c);
+  state[3] = (uint32_t) (state[3] + d);
+  state[4] = (uint32_t) (state[4] + e);
+  state[5] = (uint32_t) (state[5] + f);
+  state[6] = (uint32_t) (state[6] + g);
+  state[7] = (uint32_t) (state[7] + h);
+}
+
+void
+sha256_init (struct sha256 *const ctx)
+{
+  static const uint_least32_t initial[8] =
+    {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+  memcpy(ctx->state, initial, sizeof(ctx->state));
+  ctx->count = 0;
+}
+
+void
+sha256_update (struct sha256 *const ctx, const void *const buf, size_t size)
+{
+  const uint8_t *p = buf;
+  size_t const used = ctx->count % 64;
+
+  ctx->count += size;
+  if (used)
+    {
+      size_t const len = size < 64 - used ? size : 64 - used;
+
+      memcpy(&ctx->buf[used], p, len);
+      p += len;
+      size -= len;
+      if (used + len < 64)
+	return;
+      sha256_block(ctx->state, ctx->buf);
+    }
+  for (; size >= 64; p += 64, size -= 64)
+    sha256_block(ctx->state, p);
+  memcpy(ctx->buf, p, size);
+}
+
+void
+sha256_final (struct sha256 *const ctx, uint8_t digest[32])
+{
+  uint_fast64_t const bits = ctx->count * 8;
+  size_t used = ctx->count % 64;
+
+  ctx->buf[used++] = 0x80;
+  if (used > 56)
+    {
+      memset(&ctx->buf[used], 0, 64 - used);
+      sha256_block(ctx->state, ctx->buf);
+      used = 0;
+    }
+  memset(&ctx->buf[used], 0, 56 - used);
+  for (unsigned int i = 0; i < 8; i++)
+    ctx->buf[56 + i] = bits >> (56 - i * 8);
+  sha256_block(ctx->state, ctx->buf);
+  for (unsigned int i = 0; i < 32; i++)
+    digest[i] = ctx->state[i / 4] >> (24 - (i % 4) * 8);
+}
+
+unsigned int
+check_size (unsigned int const type)
+{
+  return type ? (4 << ((type - 1) / 3)) : 0;
+}
+
+const char *
+check_name (unsigned int const type)
+{
+  switch (type)
+    {
+    case CHECK_NONE:	return "None";
+    case CHECK_CRC32:	return "CRC32";
+    case CHECK_CRC64:	return "CRC64";
+    case CHECK_SHA256:	return "SHA-256";
+    default:		return NULL;
+    }
+}
+
+void
+check_init (struct check *const check, unsigned int const type)
+{
+  check->type = type;
+  switch (type)
+    {
+    case CHECK_CRC32:
+      check->u.crc32 = 0;
+      break;
+    case CHECK_CRC64:
+      check->u.crc64 = 0;
+      break;
+    case CHECK_SHA256:
+      sha256_init(&check->u.sha256);
+      break;
+    }
+}
+
+void
+check_update (struct check *const check,
+	      const void *const buf, size_t const size)
+{
+  switch (check->type)
+    {
+    case CHECK_CRC32:
+      check->u.crc32 = crc32(check->u.crc32, buf, size);
+      break;
+    case CHECK_CRC64:
+      check->u.crc64 = crc64(check->u.crc64, buf, size);
+      break;
+    case CHECK_SHA256:
+      sha256_update(&check->u.sha256, buf, size);
+      break;
+    }
+}
+
+_Bool
+check_verify (struct check *const check, const void *const recorded)
+{
+  const uint8_t *const p = recorded;
+
+  switch (check->type)
+    {
+    case CHECK_NONE:
+      return 1;
+    case CHECK_CRC32:
+      return check->u.crc32 == read_le32(p);
+    case CHECK_CRC64:
+      return check->u.crc64 == read_le64(p);
+    case CHECK_SHA256:
+      {
+	uint8_t digest[32];
+
+	sha256_final(&check->u.sha256, digest);
+	return !memcmp(digest, p, sizeof(digest));
+      }
+    default:
+      return 0;
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * Integrity checks of .xz format for the test bench
+ *
+ * Copyright 2020 TAKAI Kousuke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef CHECK_H
+#define CHECK_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Check types (in Stream Flags) */
+#define CHECK_NONE	0x0
+#define CHECK_CRC32	0x1
+#define CHECK_CRC64	0x4
+#define CHECK_SHA256	0xA
+
+struct sha256
+  {
+    uint_least32_t	state[8];
+    uint_least64_t	count;		/* Number of bytes hashed */
+    uint8_t		buf[64];
+  };
+
+struct check
+  {
+    unsigned int	type;
+    union
+      {
+	uint_least32_t	crc32;
+	uint_least64_t	crc64;
+	struct sha256	sha256;
+      } u;
+  };
+
+/* Update CRC (0 initially) with BUF[0..SIZE), as zlib's crc32() */
+extern uint_fast32_t crc32 (uint_fast32_t /* crc */,
+			    const void */* buf */, size_t /* size */);
+
+/* Same as crc32(), but with CRC-64/XZ (ECMA-182 polynomial) */
+extern uint_fast64_t crc64 (uint_fast64_t /* crc */,
+			    const void */* buf */, size_t /* size */);
+
+extern void sha256_init (struct sha256 *);
+extern void sha256_update (struct sha256 *,
+			   const void */* buf */, size_t /* size */);
+extern void sha256_final (struct sha256 *, uint8_t /* digest */[32]);
+
+/* Size of the check of TYPE (also for unsupported ones) */
+extern unsigned int check_size (unsigned int /* type */);
+
+/* Name of TYPE, or NULL if TYPE is not supported. */
+extern const char *check_name (unsigned int /* type */);
+
+extern void check_init (struct check *, unsigned int /* type */);
+extern void check_update (struct check *,
+			  const void */* buf */, size_t /* size */);
+
+/* Finish CHECK and compare it with RECORDED (check_size() bytes as
+   stored in .xz files).  Always true for CHECK_NONE. */
+extern _Bool check_verify (struct check *, const void */* recorded */);
+
+#endif /* CHECK_H */
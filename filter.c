@@ -0,0 +1,343 @@
+/*
+ * Filters of .xz format (BCJ and delta) for the test bench
+ *
+ * Copyright 2020 TAKAI Kousuke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * BCJ filters convert relative addresses of branch (and some other)
+ * instructions back from the absolute addresses the encoder made of
+ * them, which compress better.  The conversions are those of XZ Utils
+ * (src/liblzma/simple), so that the results agree bit for bit.
+ * The delta filter adds each byte to the one DISTANCE bytes before.
+ */
+
+#include <string.h>
+
+#include "filter.h"
+
+static uint_fast32_t
+read_le32 (const uint8_t *const p)
+{
+  return ((uint_fast32_t) p[0]       |
+	  (uint_fast32_t) p[1] <<  8 |
+	  (uint_fast32_t) p[2] << 16 |
+	  (uint_fast32_t) p[3] << 24);
+}
+
+static void
+write_le32 (uint8_t *const p, uint_fast32_t const val)
+{
+  p[0] = val;
+  p[1] = val >> 8;
+  p[2] = val >> 16;
+  p[3] = val >> 24;
+}
+
+/* Whether B is the most significant byte of a 32-bit displacement
+   which x86 encoders may have converted (0x00 or 0xFF) */
+#define X86_MSBYTE(B)	((((B) + 1) & 0xFE) == 0)
+
+static size_t
+x86_decode (struct filter *const f, uint8_t *const buf, size_t const size)
+{
+  static const _Bool allowed[8] = { 1, 1, 1, 0, 1, 0, 0, 0 };
+  static const unsigned int bit_number[8] = { 0, 1, 2, 2, 3, 3, 3, 3 };
+  uint_fast32_t prev_pos = f->x86_prev_pos;
+  unsigned int prev_mask = f->x86_prev_mask;
+  size_t i = 0;
+
+  if (size < 5)
+    return 0;
+  if ((uint32_t) (f->pos - prev_pos) > 5)
+    prev_pos = f->pos - 5;
+
+  while (i <= size - 5)
+    {
+      uint_fast8_t b = buf[i];
+
+      if (b != 0xE8 && b != 0xE9)
+	{
+	  i++;
+	  continue;
+	}
+
+      /* Mask of the last 3 bytes which were E8/E9 */
+      uint_fast32_t const offset = (uint32_t) (f->pos + i - prev_pos);
+      prev_pos = (uint32_t) (f->pos + i);
+      if (offset > 5)
+	prev_mask = 0;
+      else
+	for (uint_fast32_t j = 0; j < offset; j++)
+	  prev_mask = (prev_mask & 0x77) << 1;
+
+      b = buf[i + 4];
+      if (X86_MSBYTE(b) && allowed[(prev_mask >> 1) & 7] &&
+	  (prev_mask >> 1) < 0x10)
+	{
+	  uint_fast32_t src = read_le32(&buf[i + 1]), dest;
+
+	  for (;;)
+	    {
+	      dest = (uint32_t) (src - (f->pos + i + 5));
+	      if (prev_mask == 0)
+		break;
+
+	      unsigned int const n = bit_number[prev_mask >> 1];
+	      b = (uint8_t) (dest >> (24 - n * 8));
+	      if (!X86_MSBYTE(b))
+		break;
+	      src = dest ^ (((uint_fast32_t) 1 << (32 - n * 8)) - 1);
+	    }
+	  /* Sign-extended 25-bit displacement */
+	  dest &= UINT32_C(0x01FFFFFF);
+	  dest |= (uint32_t) (0 - (dest & UINT32_C(0x01000000)));
+	  write_le32(&buf[i + 1], dest);
+	  i += 5;
+	  prev_mask = 0;
+	}
+      else
+	{
+	  i++;
+	  prev_mask |= 1;
+	  if (X86_MSBYTE(b))
+	    prev_mask |= 0x10;
+	}
+    }
+
+  f->x86_prev_pos = prev_pos;
+  f->x86_prev_mask = prev_mask;
+  return i;
+}
+
+static size_t
+powerpc_decode (struct filter *const f, uint8_t *const buf, size_t const size)
+{
+  size_t i;
+
+  for (i = 0; i + 4 <= size; i += 4)
+    /* Big-endian "bl": opcode 18 with AA = 0 and LK = 1 */
+    if ((buf[i] >> 2) == 0x12 && (buf[i + 3] & 3) == 1)
+      {
+	uint_fast32_t const src = ((uint_fast32_t) (buf[i] & 3) << 24 |
+				   (uint_fast32_t) buf[i + 1] << 16 |
+				   (uint_fast32_t) buf[i + 2] << 8 |
+				   (buf[i + 3] & ~3U));
+	uint_fast32_t const dest = src - (f->pos + i);
+
+	buf[i] = 0x48 | ((dest >> 24) & 0x03);
+	buf[i + 1] = dest >> 16;
+	buf[i + 2] = dest >> 8;
+	buf[i + 3] = (buf[i + 3] & 0x03) | (dest & ~3U);
+      }
+  return i;
+}
+
+static size_t
+arm_decode (struct filter *const f, uint8_t *const buf, size_t const size)
+{
+  size_t i;
+
+  for (i = 0; i + 4 <= size; i += 4)
+    /* "bl" (always) */
+    if (buf[i + 3] == 0xEB)
+      {
+	uint_fast32_t const src = ((uint_fast32_t) buf[i + 2] << 16 |
+				   (uint_fast32_t) buf[i + 1] << 8 |
+				   buf[i]) << 2;
+	uint_fast32_t const dest = (src - (f->pos + i + 8)) >> 2;
+
+	buf[i + 2] = dest >> 16;
+	buf[i + 1] = dest >> 8;
+	buf[i] = dest;
+      }
+  return i;
+}
+
+static size_t
+armthumb_decode (struct filter *const f, uint8_t *const buf, size_t const size)
+{
+  size_t i;
+
+  for (i = 0; i + 4 <= size; i += 2)
+    /* A pair of 16-bit halves of Thumb "bl" */
+    if ((buf[i + 1] & 0xF8) == 0xF0 && (buf[i + 3] & 0xF8) == 0xF8)
+      {
+	uint_fast32_t const src = ((uint_fast32_t) (buf[i + 1] & 7) << 19 |
+				   (uint_fast32_t) buf[i] << 11 |
+				   (uint_fast32_t) (buf[i + 3] & 7) << 8 |
+				   buf[i + 2]) << 1;
+	uint_fast32_t const dest = (src - (f->pos + i + 4)) >> 1;
+
+	buf[i + 1] = 0xF0 | ((dest >> 19) & 7);
+	buf[i] = dest >> 11;
+	buf[i + 3] = 0xF8 | ((dest >> 8) & 7);
+	buf[i + 2] = dest;
+	i += 2;
+      }
+  return i;
+}
+
+static size_t
+sparc_decode (struct filter *const f, uint8_t *const buf, size_t const size)
+{
+  size_t i;
+
+  for (i = 0; i + 4 <= size; i += 4)
+    /* "call" with a displacement in +-8 MiB */
+    if ((buf[i] == 0x40 && (buf[i + 1] & 0xC0) == 0x00) ||
+	(buf[i] == 0x7F && (buf[i + 1] & 0xC0) == 0xC0))
+      {
+	uint_fast32_t const src = ((uint_fast32_t) buf[i] << 24 |
+				   (uint_fast32_t) buf[i + 1] << 16 |
+				   (uint_fast32_t) buf[i + 2] << 8 |
+				   buf[i + 3]) << 2;
+	uint_fast32_t dest = (uint32_t) (src - (f->pos + i)) >> 2;
+
+	dest = ((((0 - ((dest >> 22) & 1)) << 22) & UINT32_C(0x3FFFFFFF)) |
+		(dest & UINT32_C(0x3FFFFF)) | UINT32_C(0x40000000));
+	buf[i] = dest >> 24;
+	buf[i + 1] = dest >> 16;
+	buf[i + 2] = dest >> 8;
+	buf[i + 3] = dest;
+      }
+  return i;
+}
+
+static size_t
+arm64_decode (struct filter *const f, uint8_t *const buf, size_t const size)
+{
+  size_t i;
+
+  for (i = 0; i + 4 <= size; i += 4)
+    {
+      uint_fast32_t const pc = (uint32_t) (f->pos + i);
+      uint_fast32_t instr = read_le32(&buf[i]);
+
+      if ((instr >> 26) == 0x25)
+	{
+	  /* "bl" */
+	  instr = (UINT32_C(0x94000000) |
+		   ((instr - (pc >> 2)) & UINT32_C(0x03FFFFFF)));
+	  write_le32(&buf[i], instr);
+	}
+      else if ((instr & UINT32_C(0x9F000000)) == UINT32_C(0x90000000))
+	{
+	  /* "adrp" with an immediate in +-512 MiB (others are left
+	     as they are) */
+	  uint_fast32_t const src = (((instr >> 29) & 3) |
+				     ((instr >> 3) & UINT32_C(0x001FFFFC)));
+
+	  if ((src + UINT32_C(0x00020000)) & UINT32_C(0x001C0000))
+	    continue;
+
+	  uint_fast32_t const dest = (uint32_t) (src - (pc >> 12));
+	  instr &= UINT32_C(0x9000001F);
+	  instr |= (dest & 3) << 29;
+	  instr |= (dest & UINT32_C(0x0003FFFC)) << 3;
+	  instr |= (uint32_t) (0 - (dest & UINT32_C(0x00020000)))
+		   & UINT32_C(0x00E00000);
+	  write_le32(&buf[i], instr);
+	}
+    }
+  return i;
+}
+
+static size_t
+delta_decode (struct filter *const f, uint8_t *const buf, size_t const size)
+{
+  unsigned int const distance = f->delta_distance;
+  uint8_t pos = f->delta_pos;
+
+  /* HISTORY[POS + N] is the Nth last byte. */
+  for (size_t i = 0; i < size; i++)
+    {
+      buf[i] += f->delta_history[(uint8_t) (pos + distance)];
+      f->delta_history[pos--] = buf[i];
+    }
+  f->delta_pos = pos;
+  return size;
+}
+
+const char *
+filter_name (uint_fast64_t const id)
+{
+  switch (id)
+    {
+    case FILTER_DELTA:		return "Delta";
+    case FILTER_X86:		return "x86";
+    case FILTER_POWERPC:	return "PowerPC";
+    case FILTER_ARM:		return "ARM";
+    case FILTER_ARMTHUMB:	return "ARM-Thumb";
+    case FILTER_SPARC:		return "SPARC";
+    case FILTER_ARM64:		return "ARM64";
+    default:			return NULL;
+    }
+}
+
+_Bool
+filter_init (struct filter *const f, uint_fast64_t const id,
+	     const uint8_t *const props, size_t const props_size)
+{
+  memset(f, 0, sizeof(*f));
+  f->id = id;
+  switch (id)
+    {
+    case FILTER_DELTA:
+      if (props_size != 1)
+	return 0;
+      f->delta_distance = props[0] + 1;
+      return 1;
+
+    case FILTER_X86:
+    case FILTER_POWERPC:
+    case FILTER_ARM:
+    case FILTER_ARMTHUMB:
+    case FILTER_SPARC:
+    case FILTER_ARM64:
+      /* Optional start offset */
+      if (props_size == 4)
+	f->pos = read_le32(props);
+      else if (props_size != 0)
+	return 0;
+      f->x86_prev_pos = (uint32_t) (f->pos - 5);
+      return 1;
+
+    default:
+      return 0;
+    }
+}
+
+size_t
+filter_decode (struct filter *const f, uint8_t *const buf, size_t const size)
+{
+  size_t done;
+
+  switch (f->id)
+    {
+    case FILTER_DELTA:		return delta_decode(f, buf, size);
+    case FILTER_X86:		done = x86_decode(f, buf, size); break;
+    case FILTER_POWERPC:	done = powerpc_decode(f, buf, size); break;
+    case FILTER_ARM:		done = arm_decode(f, buf, size); break;
+    case FILTER_ARMTHUMB:	done = armthumb_decode(f, buf, size); break;
+    case FILTER_SPARC:		done = sparc_decode(f, buf, size); break;
+    case FILTER_ARM64:		done = arm64_decode(f, buf, size); break;
+    default:			return size;
+    }
+  f->pos += done;
+  return done;
+}
@@ -0,0 +1,62 @@
+/*
+ * Filters of .xz format (BCJ and delta) for the test bench
+ *
+ * Copyright 2020 TAKAI Kousuke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef FILTER_H
+#define FILTER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Filter IDs (in Filter Flags) */
+#define FILTER_DELTA	0x03
+#define FILTER_X86	0x04
+#define FILTER_POWERPC	0x05
+#define FILTER_ARM	0x07
+#define FILTER_ARMTHUMB	0x08
+#define FILTER_SPARC	0x09
+#define FILTER_ARM64	0x0A
+
+struct filter
+  {
+    unsigned int	id;
+    uint_least32_t	pos;		/* Position of the next byte for
+					   BCJ filters (with start offset) */
+    uint_least32_t	x86_prev_pos;
+    unsigned int	x86_prev_mask;
+    unsigned int	delta_distance;
+    uint8_t		delta_pos;
+    uint8_t		delta_history[256];
+  };
+
+/* Name of filter ID, or NULL if it is not supported. */
+extern const char *filter_name (uint_fast64_t /* id */);
+
+/* Initialize FILTER for decoding with filter ID and its properties
+   PROPS[0..PROPS_SIZE).  Returns 0 if the properties are not valid. */
+extern _Bool filter_init (struct filter *, uint_fast64_t /* id */,
+			  const uint8_t */* props */, size_t /* props_size */);
+
+/* Decode BUF[0..SIZE) in place and return the number of bytes done.
+   The rest (less than 5 bytes) is to be given again at the beginning
+   of the next call, or is left as it is at the end of the data. */
+extern size_t filter_decode (struct filter *,
+			     uint8_t */* buf */, size_t /* size */);
+
+#endif /* FILTER_H */
@@ -0,0 +1,477 @@
+/*
+ * Re-chunker of LZMA2 streams with periodic dictionary resets
+ *
+ * Copyright 2020 TAKAI Kousuke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * rechunk-lzma2 [-v] [-x] [-j THREADS] [-p PRESET] [-s SEGMENT-SIZE]
+ *		 [-i INDEX-FILE] [FILE]
+ *	decompresses raw LZMA2 FILE (or the standard input) and writes it
+ *	to the standard output compressed again in segments of
+ *	SEGMENT-SIZE bytes (8 MiB by default), each starting with
+ *	a dictionary reset, so that uncompress_lzma2_mt() can decode the
+ *	segments in parallel and uncompress_lzma2_range() needs to decode
+ *	only the segments of a range.  Segments are compressed with
+ *	liblzma (xz PRESET, 6 by default) by THREADS threads (0 for all
+ *	CPUs).  With -x, the output is an .xz file with a Block (with
+ *	CRC64) per segment instead, whose Index locates the segments.
+ *	With -i, the chunks of the raw output are listed into INDEX-FILE
+ *	in the format of test-unlzma2 -l.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <lzma.h>
+
+#include "uncompress_lzma2.h"
+
+int verbosity;
+
+void __attribute__((format(printf, 1, 2)))
+dbg_printf (const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+/* A part of the data compressed on its own */
+struct segment
+  {
+    size_t		in_offset;	/* In the decompressed data */
+    size_t		in_size;
+    uint8_t *		out;
+    size_t		out_size;
+    lzma_vli		unpadded_size;	/* Of the .xz Block (with -x) */
+    lzma_ret		status;
+  };
+
+struct job
+  {
+    const uint8_t *	data;
+    struct segment *	segments;
+    size_t		nsegments;
+    size_t		next;		/* Next segment to be taken */
+    uint32_t		preset;
+    _Bool		xz;
+  };
+
+static void
+compress_segment (const struct job *const job, struct segment *const seg)
+{
+  lzma_options_lzma options;
+  lzma_filter filters[] =
+    {
+      { .id = LZMA_FILTER_LZMA2, .options = &options },
+      { .id = LZMA_VLI_UNKNOWN },
+    };
+  size_t const bound = lzma_block_buffer_bound(seg->in_size);
+
+  seg->out_size = 0;
+  if (lzma_lzma_preset(&options, job->preset))
+    {
+      seg->status = LZMA_OPTIONS_ERROR;
+      return;
+    }
+  /* A larger dictionary would never be used. */
+  if (options.dict_size > seg->in_size)
+    options.dict_size = (seg->in_size > LZMA_DICT_SIZE_MIN ?
+			 seg->in_size : LZMA_DICT_SIZE_MIN);
+  if (!(seg->out = malloc(bound)))
+    {
+      seg->status = LZMA_MEM_ERROR;
+      return;
+    }
+
+  if (job->xz)
+    {
+      lzma_block block =
+	{
+	  .version = 0,
+	  .check = LZMA_CHECK_CRC64,
+	  .filters = filters,
+	};
+
+      seg->status = lzma_block_buffer_encode(&block, NULL,
+					     &job->data[seg->in_offset],
+					     seg->in_size, seg->out,
+					     &seg->out_size, bound);
+      seg->unpadded_size = lzma_block_unpadded_size(&block);
+    }
+  else
+    {
+      /* The first chunk of a raw LZMA2 stream resets the dictionary;
+	 the end marker is dropped but after the last segment. */
+      seg->status = lzma_raw_buffer_encode(filters, NULL,
+					   &job->data[seg->in_offset],
+					   seg->in_size, seg->out,
+					   &seg->out_size, bound);
+      if (seg->status == LZMA_OK && seg->out_size > 0)
+	seg->out_size--;
+    }
+}
+
+static void *
+compressor (void *const arg)
+{
+  struct job *const job = arg;
+
+  for (;;)
+    {
+      size_t const i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+
+      if (i >= job->nsegments)
+	break;
+      compress_segment(job, &job->segments[i]);
+    }
+  return NULL;
+}
+
+static void
+write_all (const void *const buf, size_t const size)
+{
+  for (size_t offset = 0; offset < size; )
+    {
+      ssize_t const nwritten = write(STDOUT_FILENO,
+				     (const char *) buf + offset,
+				     size - offset);
+
+      if (nwritten < 0)
+	err(1, "(standard output)");
+      offset += nwritten;
+    }
+}
+
+static size_t
+str_to_size (const char *s)
+{
+  unsigned long ulval;
+  size_t size;
+  char *suffix;
+  uint_fast32_t unit;
+
+  errno = 0;
+  ulval = strtoul(s, &suffix, 0);
+  if (errno)
+    err(2, "Invalid size `%s'", s);
+  else if (suffix == s)
+    errx(2, "Invalid number in `%s'", s);
+  unit = 1;
+  if (!*suffix)
+    ;
+  else if (!strcmp(suffix, "K"))
+    unit = 1024;
+  else if (!strcmp(suffix, "M"))
+    unit = 1024 * 1024;
+  else if (!strcmp(suffix, "G"))
+    unit = 1024 * 1024 * 1024;
+  else
+    errx(2, "Unknown suffix `%s' in `%s'", suffix, s);
+  if (__builtin_mul_overflow(ulval, unit, &size))
+    errx(2, "Size argument `%s' overflow", s);
+  return size;
+}
+
+static void *
+read_input (const char *const filename, size_t *const sizep)
+{
+  FILE *const fp = strcmp(filename, "-") ? fopen(filename, "rb") : stdin;
+  char *buf = NULL;
+  size_t size = 0, alloc = 0;
+
+  if (!fp)
+    err(1, "%s", filename);
+  for (;;)
+    {
+      if (size == alloc)
+	{
+	  alloc = alloc ? alloc * 2 : 1 << 20;
+	  if (!(buf = realloc(buf, alloc)))
+	    errx(1, "Memory exhausted");
+	}
+
+      size_t const nread = fread(buf + size, 1, alloc - size, fp);
+
+      size += nread;
+      if (nread == 0)
+	break;
+    }
+  if (ferror(fp))
+    err(1, "%s", filename);
+  if (fp != stdin)
+    fclose(fp);
+  *sizep = size;
+  return buf;
+}
+
+/* Decompress INBUF[0..INSIZE) into a new buffer of exact size. */
+static uint8_t *
+decompress (const char *const filename, const void *const inbuf,
+	    size_t const insize, size_t *const outsizep, unsigned int threads)
+{
+  size_t scansize = insize, nchunks = 0, outtotal, outsize;
+  enum uncompress_status status
+    = uncompress_lzma2_scan(inbuf, &scansize, NULL, &nchunks, &outtotal);
+  uint8_t *outbuf;
+
+  if (status != UNCOMPRESS_OK && status != UNCOMPRESS_OUTLIMIT)
+    errx(1, "%s: Broken chunk headers", filename);
+  if (!(outbuf = malloc(outtotal ? outtotal : 1)))
+    errx(1, "Memory exhausted");
+
+  size_t consumed = insize;
+  outsize = outtotal;
+  status = uncompress_lzma2_mt(inbuf, &consumed, outbuf, &outsize, threads);
+  if (status != UNCOMPRESS_OK)
+    errx(1, "%s: Decompression failed (%d)", filename, (int) status);
+  if (verbosity > 0)
+    dbg_printf("%s: %zu chunks, %zu -> %zu bytes", filename, nchunks,
+	       consumed, outsize);
+  *outsizep = outsize;
+  return outbuf;
+}
+
+/* Write the .xz Stream of the compressed segments. */
+static void
+write_xz (const struct job *const job)
+{
+  lzma_stream_flags flags = { .version = 0, .check = LZMA_CHECK_CRC64 };
+  uint8_t header[LZMA_STREAM_HEADER_SIZE];
+  lzma_index *const index = lzma_index_init(NULL);
+  uint8_t *buf;
+  size_t size = 0;
+
+  if (!index || lzma_stream_header_encode(&flags, header) != LZMA_OK)
+    errx(1, "Cannot make .xz Stream Header");
+  write_all(header, sizeof(header));
+  for (size_t i = 0; i < job->nsegments; i++)
+    {
+      const struct segment *const seg = &job->segments[i];
+
+      if (lzma_index_append(index, NULL, seg->unpadded_size,
+			    seg->in_size) != LZMA_OK)
+	errx(1, "Cannot index Block %zu", i);
+      write_all(seg->out, seg->out_size);
+    }
+
+  flags.backward_size = lzma_index_size(index);
+  if (!(buf = malloc(flags.backward_size)) ||
+      lzma_index_buffer_encode(index, buf, &size,
+			       flags.backward_size) != LZMA_OK ||
+      lzma_stream_footer_encode(&flags, header) != LZMA_OK)
+    errx(1, "Cannot make .xz Index");
+  write_all(buf, size);
+  write_all(header, sizeof(header));
+  free(buf);
+  lzma_index_end(index, NULL);
+}
+
+/* Write the chunk table of the raw stream OUT[0..SIZE) to FILENAME. */
+static void
+write_index (const char *const filename, const uint8_t *const out,
+	     size_t const size)
+{
+  size_t scansize = size, nchunks = 0, outtotal;
+  struct uncompress_lzma2_chunk *chunks;
+  FILE *fp;
+  enum uncompress_status const status
+    = uncompress_lzma2_scan(out, &scansize, NULL, &nchunks, &outtotal);
+
+  /* Counting succeeds only for a stream without chunks (an empty
+     table); otherwise it runs out of the (empty) array. */
+  if (!(status == UNCOMPRESS_OUTLIMIT ||
+	(status == UNCOMPRESS_OK && nchunks == 0)) ||
+      !(chunks = malloc(sizeof(*chunks) * (nchunks ? nchunks : 1))))
+    errx(1, "Cannot scan output");
+  uncompress_lzma2_scan(out, &scansize, chunks, &nchunks, &outtotal);
+
+  if (!(fp = fopen(filename, "w")))
+    err(1, "%s", filename);
+  for (size_t i = 0; i < nchunks; i++)
+    {
+      static const char *const resets[] =
+	{ "none", "state", "props", "dict" };
+
+      fprintf(fp, "%zu\t%zu+%zu\t%zu+%zu\t%s\t%s",
+	      i, chunks[i].in_offset, chunks[i].in_size,
+	      chunks[i].out_offset, chunks[i].out_size,
+	      (chunks[i].type == UNCOMPRESS_LZMA2_CHUNK_LZMA ?
+	       "lzma" : "stored"),
+	      resets[chunks[i].reset]);
+      if (chunks[i].type == UNCOMPRESS_LZMA2_CHUNK_LZMA)
+	fprintf(fp, "\tlc=%u,lp=%u,pb=%u",
+		chunks[i].lc, chunks[i].lp, chunks[i].pb);
+      putc('\n', fp);
+    }
+  if (fclose(fp))
+    err(1, "%s", filename);
+  free(chunks);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int optc;
+  const char *filename;
+  const char *index_name = NULL;
+  size_t segment_size = 8 << 20;
+  unsigned int threads = 1;
+  struct job job = { .preset = 6 };
+
+  while ((optc = getopt(argc, argv, "i:j:p:s:vx")) >= 0)
+    switch (optc)
+      {
+      case 'i':
+	index_name = optarg;
+	break;
+      case 'j':
+      case 'p':
+	{
+	  char *end;
+
+	  errno = 0;
+	  unsigned long const ulval = strtoul(optarg, &end, 0);
+	  if (errno || end == optarg || *end || ulval != (unsigned int) ulval)
+	    errx(2, "Invalid number `%s'", optarg);
+	  if (optc == 'j')
+	    threads = ulval;
+	  else if (ulval > 9)
+	    errx(2, "Invalid preset `%s'", optarg);
+	  else
+	    job.preset = ulval;
+	}
+	break;
+      case 's':
+	if (!(segment_size = str_to_size(optarg)))
+	  errx(2, "Invalid segment size");
+	break;
+      case 'v':
+	verbosity++;
+	break;
+      case 'x':
+	job.xz = 1;
+	break;
+      default:
+	errx(2, "usage: %s [-v] [-x] [-j THREADS] [-p PRESET] [-s SEGMENT-SIZE]\n\t[-i INDEX-FILE] [FILE]",
+	     argv[0]);
+	return 2;
+      }
+
+  if (optind >= argc)
+    filename = "-";
+  else if (optind + 1 == argc)
+    filename = argv[optind];
+  else
+    errx(2, "Too many arguments");
+  if (index_name && job.xz)
+    errx(2, "-i is for raw output (.xz files have their own Index)");
+  if (isatty(STDOUT_FILENO))
+    errx(2, "Compressed data not written to a terminal");
+
+  if (threads == 0)
+    {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = n > 0 ? n : 1;
+    }
+
+  size_t insize, size;
+  void *const inbuf = read_input(filename, &insize);
+  uint8_t *const data = decompress(filename, inbuf, insize, &size, threads);
+
+  free(inbuf);
+
+  /* An empty input is still one (empty) segment. */
+  job.data = data;
+  job.nsegments = size ? (size - 1) / segment_size + 1 : 1;
+  if (!(job.segments = calloc(job.nsegments, sizeof(*job.segments))))
+    errx(1, "Memory exhausted");
+  for (size_t i = 0; i < job.nsegments; i++)
+    {
+      job.segments[i].in_offset = i * segment_size;
+      job.segments[i].in_size = (size - job.segments[i].in_offset
+				 < segment_size ?
+				 size - job.segments[i].in_offset :
+				 segment_size);
+    }
+
+  pthread_t *const tids = malloc(sizeof(*tids) * threads);
+  unsigned int started = 0;
+
+  if (!tids)
+    errx(1, "Memory exhausted");
+  while (started + 1 < threads && started + 1 < job.nsegments &&
+	 pthread_create(&tids[started], NULL, compressor, &job) == 0)
+    started++;
+  compressor(&job);
+  for (unsigned int i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+  free(tids);
+
+  size_t outtotal = 0;
+  for (size_t i = 0; i < job.nsegments; i++)
+    {
+      if (job.segments[i].status != LZMA_OK)
+	errx(1, "Compression of segment %zu failed (liblzma error %d)",
+	     i, (int) job.segments[i].status);
+      outtotal += job.segments[i].out_size;
+      if (verbosity > 0)
+	dbg_printf("Segment %zu: %zu -> %zu bytes", i,
+		   job.segments[i].in_size, job.segments[i].out_size);
+    }
+
+  if (job.xz)
+    write_xz(&job);
+  else
+    {
+      /* Gathered for the chunk table; the end marker follows
+	 the last segment. */
+      uint8_t *const out = malloc(outtotal + 1);
+      size_t pos = 0;
+
+      if (!out)
+	errx(1, "Memory exhausted");
+      for (size_t i = 0; i < job.nsegments; i++)
+	{
+	  memcpy(&out[pos], job.segments[i].out, job.segments[i].out_size);
+	  pos += job.segments[i].out_size;
+	}
+      out[pos++] = 0x00;
+      write_all(out, pos);
+      if (index_name)
+	write_index(index_name, out, pos);
+      free(out);
+    }
+  if (verbosity > 0)
+    dbg_printf("%zu segments, %zu -> %zu bytes", job.nsegments, size,
+	       outtotal);
+
+  for (size_t i = 0; i < job.nsegments; i++)
+    free(job.segments[i].out);
+  free(job.segments);
+  free(data);
+  return 0;
+}
@@ -0,0 +1,343 @@
+#! /bin/sh
+#
+# Regression test matrix for LZMA2 simplified decompressor
+#
+# Copyright 2020 TAKAI Kousuke
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# SPDX-License-Identifier: Apache-2.0
+
+#
+# test-matrix.sh [-u] [-n] [-r RUNS] [-t THRESHOLD]
+#	builds the decoder in each configuration of BUILDS (in
+#	$MATRIX_DIR/build-*), and with each instruction set variant of
+#	ISAS the CPU supports, decodes a generated corpus (raw LZMA2 with
+#	several presets and lc/lp/pb, and .xz with checks and filters) in
+#	each mode of test-unlzma2 (single call with and without slack,
+#	streaming, threads, resumed after OUTLIMIT, gathered, validated).
+#	The output must be identical to the original data, which must
+#	also be what xz restores.  A corrupt check of each type must be
+#	reported, for a single file and in batch mode.  rechunk-lzma2 output must decode to its
+#	input and list the chunks as test-unlzma2 -l does.
+#	Truncated and corrupted streams must give the library status (and
+#	the partial output of a single call) listed in EXPECTED with every
+#	build, variant and mode.  If the corpus differs from the one
+#	EXPECTED was made for (by another version of xz), they are only
+#	compared with the first build and variant.
+#
+#	Then the throughput of each build and variant (median MB/s of
+#	bench-unlzma2 -r RUNS) is compared with BASELINE, and drops of more
+#	than THRESHOLD percent (10 by default) fail; -n skips the comparison.
+#	BASELINE is written only by -u (update), which should be run on
+#	a reference tree (e.g. a checkout of the parent commit, with
+#	BASELINE pointing outside it); without BASELINE the comparison is
+#	skipped.
+#
+# Exits with 1 if anything fails.
+#
+
+MAKE=${MAKE:-make}
+XZ=${XZ:-xz}
+MATRIX_DIR=${MATRIX_DIR:-matrix}
+BASELINE=${BASELINE:-test-matrix.baseline}
+EXPECTED=${EXPECTED:-test-matrix.expected}
+# Builds (comma-separated make variables; "default" for none)
+BUILDS=${BUILDS:-"default RC64=1 PROBS_GROUPED=1 RC64=1,PROBS_GROUPED=1"}
+ISAS=${ISAS:-"baseline bmi2 avx2"}
+CORPUS_SIZE=${CORPUS_SIZE:-1048576}
+KINDS="text binary random repeat"
+LZMA2_OPTIONS="preset=0 preset=6 preset=9e lc=0,lp=2,pb=2 lc=4,lp=0,pb=0
+	lc=1,lp=3,pb=4"
+
+update=0
+perf=1
+runs=5
+threshold=10
+while getopts 'nr:t:u' opt; do
+  case $opt in
+  n) perf=0 ;;
+  r) runs=$OPTARG ;;
+  t) threshold=$OPTARG ;;
+  u) update=1 ;;
+  *) echo "usage: $0 [-u] [-n] [-r RUNS] [-t THRESHOLD]" >&2; exit 2 ;;
+  esac
+done
+
+failures=0
+fail () {
+  echo "FAIL: $*"
+  failures=$((failures + 1))
+}
+
+mkdir -p "$MATRIX_DIR/corpus" || exit 1
+
+# Build each configuration from a copy of the sources.
+for build in $BUILDS; do
+  dir=$MATRIX_DIR/build-$build
+  mkdir -p "$dir" &&
+  cp -p ./*.c ./*.h Makefile "$dir" &&
+  $MAKE -s -C "$dir" $(test "$build" = default || echo "$build" | tr , ' ') \
+    test-unlzma2 bench-unlzma2 ||
+    { echo "Build $build failed" >&2; exit 1; }
+done
+set -- $BUILDS
+ref_build=$MATRIX_DIR/build-$1
+
+# Corpus: originals, raw LZMA2 streams, a stream of two segments
+# (dictionary reset in the middle) and .xz files
+corpus=$MATRIX_DIR/corpus
+for kind in $KINDS; do
+  test -f "$corpus/$kind" ||
+    "$ref_build/bench-unlzma2" -g $kind -n $CORPUS_SIZE > "$corpus/$kind" ||
+    exit 1
+  for o in $LZMA2_OPTIONS; do
+    f=$corpus/$kind.$o.lz
+    test -f "$f" ||
+      $XZ -F raw --lzma2=$o -c "$corpus/$kind" > "$f" 2>/dev/null || exit 1
+  done
+done
+f=$corpus/text+binary
+if ! test -f "$f.lz"; then
+  cat "$corpus/text" "$corpus/binary" > "$f" &&
+  { head -c -1 "$corpus/text.preset=6.lz"; cat "$corpus/binary.preset=6.lz"; } \
+    > "$f.lz" || exit 1
+fi
+# NAME:CHECK:FILTER (filtered Blocks are decoded by other paths); only
+# crc32 is unfiltered.  Filters this xz does not know are skipped.
+for x in crc32:crc32: x86:crc64:--x86 delta:sha256:--delta=dist=4 \
+	 powerpc:crc64:--powerpc arm:crc32:--arm armthumb:crc64:--armthumb \
+	 sparc:crc32:--sparc arm64:crc64:--arm64; do
+  f=$corpus/binary.${x%%:*}.xz
+  x=${x#*:}
+  test -f "$f" ||
+    $XZ -F xz -T1 -C ${x%%:*} ${x#*:} --lzma2=preset=6 -c "$corpus/binary" \
+      > "$f" 2>/dev/null ||
+    { echo "skip: ${x#*:} (not supported by $XZ)"; rm -f "$f"; }
+done
+
+# What each compressed file decodes to
+original () {
+  base=${1%.lz}
+  base=${base%.xz}
+  case $base in
+  */text+binary) echo "$base" ;;
+  *) echo "${base%%.*}" ;;
+  esac
+}
+
+for f in "$corpus"/*.lz "$corpus"/*.xz; do
+  case $f in
+  *.lz) $XZ -F raw -dc "$f" ;;
+  *) $XZ -dc "$f" ;;
+  esac 2>/dev/null | cmp -s - "$(original "$f")" ||
+    fail "xz does not restore $f"
+done
+
+# Library status reported by test-unlzma2 -v (of the last call)
+status () {
+  sed -n 's/^uncompress_lzma2.* = [0-9]* (\([A-Z_]*\))$/\1/p' | tail -n 1
+}
+
+# Copy file $1 with all bits of the byte at $2 flipped
+flip () {
+  b=$(head -c $(($2 + 1)) "$1" | tail -c 1 | od -An -tu1)
+  head -c $2 "$1"
+  printf "\\$(printf %o $((255 - b)))"
+  tail -c +$(($2 + 2)) "$1"
+}
+
+# Malformed streams: truncated, and with a byte changed
+bad=$MATRIX_DIR/bad
+mkdir -p "$bad" || exit 1
+src=$corpus/text.preset=6.lz
+size=$(wc -c < "$src")
+for n in 1 5 6 100 $((size / 2)) $((size - 1)); do
+  head -c $n "$src" > "$bad/trunc-$n.lz"
+done
+for pos in 0 1 3 5 6 7 64 1000 $((size / 3)) $((size - 2)); do
+  flip "$src" $pos > "$bad/flip-$pos.lz"
+done
+# .xz files of each check type with the last byte of the check of their
+# Block (just before the Index, whose size is in the Stream Footer)
+# flipped: NAME:CHECK
+badcheck=$MATRIX_DIR/badcheck
+mkdir -p "$badcheck" || exit 1
+badchecks="crc32:CRC32 x86:CRC64 delta:SHA-256"
+for x in $badchecks; do
+  f=$corpus/binary.${x%%:*}.xz
+  set -- $(tail -c 8 "$f" | head -c 4 | od -An -tu1)
+  index_size=$((($1 + $2 * 256 + $3 * 65536 + $4 * 16777216 + 1) * 4))
+  flip "$f" $(($(wc -c < "$f") - 12 - index_size - 1)) \
+    > "$badcheck/${x%%:*}.xz"
+done
+# The output buffer of a single call is larger than the data, so that
+# a truncated stream gives INLIMIT as other modes do.
+bufsize=$((CORPUS_SIZE * 2))
+# Without EXPECTED for this corpus, the first combination makes it.
+expected=$MATRIX_DIR/expected
+make_expected=0
+if test "$(sed -n 's/^source //p' "$EXPECTED" 2>/dev/null)" = \
+    "$(cksum < "$src")"; then
+  grep -v '^#' "$EXPECTED" > "$expected"
+else
+  echo "skip: $EXPECTED (made from another $src)"
+  make_expected=1
+  : > "$expected"
+fi
+
+combos=
+for build in $BUILDS; do
+  t=$MATRIX_DIR/build-$build/test-unlzma2
+  for isa in $ISAS; do
+    # Skip variants the CPU does not support (another one is chosen).
+    chosen=$(UNCOMPRESS_LZMA2_ISA=$isa "$t" -v -t "$src" 2>&1 >/dev/null |
+	     sed -n 's/^Decoder variant: //p')
+    if test "$chosen" != "$isa"; then
+      echo "skip: $build/$isa (not supported)"
+      continue
+    fi
+    combos="$combos $build/$isa"
+  done
+done
+
+set -- $combos
+first=$1
+for combo in $combos; do
+  build=${combo%/*}
+  isa=${combo#*/}
+  t=$MATRIX_DIR/build-$build/test-unlzma2
+  echo "decode: $combo"
+  for f in "$corpus"/*.lz "$corpus"/*.xz; do
+    orig=$(original "$f")
+    case $f in
+    *.lz | *.crc32.xz) modes="- -S -s4097 -j2 -R,-b1000 -g" ;;
+    *) modes="- -j2" ;;
+    esac
+    for m in $modes; do
+      args=$(test "$m" = - || echo "$m" | tr , ' ')
+      UNCOMPRESS_LZMA2_ISA=$isa "$t" $args "$f" 2>/dev/null |
+	cmp -s - "$orig" || fail "$combo $m $f"
+    done
+    case $f in
+    *.lz | *.crc32.xz)
+      UNCOMPRESS_LZMA2_ISA=$isa "$t" -t "$f" 2>/dev/null ||
+	fail "$combo -t $f" ;;
+    esac
+  done
+
+  # Check mismatches must be reported for single files, and in batch
+  # mode for each corrupt file alone.
+  for x in $badchecks; do
+    f=$badcheck/${x%%:*}.xz
+    UNCOMPRESS_LZMA2_ISA=$isa "$t" "$f" 2>&1 > /dev/null |
+      grep -q "${x#*:} mismatch" || fail "$combo $f: no ${x#*:} mismatch"
+  done
+  rm -rf "$badcheck/batch"
+  mkdir "$badcheck/batch" &&
+  cp "$badcheck"/*.xz "$corpus/binary.crc32.xz" "$badcheck/batch" || exit 1
+  UNCOMPRESS_LZMA2_ISA=$isa "$t" -j2 "$badcheck/batch"/*.xz \
+    > "$MATRIX_DIR/out" 2>/dev/null && fail "$combo -j2 $badcheck: no failure"
+  for x in $badchecks; do
+    grep -q "^$badcheck/batch/${x%%:*}\.xz	Block 0: ${x#*:} mismatch	" \
+      "$MATRIX_DIR/out" || fail "$combo -j2 ${x%%:*}.xz: no ${x#*:} mismatch"
+  done
+  grep -q "^$badcheck/batch/binary\.crc32\.xz	OK	" "$MATRIX_DIR/out" ||
+    fail "$combo -j2 binary.crc32.xz: not OK with corrupt ones"
+
+  for f in "$bad"/*.lz; do
+    name=${f##*/}
+    s=$(UNCOMPRESS_LZMA2_ISA=$isa "$t" -v -r -b $bufsize "$f" \
+	  2>&1 > "$MATRIX_DIR/out" | status)
+    res="$s $(cksum < "$MATRIX_DIR/out")"
+    test $make_expected = 0 || test "$combo" != "$first" ||
+      echo "$name $res" >> "$expected"
+    ref=$(awk -v name="$name" '$1 == name { $1 = ""; print substr($0, 2) }' \
+	    "$expected")
+    test "$res" = "$ref" ||
+      fail "$combo $name: $res (expected ${ref:-nothing})"
+    for m in -S,-b,$bufsize -s4097 -R,-b1000 -t; do
+      s=$(UNCOMPRESS_LZMA2_ISA=$isa "$t" -v -r $(echo "$m" | tr , ' ') \
+	    "$f" 2>&1 > /dev/null | status)
+      test "$s" = "${ref%% *}" ||
+	fail "$combo $m $name: status ${s:-none} (expected ${ref%% *})"
+    done
+  done
+done
+
+# rechunk-lzma2 (if liblzma is available): segments of 1 MiB, each
+# starting with a dictionary reset, must decode with threads to the
+# same data, and the chunk table of -i must be what test-unlzma2 -l
+# lists; also for an empty stream (only the end marker).
+if $MAKE -s -C "$ref_build" rechunk-lzma2 > /dev/null 2>&1; then
+  echo "rechunk: $ref_build"
+  printf '\0' > "$MATRIX_DIR/empty.lz"
+  for x in "$corpus/text+binary.lz:$corpus/text+binary" \
+	   "$MATRIX_DIR/empty.lz:/dev/null"; do
+    f=${x%%:*}
+    orig=${x#*:}
+    out=$MATRIX_DIR/rechunked.lz
+    "$ref_build/rechunk-lzma2" -s 1M -i "$MATRIX_DIR/rechunked.idx" "$f" \
+      > "$out" 2>/dev/null || { fail "rechunk-lzma2 $f"; continue; }
+    "$ref_build/test-unlzma2" -r -j2 "$out" 2>/dev/null | cmp -s - "$orig" ||
+      fail "rechunk-lzma2 $f: output does not decode to $orig"
+    "$ref_build/test-unlzma2" -r -l "$out" 2>/dev/null |
+      cmp -s - "$MATRIX_DIR/rechunked.idx" ||
+      fail "rechunk-lzma2 $f: -i table differs from test-unlzma2 -l"
+    test "$orig" = /dev/null ||
+      test $(grep -c '	dict	' "$MATRIX_DIR/rechunked.idx") -ge 2 ||
+      fail "rechunk-lzma2 $f: fewer than 2 segments"
+  done
+else
+  echo "skip: rechunk-lzma2 (cannot build; needs liblzma)"
+fi
+
+# Throughput against the baseline
+if test $perf = 1 && test $update = 0 && ! test -f "$BASELINE"; then
+  echo "skip: throughput (no $BASELINE; make one with -u on a reference tree)"
+  perf=0
+fi
+if test $perf = 1; then
+  : > "$MATRIX_DIR/perf"
+  for combo in $combos; do
+    build=${combo%/*}
+    isa=${combo#*/}
+    echo "bench: $combo"
+    UNCOMPRESS_LZMA2_ISA=$isa "$MATRIX_DIR/build-$build/bench-unlzma2" \
+      -r $runs "$corpus"/*.lz |
+      awk -v combo=$combo '!/^#/ { n = split($1, p, "/");
+			      print combo "\t" p[n] "\t" $6 }' \
+      >> "$MATRIX_DIR/perf"
+  done
+  if test $update = 1; then
+    cp "$MATRIX_DIR/perf" "$BASELINE"
+    echo "baseline: written to $BASELINE"
+  else
+    regressions=$(awk -F '\t' -v threshold=$threshold '
+      NR == FNR { base[$1 "\t" $2] = $3; next }
+      ($1 "\t" $2) in base && $3 < base[$1 "\t" $2] * (1 - threshold / 100) {
+	printf "%s %s: %.1f MB/s (baseline %.1f)\n", $1, $2, $3,
+	  base[$1 "\t" $2]
+      }' "$BASELINE" "$MATRIX_DIR/perf")
+    if test -n "$regressions"; then
+      echo "$regressions" | sed 's/^/FAIL: slower: /'
+      failures=$((failures + $(echo "$regressions" | wc -l)))
+    fi
+  fi
+fi
+
+if test $failures -gt 0; then
+  echo "$failures failures"
+  exit 1
+fi
+echo "All tests passed"
@@ -0,0 +1,217 @@
+/*
+ * Test of the C++ interface of LZMA2 simplified decompressor
+ *
+ * Copyright 2020 TAKAI Kousuke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * test-unlzma2-cxx FILE < RAW-LZMA2
+ *	decodes raw LZMA2 stream from the standard input, which must be
+ *	FILE compressed, with each interface of uncompress_lzma2.hpp
+ *	(lzma2::decoder into a given span and into a buffer, and
+ *	lzma2::stream::chunks() with small and large buffers), and checks
+ *	errors: truncated and corrupt input, too small output and empty
+ *	buffers.  Prints what fails and exits with 1 if anything does.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory_resource>
+#include <vector>
+
+#include "uncompress_lzma2.hpp"
+
+namespace
+{
+  int failures;
+
+  void
+  check (bool const ok, char const *const what)
+  {
+    if (!ok)
+      {
+	std::cout << "FAIL: " << what << '\n';
+	failures++;
+      }
+  }
+
+  std::vector<std::byte>
+  read_all (std::istream &in)
+  {
+    std::vector<char> const chars((std::istreambuf_iterator<char>(in)),
+				  std::istreambuf_iterator<char>());
+    std::vector<std::byte> bytes(chars.size());
+
+    if (!chars.empty())
+      std::memcpy(bytes.data(), chars.data(), chars.size());
+    return bytes;
+  }
+
+  bool
+  same (std::span<const std::byte> const a, std::span<const std::byte> const b)
+  {
+    return (a.size() == b.size() &&
+	    (a.empty() || std::memcmp(a.data(), b.data(), a.size()) == 0));
+  }
+
+  /* Whole output of S.chunks(IN, BUF), or the status of the error
+     thrown into *CODE */
+  std::vector<std::byte>
+  collect (lzma2::stream &s, std::span<const std::byte> const in,
+	   std::span<std::byte> const buf, lzma2::status *const code)
+  {
+    std::vector<std::byte> out;
+
+    *code = lzma2::status::ok;
+    s.reset();
+    try
+      {
+	for (std::span<const std::byte> const chunk : s.chunks(in, buf))
+	  out.insert(out.end(), chunk.begin(), chunk.end());
+      }
+    catch (lzma2::error const &e)
+      {
+	*code = e.code();
+      }
+    return out;
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  if (argc != 2)
+    {
+      std::cerr << "usage: " << argv[0] << " FILE < RAW-LZMA2\n";
+      return 2;
+    }
+
+  std::ifstream file(argv[1], std::ios::binary);
+  if (!file)
+    {
+      std::perror(argv[1]);
+      return 1;
+    }
+
+  std::vector<std::byte> const original = read_all(file);
+  std::vector<std::byte> const in = read_all(std::cin);
+  std::span<const std::byte> const whole(in);
+  std::pmr::monotonic_buffer_resource pool;
+  lzma2::decoder dec(&pool);
+
+  /* lzma2::decoder */
+  check(lzma2::decompressed_size(whole) == original.size(),
+	"decompressed_size()");
+  {
+    lzma2::buffer const out = dec.decode(whole);
+
+    check(same(out.span(), original), "decode() into a buffer");
+    check(out.capacity() >= out.size(), "buffer capacity");
+  }
+  {
+    std::vector<std::byte> out(original.size() + 64, std::byte(0xA5));
+    lzma2::result const r = dec.decode(whole, out);
+    bool untouched = true;
+
+    for (std::size_t i = original.size(); i < out.size(); i++)
+      untouched = untouched && out[i] == std::byte(0xA5);
+    check(r && r.in_size == in.size(), "decode() into a span");
+    check(same(std::span(out).first(r.out_size), original),
+	  "decode() into a span: data");
+    check(untouched, "decode() into a span: bytes after the data");
+  }
+  if (!original.empty())
+    {
+      std::vector<std::byte> out(original.size() - 1);
+
+      check(dec.decode(whole, out).code == lzma2::status::outlimit,
+	    "decode() into a too small span");
+    }
+  if (in.size() > 1)
+    {
+      std::vector<std::byte> out(original.size());
+
+      check(dec.decode(whole.first(in.size() - 1), out).code
+	    == lzma2::status::inlimit, "decode() of truncated input");
+    }
+  {
+    /* A stored chunk (with a dictionary reset) of 3 bytes */
+    static std::byte const stored[] =
+      {
+	std::byte(0x01), std::byte(0x00), std::byte(0x02),
+	std::byte('a'), std::byte('b'), std::byte('c'), std::byte(0x00),
+      };
+    lzma2::buffer const out = dec.decode(stored);
+
+    check(out.size() == 3 && std::memcmp(out.data(), "abc", 3) == 0,
+	  "decode() of a stored chunk");
+
+    std::vector<std::byte> corrupt(std::begin(stored), std::end(stored));
+    corrupt[0] = std::byte(0x03);
+    try
+      {
+	dec.decode(corrupt);
+	check(false, "decode() of corrupt input throws");
+      }
+    catch (lzma2::error const &e)
+      {
+	check(e.code() == lzma2::status::data_error,
+	      "decode() of corrupt input throws data_error");
+      }
+  }
+
+  /* lzma2::stream */
+  lzma2::stream s(1 << 20);
+  lzma2::status code;
+
+  for (std::size_t const size : { std::size_t(1), std::size_t(4097),
+				  std::size_t(1) << 20 })
+    {
+      std::vector<std::byte> buf(size);
+
+      check(same(collect(s, whole, buf, &code), original) &&
+	    code == lzma2::status::ok, "stream::chunks()");
+    }
+  if (in.size() > 1)
+    {
+      std::vector<std::byte> buf(4096);
+
+      collect(s, whole.first(in.size() - 1), buf, &code);
+      check(code == lzma2::status::inlimit,
+	    "stream::chunks() of truncated input throws inlimit");
+    }
+  try
+    {
+      s.reset();
+      s.chunks(whole, std::span<std::byte>());
+      check(false, "stream::chunks() with an empty buffer throws");
+    }
+  catch (std::invalid_argument const &)
+    {
+    }
+
+  if (failures)
+    {
+      std::cout << failures << " failures\n";
+      return 1;
+    }
+  std::cout << "All tests passed\n";
+  return 0;
+}
@@ -25,13 +25,30 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <limits.h>
 #include <inttypes.h>
 #include <ctype.h>
 #include <errno.h>
 #include <err.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <sys/syscall.h>
+#  include <sys/eventfd.h>
+#  include <linux/io_uring.h>
+#  ifdef __NR_io_uring_setup
+#   define HAVE_IO_URING 1
+#  endif
+# endif
+#endif
 
 #include "uncompress_lzma2.h"
+#include "check.h"
+#include "filter.h"
 
 int verbosity;
 
@@ -63,7 +80,9 @@ str_to_size (const char *s)
   while (*(unsigned char *) suffix && isspace(*(unsigned char *) suffix))
     suffix++;
   unit = 1;
-  if (!strcmp(suffix, "K"))
+  if (!*suffix)
+    ;
+  else if (!strcmp(suffix, "K"))
     unit = 1024;
   else if (!strcmp(suffix, "M"))
     unit = 1024 * 1024;
@@ -76,46 +95,1748 @@ str_to_size (const char *s)
   return size;
 }
 
+/* Output file (-O), or the standard output */
+static int output_fd = STDOUT_FILENO;
+static const char *output_name = "(standard output)";
+static _Bool output_hugepage;		/* -H */
+static int output_mmap_flags;		/* MAP_POPULATE with -P */
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Page faults of the process so far */
+static long
+page_faults (void)
+{
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return 0;
+  return ru.ru_minflt + ru.ru_majflt;
+}
+
+static void
+write_all (const void *const buf, size_t const size)
+{
+  for (size_t offset = 0; offset < size; )
+    {
+      ssize_t nwritten
+	= write(output_fd, (const char *) buf + offset, size - offset);
+      if (nwritten < 0)
+	err(1, "%s", output_name);
+      offset += nwritten;
+    }
+}
+
+/* Size of explicit huge pages tried for -H */
+#define HUGE_PAGE_SIZE	(2 << 20)
+
+/*
+ * Map an output buffer of SIZE bytes.  With -O and FILE, it is
+ * a shared mapping of the output file (extended to SIZE bytes),
+ * so that the output is decompressed directly into the page cache.
+ * With -H, an anonymous buffer is taken from the reserved huge pages
+ * (MAP_HUGETLB) if there are enough of them, or else is advised to
+ * be backed by transparent huge pages.
+ */
+static void *
+map_output (size_t size, _Bool const file)
+{
+  void *buf = MAP_FAILED;
+  const char *pages = "normal";
+  double const start = now();
+  long const faults = page_faults();
+
+  /* mmap(2) does not accept zero length */
+  if (size == 0)
+    size = 1;
+  if (file && output_fd != STDOUT_FILENO)
+    {
+      if (ftruncate(output_fd, size) < 0)
+	err(1, "%s", output_name);
+      buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | output_mmap_flags, output_fd, 0);
+    }
+  else
+    {
+#ifdef MAP_HUGETLB
+      if (output_hugepage && size <= SIZE_MAX - HUGE_PAGE_SIZE)
+	{
+	  buf = mmap(NULL, (size + HUGE_PAGE_SIZE - 1) & -HUGE_PAGE_SIZE,
+		     PROT_READ | PROT_WRITE,
+		     (MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+		      output_mmap_flags), -1, 0);
+	  pages = "explicit huge";
+	}
+#endif
+      if (buf == MAP_FAILED)
+	{
+	  buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | output_mmap_flags, -1, 0);
+	  pages = "normal";
+	}
+    }
+  if (buf == MAP_FAILED)
+    err(1, "mmap");
+#ifdef MADV_HUGEPAGE
+  if (output_hugepage && strcmp(pages, "normal") == 0)
+    {
+      if (madvise(buf, size, MADV_HUGEPAGE) < 0)
+	warn("madvise");
+      else
+	pages = "transparent huge";
+    }
+#endif
+  if (verbosity > 0)
+    dbg_printf("Output buffer: %zu bytes of %s pages mapped in %.3f ms (%ld page faults)",
+	       size, pages, (now() - start) * 1e3, page_faults() - faults);
+  return buf;
+}
+
+/* Output the first SIZE bytes of BUF from map_output(SIZE, FILE). */
+static void
+write_mapped (const void *const buf, size_t const size, _Bool const file)
+{
+  if (file && output_fd != STDOUT_FILENO)
+    {
+      /* Already in place; cut off the rest */
+      if (ftruncate(output_fd, size) < 0)
+	err(1, "%s", output_name);
+    }
+  else
+    write_all(buf, size);
+}
+
+/* Number of output segments for -g (the decoder copies stored chunks
+   as usual once they are used up) */
+#define GATHER_SEGMENTS	4096
+
+#ifndef IOV_MAX
+# define IOV_MAX	16	/* _XOPEN_IOV_MAX, the minimum for POSIX */
+#endif
+
+/* Write SEGS[0..NSEGS) to the standard output with writev(2). */
+static void
+write_segments (const struct uncompress_lzma2_segment *const segs,
+		size_t const nsegs)
+{
+  struct iovec iov[IOV_MAX];
+
+  for (size_t i = 0; i < nsegs; )
+    {
+      size_t niov = 0;
+
+      for (; niov < IOV_MAX && i + niov < nsegs; niov++)
+	{
+	  iov[niov].iov_base = (void *) segs[i + niov].data;
+	  iov[niov].iov_len = segs[i + niov].size;
+	}
+
+      ssize_t nwritten = writev(output_fd, iov, niov);
+      if (nwritten < 0)
+	err(1, "%s", output_name);
+      /* Finish a short write segment by segment */
+      for (size_t j = 0; j < niov; j++)
+	if ((size_t) nwritten >= iov[j].iov_len)
+	  nwritten -= iov[j].iov_len;
+	else
+	  {
+	    write_all((const char *) iov[j].iov_base + nwritten,
+		      iov[j].iov_len - nwritten);
+	    nwritten = 0;
+	  }
+      i += niov;
+    }
+}
+
+static const char *
+status_string (enum uncompress_status const status)
+{
+  switch (status)
+    {
+    case UNCOMPRESS_OK:		return "OK";
+    case UNCOMPRESS_NO_MEMORY:	return "NO_MEMORY";
+    case UNCOMPRESS_DATA_ERROR:	return "DATA_ERROR";
+    case UNCOMPRESS_INLIMIT:	return "INLIMIT";
+    case UNCOMPRESS_OUTLIMIT:	return "OUTLIMIT";
+    default:			return "???";
+    }
+}
+
+/* Print decoder statistics (if available) at exit. */
+static void
+print_stats (void)
+{
+  struct uncompress_lzma2_stats stats = { 0 };
+
+  if (!uncompress_lzma2_get_stats(&stats, 1))
+    return;
+  dbg_printf("stats: %llu literals, %llu matched literals, %llu matches, "
+	     "reps %llu/%llu/%llu/%llu, %llu short reps, %llu normalizes",
+	     stats.literals, stats.matched_literals, stats.matches,
+	     stats.reps[0], stats.reps[1], stats.reps[2], stats.reps[3],
+	     stats.short_reps, stats.normalizes);
+  dbg_printf("stats: %llu LZMA chunks (%.1f us each), %llu stored chunks",
+	     stats.lzma_chunks,
+	     (stats.lzma_chunks ?
+	      stats.lzma_chunk_ns / 1e3 / stats.lzma_chunks : 0.0),
+	     stats.stored_chunks);
+  dbg_printf("stats: %llu far matches (%llu bytes)",
+	     stats.far_matches, stats.far_match_bytes);
+  fputs("stats: match length", stderr);
+  for (unsigned int i = 0; i < UNCOMPRESS_LZMA2_LEN_BUCKETS; i++)
+    fprintf(stderr, " %u%s:%llu", (1U << i) + 1,
+	    i + 1 < UNCOMPRESS_LZMA2_LEN_BUCKETS ? "" : "+",
+	    stats.match_len[i]);
+  fputs("\nstats: distance slot", stderr);
+  for (unsigned int i = 0; i < 64; i++)
+    if (stats.dist_slot[i])
+      fprintf(stderr, " %u:%llu", i, stats.dist_slot[i]);
+  fputc('\n', stderr);
+}
+
+static uint_fast16_t
+read_aligned_le16 (const void *const vp)
+{
+  const uint8_t *const p = __builtin_assume_aligned(vp, 2);
+  return (uint_fast16_t) p[0] | (uint_fast16_t) p[1] << 8;
+}
+
 static uint_fast32_t
-crc32 (const void *const buf, size_t size)
+read_aligned_le32 (const void *const vp)
+{
+  const uint8_t *const p = __builtin_assume_aligned(vp, 4);
+  return ((uint_fast32_t) p[0]       |
+	  (uint_fast32_t) p[1] <<  8 |
+	  (uint_fast32_t) p[2] << 16 |
+	  (uint_fast32_t) p[3] << 24);
+}
+
+#define XZ_MAGIC1	(0xFD | ('7' << 8) | ('z' << 16) | ('X' << 24))
+#define XZ_MAGIC2	('Z' | (0x00 << 8))
+#define XZ_MAGIC3	('Y' | ('Z' << 8))
+
+#define XZ_FILTER_LZMA2	0x21
+#define XZ_FILTERS_MAX	4
+
+/* Read a multibyte integer at BUF[*POSP..LIMIT) and advance *POSP. */
+static _Bool
+xz_read_varint (const uint8_t *const buf, size_t *const posp,
+		size_t const limit, uint_fast64_t *const valp)
+{
+  uint_fast64_t val = 0;
+
+  for (unsigned int i = 0; i < 9 && *posp < limit; i++)
+    {
+      uint_fast8_t const byte = buf[(*posp)++];
+
+      val |= (uint_fast64_t) (byte & 0x7F) << (i * 7);
+      if (!(byte & 0x80))
+	{
+	  /* Must be encoded in the shortest form */
+	  if (byte == 0 && i > 0)
+	    return 0;
+	  *valp = val;
+	  return 1;
+	}
+    }
+  return 0;
+}
+
+/* A Block in a .xz file */
+struct xz_block
+  {
+    size_t		in_offset, in_size;	/* LZMA2 data */
+    size_t		out_offset, out_size;
+    size_t		check_offset;
+    unsigned int	checktype;
+    size_t		dict_size;		/* Of LZMA2 */
+    /* Filters before LZMA2 (in the order applied when encoding) */
+    unsigned int	nfilters;
+    struct
+      {
+	unsigned int	id;
+	size_t		props_offset, props_size;
+      }			filters[XZ_FILTERS_MAX - 1];
+    /* Results of decoding */
+    enum uncompress_status status;
+    size_t		insize, outsize;
+    struct check	check;
+    _Bool		check_ok;
+  };
+
+/*
+ * Report that FILENAME is a .xz file not supported: store the reason
+ * (formatted from FORMAT) into ERROR[0..ERROR_SIZE) if ERROR is not
+ * NULL, or exit otherwise.
+ */
+static void __attribute__((format(printf, 4, 5)))
+xz_unsupported (char *const error, size_t const error_size,
+		const char *const filename, const char *const format, ...)
+{
+  char buf[128];
+  va_list ap;
+
+  va_start(ap, format);
+  if (error)
+    vsnprintf(error, error_size, format, ap);
+  else
+    {
+      vsnprintf(buf, sizeof(buf), format, ap);
+      errx(1, "%s: %s", filename, buf);
+    }
+  va_end(ap);
+}
+
+/*
+ * Parse the Block Header of BLOCK at BUF[BLOCK_OFFSET..) with
+ * UNPADDED_SIZE and UNCOMPRESSED_SIZE listed in the Index, and fill in
+ * the input offset and size and the filters of BLOCK.  If the filter
+ * chain is not supported, returns 0 with the reason in ERROR as
+ * xz_unsupported() does (which exits if ERROR is NULL).
+ */
+static _Bool
+xz_parse_block_header (const char *const filename,
+		       const uint8_t *const buf, size_t const block_offset,
+		       uint_fast64_t const unpadded_size,
+		       uint_fast64_t const uncompressed_size,
+		       struct xz_block *const block,
+		       char *const error, size_t const error_size)
+{
+  size_t const header_size = (buf[block_offset] + 1) * 4;
+  size_t const check_len = check_size(block->checktype);
+  size_t const limit = block_offset + header_size - 4;
+  size_t pos = block_offset + 2;
+  unsigned int const flags = buf[block_offset + 1];
+  unsigned int const nfilters = (flags & 0x03) + 1;
+  uint_fast64_t val;
+
+  if (buf[block_offset] == 0 ||
+      unpadded_size < header_size + check_len + 1 ||
+      crc32(0, &buf[block_offset], header_size - 4)
+      != read_aligned_le32(&buf[limit]) ||
+      (flags & 0x3C))
+    return 0;
+
+  block->in_offset = block_offset + header_size;
+  block->in_size = unpadded_size - header_size - check_len;
+  block->check_offset = block->in_offset + ((block->in_size + 3) & -4);
+
+  /* Compressed Size and Uncompressed Size, if present, must agree
+     with the Index. */
+  if ((flags & 0x40) &&
+      (!xz_read_varint(buf, &pos, limit, &val) || val != block->in_size))
+    return 0;
+  if ((flags & 0x80) &&
+      (!xz_read_varint(buf, &pos, limit, &val) || val != uncompressed_size))
+    return 0;
+
+  block->nfilters = nfilters - 1;
+  for (unsigned int i = 0; i < nfilters; i++)
+    {
+      uint_fast64_t id, props_size;
+      struct filter filter;
+
+      if (!xz_read_varint(buf, &pos, limit, &id) ||
+	  !xz_read_varint(buf, &pos, limit, &props_size) ||
+	  props_size > limit - pos)
+	return 0;
+      if ((i + 1 < nfilters ? !filter_name(id) : id != XZ_FILTER_LZMA2))
+	{
+	  xz_unsupported(error, error_size, filename,
+			 "Unsupported .xz file (filter %#" PRIxFAST64
+			 ", %u filters)", id, nfilters);
+	  return 0;
+	}
+      if (i + 1 < nfilters)
+	{
+	  if (!filter_init(&filter, id, &buf[pos], props_size))
+	    return 0;
+	  block->filters[i].id = id;
+	  block->filters[i].props_offset = pos;
+	  block->filters[i].props_size = props_size;
+	}
+      else if (props_size != 1 || buf[pos] > 40)
+	return 0;
+      else
+	block->dict_size = (buf[pos] == 40 ? UINT32_C(0xFFFFFFFF) :
+			    (size_t) (2 | (buf[pos] & 1)) << (buf[pos] / 2 + 11));
+      pos += props_size;
+    }
+
+  /* Header Padding */
+  while (pos < limit)
+    if (buf[pos++])
+      return 0;
+  return 1;
+}
+
+/*
+ * Parse a .xz file in BUF[0..SIZE) (one or more Streams, possibly
+ * with Stream Padding) from the end, using the Index of each Stream.
+ * Stores the array of all Blocks (malloc'ed) and their number
+ * into *BLOCKSP and *NBLOCKSP and returns 1, or returns 0 if BUF
+ * is not a complete .xz file.
+ * A complete but unsupported file exits, or if ERROR is not NULL,
+ * returns 0 with the reason in ERROR[0..ERROR_SIZE) (which is
+ * otherwise left empty).
+ */
+static _Bool
+xz_parse (const char *const filename,
+	  const uint8_t *const buf, size_t const size,
+	  struct xz_block **const blocksp, size_t *const nblocksp,
+	  char *const error, size_t const error_size)
+{
+  struct xz_block *blocks = NULL;
+  size_t nblocks = 0;
+  size_t pos = size;
+
+  if (error)
+    error[0] = '\0';
+  if (size % 4)
+    return 0;
+
+  while (pos > 0)
+    {
+      /* Stream Padding */
+      while (pos >= 4 && read_aligned_le32(&buf[pos - 4]) == 0)
+	pos -= 4;
+      if (pos == 0)
+	break;
+
+      /* Stream Footer */
+      if (pos < 12 + 12 ||
+	  read_aligned_le16(&buf[pos - 2]) != XZ_MAGIC3 ||
+	  crc32(0, &buf[pos - 8], 6) != read_aligned_le32(&buf[pos - 12]))
+	goto invalid;
+      unsigned int const stream_flags = read_aligned_le16(&buf[pos - 4]);
+      unsigned int const checktype = (stream_flags >> 8) & 0x0F;
+      size_t const index_size
+	= ((size_t) read_aligned_le32(&buf[pos - 8]) + 1) * 4;
+
+      if (index_size > pos - 12 - 12)
+	goto invalid;
+      size_t const index_offset = pos - 12 - index_size;
+      size_t const index_limit = pos - 12 - 4;
+      size_t ipos = index_offset + 1;
+      uint_fast64_t nrecords;
+
+      /* Index */
+      if (buf[index_offset] != 0 ||
+	  crc32(0, &buf[index_offset], index_size - 4)
+	  != read_aligned_le32(&buf[index_limit]) ||
+	  !xz_read_varint(buf, &ipos, index_limit, &nrecords) ||
+	  nrecords > (index_limit - ipos) / 2)
+	goto invalid;
+
+      /* Blocks of this Stream are inserted before those already found. */
+      if (nrecords > 0)
+	{
+	  if (!(blocks = realloc(blocks, sizeof(*blocks) * (nblocks + nrecords))))
+	    errx(1, "Memory exhausted");
+	  memmove(&blocks[nrecords], blocks, sizeof(*blocks) * nblocks);
+	  nblocks += nrecords;
+	}
+
+      size_t blocks_size = 0;
+      size_t i;
+
+      /* First pass: sizes of Blocks to find the Stream Header */
+      for (i = 0; i < nrecords; i++)
+	{
+	  uint_fast64_t unpadded_size, uncompressed_size;
+
+	  if (!xz_read_varint(buf, &ipos, index_limit, &unpadded_size) ||
+	      !xz_read_varint(buf, &ipos, index_limit, &uncompressed_size) ||
+	      unpadded_size == 0 || unpadded_size > index_offset ||
+	      __builtin_add_overflow(blocks_size, (unpadded_size + 3) & -4,
+				     &blocks_size) ||
+	      uncompressed_size != (size_t) uncompressed_size)
+	    goto invalid;
+	  blocks[i].out_size = uncompressed_size;
+	  blocks[i].check_offset = unpadded_size;	/* Temporarily */
+	}
+      /* Index Padding */
+      while (ipos < index_limit)
+	if (buf[ipos++])
+	  goto invalid;
+      if (blocks_size > index_offset - 12)
+	goto invalid;
+
+      /* Stream Header */
+      pos = index_offset - blocks_size - 12;
+      if (read_aligned_le32(&buf[pos]) != XZ_MAGIC1 ||
+	  read_aligned_le16(&buf[pos + 4]) != XZ_MAGIC2 ||
+	  read_aligned_le16(&buf[pos + 6]) != stream_flags ||
+	  crc32(0, &buf[pos + 6], 2) != read_aligned_le32(&buf[pos + 8]))
+	goto invalid;
+      if (stream_flags & ~0x0F00)
+	{
+	  xz_unsupported(error, error_size, filename,
+			 "Unsupported .xz file (Stream Flags = %#x)",
+			 stream_flags);
+	  goto invalid;
+	}
+
+      /* Second pass: Block Headers */
+      size_t block_offset = pos + 12;
+      for (i = 0; i < nrecords; i++)
+	{
+	  uint_fast64_t const unpadded_size = blocks[i].check_offset;
+
+	  blocks[i].checktype = checktype;
+	  if (!xz_parse_block_header(filename, buf, block_offset,
+				     unpadded_size, blocks[i].out_size,
+				     &blocks[i], error, error_size))
+	    goto invalid;
+	  block_offset += (unpadded_size + 3) & -4;
+	}
+    }
+
+  /* Output offsets */
+  size_t out_offset = 0;
+  for (size_t i = 0; i < nblocks; i++)
+    {
+      blocks[i].out_offset = out_offset;
+      if (__builtin_add_overflow(out_offset, blocks[i].out_size, &out_offset))
+	{
+	  xz_unsupported(error, error_size, filename,
+			 "Uncompressed size overflow");
+	  goto invalid;
+	}
+    }
+
+  *blocksp = blocks;
+  *nblocksp = nblocks;
+  return 1;
+
+ invalid:
+  free(blocks);
+  return 0;
+}
+
+static void
+check_hook (void *const arg, const void *const data, size_t const size)
+{
+  check_update(arg, data, size);
+}
+
+/* Initialize CHECK for TYPE, or for CHECK_NONE if TYPE is not supported. */
+static void
+check_init_supported (struct check *const check, unsigned int const type)
+{
+  check_init(check, check_name(type) ? type : CHECK_NONE);
+}
+
+/* Allocate and initialize a streaming decoder, and its memory in *MEMP. */
+static struct uncompress_lzma2_stream *
+new_stream (size_t const dict_size, void **const memp)
+{
+  size_t const memsize = uncompress_lzma2_stream_size(dict_size);
+  void *const mem
+    = (memsize ?
+       aligned_alloc(UNCOMPRESS_LZMA2_WORKSPACE_ALIGN,
+		     ((memsize + UNCOMPRESS_LZMA2_WORKSPACE_ALIGN - 1)
+		      & -UNCOMPRESS_LZMA2_WORKSPACE_ALIGN)) :
+       NULL);
+  struct uncompress_lzma2_stream *const stream
+    = uncompress_lzma2_stream_init(mem, dict_size);
+
+  if (!stream)
+    errx(1, "Memory exhausted");
+  *memp = mem;
+  return stream;
+}
+
+/*
+ * Feed IN[0..*INSIZEP) to STREAM and write the output through STREAMBUF,
+ * BUFSIZE bytes at a time, until more input is needed or decoding ends.
+ * *INSIZEP is set to the bytes consumed, and the output is added to
+ * CHECK and *OUTSIZEP.  Returns the last status of the decoder.
+ */
+static enum uncompress_status
+feed_stream (struct uncompress_lzma2_stream *const stream,
+	     const char *const in, size_t *const insizep,
+	     char *const streambuf, size_t const bufsize,
+	     struct check *const check, size_t *const outsizep)
+{
+  enum uncompress_status status;
+  size_t inpos = 0;
+
+  do
+    {
+      size_t inlen = *insizep - inpos, outlen = bufsize;
+
+      if (inlen > bufsize)
+	inlen = bufsize;
+      status = uncompress_lzma2_stream(stream, &in[inpos], &inlen,
+				       streambuf, &outlen);
+      inpos += inlen;
+      *outsizep += outlen;
+      write_all(streambuf, outlen);
+      check_update(check, streambuf, outlen);
+    }
+  while (status == UNCOMPRESS_OUTLIMIT ||
+	 (status == UNCOMPRESS_INLIMIT && inpos < *insizep));
+  *insizep = inpos;
+  return status;
+}
+
+/*
+ * Input read by a separate thread while decoding: a ring of READ_SLOTS
+ * buffers of READ_SLOT_SIZE bytes each, filled by reader() and
+ * consumed by reader_get() / reader_put().
+ */
+#define READ_SLOTS	4
+#define READ_SLOT_SIZE	(1 << 20)
+
+struct reader
+  {
+    int			fd;
+    const char *	filename;
+    pthread_mutex_t	lock;
+    pthread_cond_t	cond;
+    char *		slots[READ_SLOTS];
+    size_t		lengths[READ_SLOTS];
+    size_t		head, tail;	/* Slots filled / consumed so far */
+    _Bool		eof;
+    int			error;		/* errno of read(2), if failed */
+  };
+
+static void *
+reader (void *const arg)
+{
+  struct reader *const r = arg;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&r->lock);
+      while (r->head - r->tail == READ_SLOTS)
+	pthread_cond_wait(&r->cond, &r->lock);
+      pthread_mutex_unlock(&r->lock);
+
+      /* Only this thread touches the slot at HEAD. */
+      char *const slot = r->slots[r->head % READ_SLOTS];
+      size_t len = 0;
+      int error = 0;
+
+      while (len < READ_SLOT_SIZE)
+	{
+	  ssize_t const nread = read(r->fd, &slot[len], READ_SLOT_SIZE - len);
+
+	  if (nread < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      error = errno;
+	      break;
+	    }
+	  if (nread == 0)
+	    break;
+	  len += nread;
+	}
+
+      pthread_mutex_lock(&r->lock);
+      r->lengths[r->head % READ_SLOTS] = len;
+      if (len > 0)
+	r->head++;
+      if (len < READ_SLOT_SIZE)
+	{
+	  r->eof = 1;
+	  r->error = error;
+	}
+      pthread_cond_broadcast(&r->cond);
+      pthread_mutex_unlock(&r->lock);
+      if (len < READ_SLOT_SIZE)
+	return NULL;
+    }
+}
+
+/* Wait for the next slot and return it with its length in *LENP,
+   or NULL at the end of input. */
+static const char *
+reader_get (struct reader *const r, size_t *const lenp)
+{
+  const char *slot = NULL;
+
+  pthread_mutex_lock(&r->lock);
+  while (r->tail == r->head && !r->eof)
+    pthread_cond_wait(&r->cond, &r->lock);
+  if (r->tail != r->head)
+    {
+      slot = r->slots[r->tail % READ_SLOTS];
+      *lenp = r->lengths[r->tail % READ_SLOTS];
+    }
+  else if (r->error)
+    {
+      errno = r->error;
+      err(1, "%s", r->filename);
+    }
+  pthread_mutex_unlock(&r->lock);
+  return slot;
+}
+
+/* Return the slot from reader_get() to the reader. */
+static void
+reader_put (struct reader *const r)
+{
+  pthread_mutex_lock(&r->lock);
+  r->tail++;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * Decode a raw LZMA2 stream from FD (a pipe or the like) with the
+ * streaming decoder while another thread reads it, so that reading and
+ * decoding overlap.  Returns the exit status.
+ */
+static int
+stream_pipe (int const fd, const char *const filename,
+	     size_t const bufsize, size_t const dict_size)
+{
+  struct reader r = { .fd = fd, .filename = filename };
+  void *mem;
+  struct uncompress_lzma2_stream *const stream = new_stream(dict_size, &mem);
+  char *const streambuf = malloc(bufsize);
+  struct check check;
+  enum uncompress_status status = UNCOMPRESS_INLIMIT;
+  size_t insize = 0, outsize = 0;
+  const char *slot;
+  size_t len;
+  pthread_t tid;
+
+  if (!streambuf)
+    errx(1, "Memory exhausted");
+  for (unsigned int i = 0; i < READ_SLOTS; i++)
+    if (!(r.slots[i] = malloc(READ_SLOT_SIZE)))
+      errx(1, "Memory exhausted");
+  pthread_mutex_init(&r.lock, NULL);
+  pthread_cond_init(&r.cond, NULL);
+  if ((errno = pthread_create(&tid, NULL, reader, &r)) != 0)
+    err(1, "pthread_create");
+
+  check_init(&check, CHECK_NONE);
+  while (status == UNCOMPRESS_INLIMIT && (slot = reader_get(&r, &len)))
+    {
+      status = feed_stream(stream, slot, &len, streambuf, bufsize,
+			   &check, &outsize);
+      insize += len;
+      reader_put(&r);
+    }
+  free(streambuf);
+  free(mem);
+  if (verbosity > 0)
+    dbg_printf("uncompress_lzma2_stream(%s, [%zu], [%zu]) = %d (%s)",
+	       filename, insize, outsize, (int) status, status_string(status));
+  /* The reader may still be blocked in read(2); exit(3) takes it away. */
+  return status == UNCOMPRESS_OK ? 0 : 1;
+}
+
+/* Output of the streaming decoder is filtered this many bytes at a time,
+   while it is still in cache. */
+#define FILTER_WINDOW	(256 << 10)
+
+/*
+ * Decode BLOCK of a .xz file in INBUF into OUTBUF[0..OUTLEN), update
+ * its check, and store the numbers of bytes consumed and produced into
+ * BLOCK->insize and BLOCK->outsize.  The output of uncompress_lzma2()
+ * cannot be filtered in place, as it is the dictionary for later
+ * matches, so Blocks with filters are decoded with the streaming
+ * decoder (whose window is the dictionary), and each piece of output
+ * is filtered right after it has been copied into OUTBUF.
+ */
+static enum uncompress_status
+xz_decode_block (const uint8_t *const inbuf, struct xz_block *const block,
+		 uint8_t *const outbuf, size_t const outlen)
+{
+  const uint8_t *const in = &inbuf[block->in_offset];
+  struct filter filters[XZ_FILTERS_MAX - 1];
+  size_t done[XZ_FILTERS_MAX - 1];
+  enum uncompress_status status;
+  size_t inpos = 0, outpos = 0, checked = 0, len;
+  unsigned int i;
+
+  check_init_supported(&block->check, block->checktype);
+  block->insize = block->in_size;
+  block->outsize = outlen;
+  if (block->nfilters == 0)
+    return uncompress_lzma2_hook(in, &block->insize, outbuf, &block->outsize,
+				 check_hook, &block->check);
+
+  for (i = 0; i < block->nfilters; i++)
+    {
+      filter_init(&filters[i], block->filters[i].id,
+		  &inbuf[block->filters[i].props_offset],
+		  block->filters[i].props_size);
+      done[i] = 0;
+    }
+
+  void *mem;
+  struct uncompress_lzma2_stream *const stream
+    = new_stream((block->dict_size < block->out_size ?
+		  block->dict_size : block->out_size), &mem);
+
+  do
+    {
+      size_t inlen = block->in_size - inpos;
+
+      len = outlen - outpos;
+      if (len > FILTER_WINDOW)
+	len = FILTER_WINDOW;
+      status = uncompress_lzma2_stream(stream, &in[inpos], &inlen,
+				       &outbuf[outpos], &len);
+      inpos += inlen;
+      outpos += len;
+
+      /* Filters in reverse order, each on what the next one has done;
+	 the last few bytes not done by a filter are left as they are. */
+      size_t avail = outpos;
+      for (i = block->nfilters; i-- > 0; )
+	{
+	  done[i] += filter_decode(&filters[i], &outbuf[done[i]],
+				   avail - done[i]);
+	  if (status != UNCOMPRESS_OUTLIMIT)
+	    done[i] = avail;
+	  avail = done[i];
+	}
+      check_update(&block->check, &outbuf[checked], avail - checked);
+      checked = avail;
+    }
+  while (status == UNCOMPRESS_OUTLIMIT && (outpos < outlen || len > 0));
+
+  free(mem);
+  block->insize = inpos;
+  block->outsize = outpos;
+  return status;
+}
+
+/* Blocks to be decoded by xz_worker() */
+struct xz_job
+  {
+    const uint8_t *	inbuf;
+    struct xz_block *	blocks;
+    size_t		nblocks;
+    size_t		next;		/* Next Block to be taken */
+    uint8_t *		outbuf;
+  };
+
+static void *
+xz_worker (void *const arg)
+{
+  struct xz_job *const job = arg;
+  size_t i;
+
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+	 < job->nblocks)
+    {
+      struct xz_block *const block = &job->blocks[i];
+
+      block->status = xz_decode_block(job->inbuf, block,
+				      &job->outbuf[block->out_offset],
+				      block->out_size);
+    }
+  return NULL;
+}
+
+/*
+ * Decode all BLOCKS of a .xz file in INBUF using THREADS threads (0 for
+ * all online CPUs), write the output, and return the exit status.
+ */
+static int
+xz_decode_blocks (const char *const filename, const uint8_t *const inbuf,
+		  struct xz_block *const blocks, size_t const nblocks,
+		  unsigned int threads)
+{
+  struct uncompress_lzma2_batch_item *items;
+  size_t const outtotal = (nblocks ?
+			   blocks[nblocks - 1].out_offset +
+			   blocks[nblocks - 1].out_size : 0);
+  uint8_t *outbuf;
+  size_t i;
+
+  outbuf = map_output(outtotal, 1);
+  for (i = 0; i < nblocks && !blocks[i].nfilters; i++)
+    ;
+  if (i < nblocks)
+    {
+      /* Filters are beyond uncompress_lzma2_batch(). */
+      struct xz_job job = { inbuf, blocks, nblocks, 0, outbuf };
+
+      if (threads == 0)
+	{
+	  long n = sysconf(_SC_NPROCESSORS_ONLN);
+	  threads = n > 0 ? n : 1;
+	}
+      if (threads > nblocks)
+	threads = nblocks;
+
+      /* Fewer threads (down to the calling one alone) are used if
+	 thread IDs cannot be allocated or threads cannot be created. */
+      pthread_t *const tids = malloc(sizeof(pthread_t) * (threads - 1));
+      unsigned int nthreads = 0;
+
+      if (tids)
+	for (; nthreads < threads - 1; nthreads++)
+	  if (pthread_create(&tids[nthreads], NULL, xz_worker, &job) != 0)
+	    break;
+      xz_worker(&job);
+      while (nthreads > 0)
+	pthread_join(tids[--nthreads], NULL);
+      free(tids);
+      goto decoded;
+    }
+
+  if (!(items = calloc(nblocks ? nblocks : 1, sizeof(*items))))
+    errx(1, "Memory exhausted");
+
+  for (i = 0; i < nblocks; i++)
+    {
+      struct xz_block *const block = &blocks[i];
+
+      /* The check is updated for each chunk while it is still in cache. */
+      check_init_supported(&block->check, block->checktype);
+      items[i].inbuf = &inbuf[block->in_offset];
+      items[i].insize = block->in_size;
+      items[i].outbuf = &outbuf[block->out_offset];
+      items[i].outsize = block->out_size;
+      items[i].hook = check_hook;
+      items[i].hook_arg = &block->check;
+    }
+  uncompress_lzma2_batch(items, nblocks, threads);
+  for (i = 0; i < nblocks; i++)
+    {
+      blocks[i].status = items[i].status;
+      blocks[i].insize = items[i].insize;
+      blocks[i].outsize = items[i].outsize;
+    }
+  free(items);
+
+ decoded:
+  for (i = 0; i < nblocks; i++)
+    {
+      struct xz_block *const block = &blocks[i];
+
+      if (block->status == UNCOMPRESS_OK &&
+	  (block->insize != block->in_size ||
+	   block->outsize != block->out_size))
+	block->status = UNCOMPRESS_DATA_ERROR;
+      block->check_ok
+	= (block->status == UNCOMPRESS_OK &&
+	   check_verify(&block->check, &inbuf[block->check_offset]));
+    }
+
+  for (i = 0; i < nblocks; i++)
+    {
+      struct xz_block *const block = &blocks[i];
+
+      if (verbosity > 0)
+	dbg_printf("Block %zu: uncompress_lzma2([%zu -> %zu], [%zu -> %zu]) = %d (%s)%s",
+		   i, block->in_size, block->insize,
+		   block->out_size, block->outsize, (int) block->status,
+		   status_string(block->status),
+		   (block->status != UNCOMPRESS_OK ||
+		    block->checktype == CHECK_NONE ? "" :
+		    block->check.type == CHECK_NONE ? ", check not verified" :
+		    block->check_ok ? ", check OK" : ", check mismatch"));
+      if (!block->check_ok)
+	break;
+    }
+
+  /* Write output up to the first bad Block. */
+  write_mapped(outbuf, (i < nblocks ?
+			blocks[i].out_offset + blocks[i].outsize :
+			outtotal), 1);
+  if (i < nblocks)
+    {
+      if (blocks[i].status == UNCOMPRESS_OK)
+	errx(1, "%s: Block %zu: %s mismatch", filename, i,
+	     check_name(blocks[i].checktype));
+      return 1;
+    }
+  if (verbosity > 0)
+    dbg_printf("%zu blocks, %zu bytes", nblocks, outtotal);
+  return 0;
+}
+
+/*
+ * Batch mode: many files, each decompressed in memory into a file of
+ * its own.  The main thread opens files and reads and writes them
+ * asynchronously, with io_uring if available or a pool of I/O threads
+ * otherwise, while a pool of decoder threads decompresses the files
+ * already read.  Each file in flight takes one of a fixed number of
+ * slots (with its input and output buffers), so that reading does not
+ * run arbitrarily far ahead of decoding and writing.
+ */
+enum format { FMT_AUTO, FMT_RAW, FMT_XZ };
+
+/* Slots per decoder thread: one being decoded and one being read or
+   written, plus a few to cover the latency of opening files */
+#define BATCH_SLOTS(THREADS)	(2 * (THREADS) + 2)
+#define BATCH_IO_THREADS	4
+/* Largest read or write in one request (Linux does at most
+   0x7FFFF000 bytes at a time anyway) */
+#define BATCH_IO_MAX		(1 << 30)
+
+struct batch_file
+  {
+    char *		inname;
+    char *		outname;	/* NULL for an unknown suffix */
+  };
+
+struct batch_slot
+  {
+    struct batch_slot *	next;		/* In a queue */
+    const struct batch_file *file;
+    enum { BATCH_READ, BATCH_DECODE, BATCH_WRITE } state;
+    int			fd;
+    uint8_t *		inbuf;
+    uint8_t *		outbuf;
+    size_t		insize, outsize;
+    size_t		pos;		/* Bytes read or written so far */
+    ssize_t		result;		/* Of the last I/O, or -errno */
+    char		error[64];	/* Empty if none so far */
+    double		seconds;	/* Time spent in decoding */
+  };
+
+struct batch_queue
+  {
+    struct batch_slot *	head;
+    struct batch_slot **tailp;
+  };
+
+#ifdef HAVE_IO_URING
+struct ring
+  {
+    int			fd;
+    unsigned int *	sq_head;
+    unsigned int *	sq_tail;
+    unsigned int *	sq_array;
+    unsigned int	sq_mask;
+    struct io_uring_sqe *sqes;
+    unsigned int *	cq_head;
+    unsigned int *	cq_tail;
+    unsigned int	cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int	pending;	/* SQEs not submitted yet */
+  };
+#endif
+
+struct batch
+  {
+    enum format		format;
+    _Bool		require_check;
+    pthread_mutex_t	lock;
+    pthread_cond_t	decode_cond;	/* DECODE_QUEUE not empty or QUIT */
+    pthread_cond_t	io_cond;	/* IO_QUEUE not empty or QUIT */
+    pthread_cond_t	done_cond;	/* DONE not empty */
+    struct batch_queue	decode_queue, io_queue, done;
+    _Bool		quit;
+#ifdef HAVE_IO_URING
+    struct ring		ring;		/* FD is -1 if not used */
+    int			eventfd;	/* Signaled with each DONE */
+    uint64_t		eventfd_count;
+#endif
+  };
+
+static void
+queue_init (struct batch_queue *const q)
+{
+  q->head = NULL;
+  q->tailp = &q->head;
+}
+
+static void
+queue_put (struct batch_queue *const q, struct batch_slot *const slot)
+{
+  slot->next = NULL;
+  *q->tailp = slot;
+  q->tailp = &slot->next;
+}
+
+static struct batch_slot *
+queue_get (struct batch_queue *const q)
+{
+  struct batch_slot *const slot = q->head;
+
+  if (slot && !(q->head = slot->next))
+    q->tailp = &q->head;
+  return slot;
+}
+
+#ifdef HAVE_IO_URING
+/* Set up R with ENTRIES entries and return 1, or return 0 if io_uring
+   (with IORING_OP_READ and IORING_OP_WRITE) is not available. */
+static _Bool
+ring_init (struct ring *const r, unsigned int const entries)
+{
+  struct io_uring_params p;
+  char *rings;
+
+  memset(&p, 0, sizeof(p));
+  if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    return 0;
+
+  /* IORING_FEAT_RW_CUR_POS came with IORING_OP_READ and
+     IORING_OP_WRITE (Linux 5.6), after IORING_FEAT_SINGLE_MMAP. */
+  size_t const sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  size_t const cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (!(p.features & IORING_FEAT_RW_CUR_POS) ||
+      (rings = mmap(NULL, sq_len > cq_len ? sq_len : cq_len,
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    r->fd, IORING_OFF_SQ_RING)) == MAP_FAILED ||
+      (r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		      r->fd, IORING_OFF_SQES)) == MAP_FAILED)
+    {
+      /* The mappings go away with the file descriptor. */
+      close(r->fd);
+      r->fd = -1;
+      return 0;
+    }
+
+  r->sq_head = (unsigned int *) (rings + p.sq_off.head);
+  r->sq_tail = (unsigned int *) (rings + p.sq_off.tail);
+  r->sq_array = (unsigned int *) (rings + p.sq_off.array);
+  r->sq_mask = *(unsigned int *) (rings + p.sq_off.ring_mask);
+  r->cq_head = (unsigned int *) (rings + p.cq_off.head);
+  r->cq_tail = (unsigned int *) (rings + p.cq_off.tail);
+  r->cq_mask = *(unsigned int *) (rings + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (rings + p.cq_off.cqes);
+  r->pending = 0;
+  return 1;
+}
+
+/* Queue a read or write (OPCODE) of BUF[0..LEN) at OFFSET of FD.
+   There is always room: each slot has at most one request in flight. */
+static void
+ring_queue (struct ring *const r, unsigned int const opcode, int const fd,
+	    void *const buf, size_t const len, uint64_t const offset,
+	    uint64_t const user_data)
+{
+  unsigned int const tail = *r->sq_tail;
+  unsigned int const index = tail & r->sq_mask;
+  struct io_uring_sqe *const sqe = &r->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  r->sq_array[index] = index;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->pending++;
+}
+
+/* Submit pending requests and wait for at least one completion. */
+static void
+ring_enter (struct ring *const r)
+{
+  int const ret = syscall(__NR_io_uring_enter, r->fd, r->pending, 1,
+			  IORING_ENTER_GETEVENTS, NULL, 0);
+
+  if (ret >= 0)
+    r->pending -= ret;
+  else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    err(1, "io_uring_enter");
+}
+
+/* Take a completion into *USER_DATAP and *RESP, or return 0 if none. */
+static _Bool
+ring_reap (struct ring *const r, uint64_t *const user_datap,
+	   int32_t *const resp)
+{
+  unsigned int const head = *r->cq_head;
+
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+
+  const struct io_uring_cqe *const cqe = &r->cqes[head & r->cq_mask];
+  *user_datap = cqe->user_data;
+  *resp = cqe->res;
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* Read the eventfd through the ring; it completes (with user data 0)
+   when a decoder has put a slot on DONE. */
+static void
+batch_watch_eventfd (struct batch *const b)
+{
+  ring_queue(&b->ring, IORING_OP_READ, b->eventfd, &b->eventfd_count,
+	     sizeof(b->eventfd_count), (uint64_t) -1, 0);
+}
+#endif
+
+/* Put SLOT on DONE for the main thread. */
+static void
+batch_done (struct batch *const b, struct batch_slot *const slot)
+{
+  pthread_mutex_lock(&b->lock);
+  queue_put(&b->done, slot);
+  pthread_cond_signal(&b->done_cond);
+  pthread_mutex_unlock(&b->lock);
+#ifdef HAVE_IO_URING
+  if (b->ring.fd >= 0)
+    eventfd_write(b->eventfd, 1);
+#endif
+}
+
+/* Wait for a slot on Q (signaled by COND), or return NULL to quit. */
+static struct batch_slot *
+batch_take (struct batch *const b, struct batch_queue *const q,
+	    pthread_cond_t *const cond)
 {
-  static uint_least32_t table[256];
+  struct batch_slot *slot;
 
-  if (!table[1])
+  pthread_mutex_lock(&b->lock);
+  while (!(slot = queue_get(q)) && !b->quit)
+    pthread_cond_wait(cond, &b->lock);
+  pthread_mutex_unlock(&b->lock);
+  return slot;
+}
+
+/* Start reading or writing the rest of the buffer of SLOT. */
+static void
+batch_io (struct batch *const b, struct batch_slot *const slot)
+{
+#ifdef HAVE_IO_URING
+  if (b->ring.fd >= 0)
+    {
+      _Bool const reading = slot->state == BATCH_READ;
+      size_t len = (reading ? slot->insize : slot->outsize) - slot->pos;
+
+      if (len > BATCH_IO_MAX)
+	len = BATCH_IO_MAX;
+      ring_queue(&b->ring, reading ? IORING_OP_READ : IORING_OP_WRITE,
+		 slot->fd, (reading ? slot->inbuf : slot->outbuf) + slot->pos,
+		 len, slot->pos, (uintptr_t) slot);
+      return;
+    }
+#endif
+  pthread_mutex_lock(&b->lock);
+  queue_put(&b->io_queue, slot);
+  pthread_cond_signal(&b->io_cond);
+  pthread_mutex_unlock(&b->lock);
+}
+
+/* Wait for a slot whose I/O or decoding has finished. */
+static struct batch_slot *
+batch_wait (struct batch *const b)
+{
+  struct batch_slot *slot;
+
+  pthread_mutex_lock(&b->lock);
+#ifdef HAVE_IO_URING
+  if (b->ring.fd >= 0)
+    while (!(slot = queue_get(&b->done)))
+      {
+	uint64_t user_data;
+	int32_t res;
+
+	pthread_mutex_unlock(&b->lock);
+	if (!ring_reap(&b->ring, &user_data, &res))
+	  ring_enter(&b->ring);
+	else if (user_data)
+	  {
+	    slot = (struct batch_slot *) (uintptr_t) user_data;
+	    slot->result = res;
+	    return slot;
+	  }
+	else if (res < 0 && res != -EINTR && res != -EAGAIN)
+	  {
+	    errno = -res;
+	    err(1, "eventfd");
+	  }
+	else
+	  batch_watch_eventfd(b);
+	pthread_mutex_lock(&b->lock);
+      }
+  else
+#endif
+  while (!(slot = queue_get(&b->done)))
+    pthread_cond_wait(&b->done_cond, &b->lock);
+  pthread_mutex_unlock(&b->lock);
+  return slot;
+}
+
+/* I/O thread without io_uring */
+static void *
+batch_io_thread (void *const arg)
+{
+  struct batch *const b = arg;
+  struct batch_slot *slot;
+
+  while ((slot = batch_take(b, &b->io_queue, &b->io_cond)))
+    {
+      size_t len = ((slot->state == BATCH_READ ? slot->insize : slot->outsize)
+		    - slot->pos);
+      ssize_t n;
+
+      if (len > BATCH_IO_MAX)
+	len = BATCH_IO_MAX;
+      do
+	n = (slot->state == BATCH_READ ?
+	     pread(slot->fd, slot->inbuf + slot->pos, len, slot->pos) :
+	     pwrite(slot->fd, slot->outbuf + slot->pos, len, slot->pos));
+      while (n < 0 && errno == EINTR);
+      slot->result = n < 0 ? -errno : n;
+      batch_done(b, slot);
+    }
+  return NULL;
+}
+
+/* Decompress the input of SLOT into its (malloc'ed) output buffer. */
+static void
+batch_decode (struct batch *const b, struct batch_slot *const slot,
+	      void *const workspace)
+{
+  const uint8_t *const inbuf = slot->inbuf;
+  size_t const insize = slot->insize;
+  enum uncompress_status status;
+  struct xz_block *blocks = NULL;
+  size_t nblocks = 0;
+  size_t outtotal, alloc;
+  size_t i;
+
+  if (b->format != FMT_RAW && insize > (12 + 8) &&
+      read_aligned_le32(inbuf) == XZ_MAGIC1)
+    {
+      if (!xz_parse(slot->file->inname, inbuf, insize, &blocks, &nblocks,
+		    slot->error, sizeof(slot->error)))
+	{
+	  /* Unless it is unsupported */
+	  if (!slot->error[0])
+	    strcpy(slot->error, "Broken .xz file");
+	  return;
+	}
+      for (i = 0; i < nblocks && b->require_check; i++)
+	if (blocks[i].checktype == CHECK_NONE ||
+	    !check_name(blocks[i].checktype))
+	  {
+	    strcpy(slot->error, "No supported integrity check");
+	    goto finish;
+	  }
+      outtotal = (nblocks ?
+		  blocks[nblocks - 1].out_offset +
+		  blocks[nblocks - 1].out_size : 0);
+    }
+  else if (b->format == FMT_XZ)
+    {
+      strcpy(slot->error, "Not a .xz file");
+      return;
+    }
+  else if (b->require_check)
+    {
+      strcpy(slot->error, "No supported integrity check");
+      return;
+    }
+  else
     {
-      const uint_fast32_t poly = UINT32_C(0xEDB88320);
+      size_t scansize = insize, nchunks = 0;
 
-      for (unsigned int i = 0; i < 256; i++)
+      status = uncompress_lzma2_scan(inbuf, &scansize, NULL, &nchunks,
+				     &outtotal);
+      if (status != UNCOMPRESS_OK && status != UNCOMPRESS_OUTLIMIT)
 	{
-	  uint_fast32_t crc = i;
+	  strcpy(slot->error, status_string(status));
+	  return;
+	}
+    }
+
+  /* Slack for wide match copies to the end (of raw streams) */
+  if (__builtin_add_overflow(outtotal, UNCOMPRESS_LZMA2_OUTPUT_SLACK, &alloc) ||
+      !(slot->outbuf = malloc(alloc)))
+    {
+      strcpy(slot->error, status_string(UNCOMPRESS_NO_MEMORY));
+      goto finish;
+    }
+
+  if (!blocks)
+    {
+      size_t isize = insize, osize = outtotal;
+
+      status = (workspace ?
+		uncompress_lzma2_slack(inbuf, &isize, slot->outbuf, &osize,
+				       workspace,
+				       UNCOMPRESS_LZMA2_OUTPUT_SLACK) :
+		uncompress_lzma2(inbuf, &isize, slot->outbuf, &osize));
+      slot->outsize = osize;
+      if (status != UNCOMPRESS_OK)
+	strcpy(slot->error, status_string(status));
+      return;
+    }
+
+  for (i = 0; i < nblocks; i++)
+    {
+      struct xz_block *const block = &blocks[i];
 
-	  for (unsigned int j = 0; j < 8; j++)
-	    crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
-	  table[i] = crc;
+      status = xz_decode_block(inbuf, block, &slot->outbuf[block->out_offset],
+			       block->out_size);
+      if (status == UNCOMPRESS_OK &&
+	  (block->insize != block->in_size ||
+	   block->outsize != block->out_size))
+	status = UNCOMPRESS_DATA_ERROR;
+      if (status != UNCOMPRESS_OK)
+	{
+	  snprintf(slot->error, sizeof(slot->error), "Block %zu: %s",
+		   i, status_string(status));
+	  break;
+	}
+      if (!check_verify(&block->check, &inbuf[block->check_offset]))
+	{
+	  snprintf(slot->error, sizeof(slot->error), "Block %zu: %s mismatch",
+		   i, check_name(block->checktype));
+	  break;
 	}
+      slot->outsize = block->out_offset + block->outsize;
     }
 
-  uint_fast32_t crc = UINT32_C(0xFFFFFFFF);
-  for (size_t i = 0; i < size; i++)
-    crc = (crc >> 8) ^ table[(crc & 0xFF) ^ ((const uint8_t *) buf)[i]];
-  return ~crc & UINT32_C(0xFFFFFFFF);
+ finish:
+  free(blocks);
 }
 
-static uint_fast16_t
-read_aligned_le16 (const void *const vp)
+static void *
+batch_decoder (void *const arg)
 {
-  const uint8_t *const p = __builtin_assume_aligned(vp, 2);
-  return (uint_fast16_t) p[0] | (uint_fast16_t) p[1] << 8;
+  struct batch *const b = arg;
+  void *const workspace
+    = aligned_alloc(UNCOMPRESS_LZMA2_WORKSPACE_ALIGN,
+		    ((uncompress_lzma2_workspace_size()
+		      + UNCOMPRESS_LZMA2_WORKSPACE_ALIGN - 1)
+		     & -UNCOMPRESS_LZMA2_WORKSPACE_ALIGN));
+  struct batch_slot *slot;
+
+  while ((slot = batch_take(b, &b->decode_queue, &b->decode_cond)))
+    {
+      double const t0 = now();
+
+      batch_decode(b, slot, workspace);
+      slot->seconds = now() - t0;
+      batch_done(b, slot);
+    }
+  free(workspace);
+  return NULL;
 }
 
-static uint_fast32_t
-read_aligned_le32 (const void *const vp)
+static void
+batch_decode_queue (struct batch *const b, struct batch_slot *const slot)
 {
-  const uint8_t *const p = __builtin_assume_aligned(vp, 4);
-  return ((uint_fast32_t) p[0]       |
-	  (uint_fast32_t) p[1] <<  8 |
-	  (uint_fast32_t) p[2] << 16 |
-	  (uint_fast32_t) p[3] << 24);
+  slot->state = BATCH_DECODE;
+  pthread_mutex_lock(&b->lock);
+  queue_put(&b->decode_queue, slot);
+  pthread_cond_signal(&b->decode_cond);
+  pthread_mutex_unlock(&b->lock);
+}
+
+/* Open the input of SLOT and start reading it; returns 0 on error. */
+static _Bool
+batch_start (struct batch *const b, struct batch_slot *const slot)
+{
+  const char *const name = slot->file->inname;
+  struct stat statbuf;
+
+  slot->inbuf = slot->outbuf = NULL;
+  slot->insize = slot->outsize = 0;
+  slot->error[0] = '\0';
+  slot->seconds = 0;
+  if (!slot->file->outname)
+    {
+      strcpy(slot->error, "Unknown suffix");
+      return 0;
+    }
+  if ((slot->fd = open(name, O_RDONLY | O_CLOEXEC)) < 0 ||
+      fstat(slot->fd, &statbuf) < 0)
+    {
+      snprintf(slot->error, sizeof(slot->error), "%s", strerror(errno));
+      return 0;
+    }
+  if (!S_ISREG(statbuf.st_mode))
+    {
+      strcpy(slot->error, "Not a regular file");
+      return 0;
+    }
+  if ((slot->insize = statbuf.st_size) != statbuf.st_size ||
+      !(slot->inbuf = malloc(slot->insize ? slot->insize : 1)))
+    {
+      strcpy(slot->error, status_string(UNCOMPRESS_NO_MEMORY));
+      return 0;
+    }
+  slot->state = BATCH_READ;
+  slot->pos = 0;
+  if (slot->insize == 0)
+    batch_decode_queue(b, slot);
+  else
+    batch_io(b, slot);
+  return 1;
+}
+
+/* Advance SLOT after its I/O or decoding; returns 0 when it is done. */
+static _Bool
+batch_step (struct batch *const b, struct batch_slot *const slot)
+{
+  switch (slot->state)
+    {
+    case BATCH_READ:
+      if (slot->result < 0)
+	{
+	  snprintf(slot->error, sizeof(slot->error), "%s",
+		   strerror(-slot->result));
+	  return 0;
+	}
+      if (slot->result == 0)	/* The file has been truncated. */
+	slot->insize = slot->pos;
+      else if ((slot->pos += slot->result) < slot->insize)
+	{
+	  batch_io(b, slot);
+	  return 1;
+	}
+      close(slot->fd);
+      slot->fd = -1;
+      batch_decode_queue(b, slot);
+      return 1;
+
+    case BATCH_DECODE:
+      free(slot->inbuf);
+      slot->inbuf = NULL;
+      if (slot->error[0])
+	return 0;
+      if ((slot->fd = open(slot->file->outname,
+			   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			   0666)) < 0)
+	{
+	  snprintf(slot->error, sizeof(slot->error), "%s: %s",
+		   slot->file->outname, strerror(errno));
+	  return 0;
+	}
+      slot->state = BATCH_WRITE;
+      slot->pos = 0;
+      break;
+
+    case BATCH_WRITE:
+      if (slot->result <= 0)
+	{
+	  snprintf(slot->error, sizeof(slot->error), "%s: %s",
+		   slot->file->outname,
+		   slot->result ? strerror(-slot->result) : "Short write");
+	  unlink(slot->file->outname);
+	  return 0;
+	}
+      slot->pos += slot->result;
+      break;
+    }
+
+  if (slot->pos == slot->outsize)
+    return 0;
+  batch_io(b, slot);
+  return 1;
+}
+
+/*
+ * Decompress NFILES FILES with THREADS decoder threads (0 for all
+ * online CPUs), reporting a line for each file and totals on the
+ * standard output.  Returns the exit status.
+ */
+static int
+batch_main (const struct batch_file *const files, size_t const nfiles,
+	    unsigned int threads, _Bool const use_ring,
+	    enum format const format, _Bool const require_check)
+{
+  struct batch b = { .format = format, .require_check = require_check };
+  struct batch_queue idle;
+  size_t next = 0, active = 0, nfailed = 0;
+  size_t intotal = 0, outtotal = 0;
+  unsigned int nslots, nio = 0, i;
+  double const t0 = now();
+
+  if (threads == 0)
+    {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = n > 0 ? n : 1;
+    }
+  if (threads > nfiles)
+    threads = nfiles ? nfiles : 1;
+  nslots = BATCH_SLOTS(threads);
+
+  struct batch_slot *const slots = malloc(sizeof(*slots) * nslots);
+  pthread_t *const tids = malloc(sizeof(*tids) * (threads + BATCH_IO_THREADS));
+
+  if (!slots || !tids)
+    errx(1, "Memory exhausted");
+
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.decode_cond, NULL);
+  pthread_cond_init(&b.io_cond, NULL);
+  pthread_cond_init(&b.done_cond, NULL);
+  queue_init(&b.decode_queue);
+  queue_init(&b.io_queue);
+  queue_init(&b.done);
+  queue_init(&idle);
+  for (i = 0; i < nslots; i++)
+    queue_put(&idle, &slots[i]);
+
+#ifdef HAVE_IO_URING
+  /* A request for each slot and one for the eventfd */
+  b.ring.fd = -1;
+  if (use_ring && ring_init(&b.ring, nslots + 1))
+    {
+      if ((b.eventfd = eventfd(0, EFD_CLOEXEC)) < 0)
+	err(1, "eventfd");
+      batch_watch_eventfd(&b);
+    }
+  else
+#endif
+  for (nio = 0; nio < BATCH_IO_THREADS; nio++)
+    if ((errno = pthread_create(&tids[threads + nio], NULL,
+				batch_io_thread, &b)) != 0)
+      err(1, "pthread_create");
+  for (i = 0; i < threads; i++)
+    if ((errno = pthread_create(&tids[i], NULL, batch_decoder, &b)) != 0)
+      err(1, "pthread_create");
+  if (verbosity > 0)
+    dbg_printf("Batch: %zu files, %u decoder threads, %u slots, %s",
+	       nfiles, threads, nslots, nio ? "I/O threads" : "io_uring");
+
+  printf("#file\tstatus\tcompressed\tuncompressed\tseconds\n");
+  while (next < nfiles || active > 0)
+    {
+      struct batch_slot *slot;
+
+      while (next < nfiles && (slot = queue_get(&idle)))
+	{
+	  slot->file = &files[next++];
+	  slot->fd = -1;
+	  if (batch_start(&b, slot))
+	    active++;
+	  else
+	    goto report;
+	}
+      if (active == 0)
+	continue;
+      slot = batch_wait(&b);
+      if (batch_step(&b, slot))
+	continue;
+      active--;
+
+    report:
+      if (slot->fd >= 0)
+	close(slot->fd);
+      free(slot->inbuf);
+      free(slot->outbuf);
+      printf("%s\t%s\t%zu\t%zu\t%.3f\n", slot->file->inname,
+	     slot->error[0] ? slot->error : "OK",
+	     slot->insize, slot->outsize, slot->seconds);
+      if (slot->error[0])
+	nfailed++;
+      else
+	{
+	  intotal += slot->insize;
+	  outtotal += slot->outsize;
+	}
+      queue_put(&idle, slot);
+    }
+
+  pthread_mutex_lock(&b.lock);
+  b.quit = 1;
+  pthread_cond_broadcast(&b.decode_cond);
+  pthread_cond_broadcast(&b.io_cond);
+  pthread_mutex_unlock(&b.lock);
+  for (i = 0; i < threads; i++)
+    pthread_join(tids[i], NULL);
+  for (i = 0; i < nio; i++)
+    pthread_join(tids[threads + i], NULL);
+  free(tids);
+  free(slots);
+
+  double const seconds = now() - t0;
+  printf("#total\t%zu/%zu OK\t%zu\t%zu\t%.3f\t%.1f MB/s\n",
+	 nfiles - nfailed, nfiles, intotal, outtotal, seconds,
+	 seconds > 0 ? outtotal / seconds / 1e6 : 0.0);
+  return nfailed ? 1 : 0;
+}
+
+/* Output name for NAME without its suffix, or NULL if unknown */
+static char *
+batch_output_name (const char *const name)
+{
+  static const char *const suffixes[] = { ".xz", ".lzma2", ".lz" };
+  size_t const len = strlen(name);
+
+  for (unsigned int i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+    {
+      size_t const slen = strlen(suffixes[i]);
+
+      if (len > slen && name[len - slen - 1] != '/' &&
+	  !strcmp(&name[len - slen], suffixes[i]))
+	{
+	  char *const outname = strndup(name, len - slen);
+
+	  if (!outname)
+	    errx(1, "Memory exhausted");
+	  return outname;
+	}
+    }
+  return NULL;
+}
+
+/* Add INNAME (and OUTNAME, or NULL to derive it) to *FILESP. */
+static void
+batch_add (struct batch_file **const filesp, size_t *const nfilesp,
+	   size_t *const allocp,
+	   const char *const inname, const char *const outname)
+{
+  if (*nfilesp == *allocp &&
+      !(*filesp = realloc(*filesp, (sizeof(**filesp) *
+				    (*allocp = *allocp ? *allocp * 2 : 16)))))
+    errx(1, "Memory exhausted");
+
+  struct batch_file *const file = &(*filesp)[(*nfilesp)++];
+  if (!(file->inname = strdup(inname)) ||
+      (outname && !(file->outname = strdup(outname))))
+    errx(1, "Memory exhausted");
+  if (!outname)
+    file->outname = batch_output_name(inname);
+}
+
+/* Add the files listed in MANIFEST, one per line as INPUT or
+   INPUT<TAB>OUTPUT, to *FILESP. */
+static void
+batch_read_manifest (const char *const manifest,
+		     struct batch_file **const filesp, size_t *const nfilesp,
+		     size_t *const allocp)
+{
+  FILE *const fp = (strcmp(manifest, "-") ? fopen(manifest, "r") : stdin);
+  char *line = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+
+  if (!fp)
+    err(1, "%s", manifest);
+  while ((len = getline(&line, &alloc, fp)) >= 0)
+    {
+      if (len > 0 && line[len - 1] == '\n')
+	line[--len] = '\0';
+      if (len == 0)
+	continue;
+
+      char *const tab = strchr(line, '\t');
+      if (tab)
+	*tab = '\0';
+      batch_add(filesp, nfilesp, allocp, line, tab ? tab + 1 : NULL);
+    }
+  if (ferror(fp))
+    err(1, "%s", manifest);
+  free(line);
+  if (fp != stdin)
+    fclose(fp);
 }
 
 int
@@ -129,21 +1850,91 @@ main (int argc, char *argv[])
   size_t inbufsize;
   char *outbuf;
   size_t outbufsize = 0;
-  _Bool check_crc = 0;
-  enum { FMT_AUTO, FMT_RAW, FMT_XZ, FMT_XZ_CRC32 } format = FMT_AUTO;
+  _Bool require_check = 0;
+  _Bool list_chunks = 0;
+  _Bool gather = 0;
+  _Bool validate = 0;
+  _Bool grow = 0;
+  _Bool slack = 0;
+  size_t range_offset = 0, range_length = 0;
+  size_t stream_bufsize = 0;
+  size_t dict_size = 64 << 20;
+  unsigned int threads = 1;
+  enum format format = FMT_AUTO;
+  unsigned int checktype = CHECK_NONE;
+  const char *manifest = NULL;
+  _Bool use_ring = 1;
 
-  while ((optc = getopt(argc, argv, "b:crvx")) >= 0)
+  while ((optc = getopt(argc, argv, "b:cD:gHj:lm:n:O:o:PRrSs:Ttvx")) >= 0)
     switch (optc)
       {
       case 'b':
 	outbufsize = str_to_size(optarg);
 	break;
       case 'c':
-	check_crc = 1;
+	require_check = 1;
+	break;
+      case 'D':
+	dict_size = str_to_size(optarg);
+	break;
+      case 'g':
+	gather = 1;
+	break;
+      case 'H':
+	output_hugepage = 1;
+	break;
+      case 'j':
+	{
+	  char *end;
+
+	  errno = 0;
+	  unsigned long const ulval = strtoul(optarg, &end, 0);
+	  if (errno || end == optarg || *end || ulval != (unsigned int) ulval)
+	    errx(2, "Invalid number of threads `%s'", optarg);
+	  threads = ulval;
+	}
+	break;
+      case 'l':
+	list_chunks = 1;
+	break;
+      case 'm':
+	manifest = optarg;
+	break;
+      case 'n':
+	range_length = str_to_size(optarg);
+	break;
+      case 'O':
+	if ((output_fd = open(optarg, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+	  err(1, "%s", optarg);
+	output_name = optarg;
+	break;
+      case 'o':
+	range_offset = str_to_size(optarg);
+	break;
+      case 'P':
+#ifdef MAP_POPULATE
+	output_mmap_flags |= MAP_POPULATE;
+#endif
+	break;
+      case 'R':
+	grow = 1;
 	break;
       case 'r':
 	format = FMT_RAW;
 	break;
+      case 'S':
+	slack = 1;
+	break;
+      case 's':
+	if (!(stream_bufsize = str_to_size(optarg)))
+	  errx(2, "Invalid buffer size for streaming");
+	break;
+      case 'T':
+	use_ring = 0;
+	break;
+      case 't':
+	validate = 1;
+	break;
       case 'v':
 	verbosity++;
 	break;
@@ -151,11 +1942,36 @@ main (int argc, char *argv[])
 	format = FMT_XZ;
 	break;
       default:
-	errx(2, "usage: %s [-v] [-r|-x] [-c] [-b OUTPUT-BUFFER-SIZE] [FILE]",
-	     argv[0]);
+	errx(2, "usage: %s [-v] [-r|-x] [-c|-l] [-g|-j THREADS] [-b OUTPUT-BUFFER-SIZE]\n\t[-o OFFSET -n LENGTH] [-s BUFFER-SIZE|-t] [-D DICT-SIZE]\n\t[-O OUTPUT-FILE] [-H] [-P] [-R|-S] [FILE]\n"
+	     "       %s [-v] [-r|-x] [-c] [-j THREADS] [-T] [-m MANIFEST] [FILE...]",
+	     argv[0], argv[0]);
 	return 2;
       }
 
+  if (verbosity > 0)
+    {
+      dbg_printf("Decoder variant: %s", uncompress_lzma2_isa());
+      atexit(print_stats);
+    }
+
+  if (manifest || optind + 1 < argc)
+    {
+      /* Each file into one without its suffix (or as in MANIFEST) */
+      struct batch_file *files = NULL;
+      size_t nfiles = 0, alloc = 0;
+
+      if (stream_bufsize || list_chunks || range_length || range_offset ||
+	  outbufsize || gather || validate || grow ||
+	  output_fd != STDOUT_FILENO)
+	errx(2, "-b, -g, -l, -n, -o, -O, -R, -s and -t are not supported for several files");
+      if (manifest)
+	batch_read_manifest(manifest, &files, &nfiles, &alloc);
+      for (int i = optind; i < argc; i++)
+	batch_add(&files, &nfiles, &alloc, argv[i], NULL);
+      return batch_main(files, nfiles, threads, use_ring, format,
+			require_check);
+    }
+
   if (optind >= argc)
     filename = "-";
   else if (optind + 1 == argc)
@@ -178,6 +1994,8 @@ main (int argc, char *argv[])
       if (buf == MAP_FAILED)
 	err(1, "mmap");
     }
+  else if (stream_bufsize && format == FMT_RAW)
+    return stream_pipe(fd, filename, stream_bufsize, dict_size);
   else
     {
       size_t buf_alloc = 1 << 20;
@@ -214,28 +2032,48 @@ main (int argc, char *argv[])
     }
   close(fd);
 
-  /* By default the output buffer is allocated for 4 times larger than
-     the input size (that is, compression ratio is assumed to be 25%). */
-  if (!outbufsize && __builtin_mul_overflow(inbufsize, 4, &outbufsize))
-    errx(1, "Output buffer size overflow (input size = %zu)", inbufsize);
-
-  outbuf = mmap(NULL, outbufsize, PROT_READ | PROT_WRITE,
-		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (outbuf == MAP_FAILED)
-    err(1, "anonymous mmap");
-
   char *inbuf = buf;
   size_t insize = inbufsize;
 
-#define XZ_MAGIC1	(0xFD | ('7' << 8) | ('z' << 16) | ('X' << 24))
-#define XZ_MAGIC2	('Z' | (0x00 << 8))
-#define XZ_MAGIC3	('Y' | ('Z' << 8))
+  struct xz_block *blocks;
+  size_t nblocks;
 
   if (format != FMT_RAW &&
+      insize > (12 + 8) &&
+      read_aligned_le32(inbuf) == XZ_MAGIC1 &&
+      xz_parse(filename, (const uint8_t *) inbuf, insize, &blocks, &nblocks,
+	       NULL, 0))
+    {
+      /* A complete .xz file; Blocks are found through the Indexes. */
+      if (nblocks != 1 || blocks[0].nfilters)
+	{
+	  if (stream_bufsize || list_chunks || range_length || outbufsize ||
+	      validate || grow)
+	    errx(2, "%s: -b, -l, -n, -o, -R, -s and -t are not supported for .xz files with %zu blocks or filters",
+		 filename, nblocks);
+	  if (require_check)
+	    for (size_t i = 0; i < nblocks; i++)
+	      if (blocks[i].checktype == CHECK_NONE ||
+		  !check_name(blocks[i].checktype))
+		errx(1, "%s: No supported integrity check", filename);
+	  return xz_decode_blocks(filename, (const uint8_t *) inbuf,
+				  blocks, nblocks, threads);
+	}
+
+      format = FMT_XZ;
+      checktype = blocks[0].checktype;
+      inbuf += blocks[0].in_offset;
+      insize = blocks[0].check_offset - blocks[0].in_offset;
+      if (verbosity > 0)
+	dbg_printf("Single .xz block, %zu bytes at %zu",
+		   insize, blocks[0].in_offset);
+      free(blocks);
+    }
+  else if (format != FMT_RAW &&
       insize > (12 + 8) &&
       read_aligned_le32(inbuf) == XZ_MAGIC1 &&
       read_aligned_le16(&inbuf[4]) == XZ_MAGIC2 &&
-      crc32(&inbuf[6], 2) == read_aligned_le32(&inbuf[8]))
+      crc32(0, &inbuf[6], 2) == read_aligned_le32(&inbuf[8]))
     {
       /* Found XZ Stream Header. */
 
@@ -245,15 +2083,13 @@ main (int argc, char *argv[])
       if (stream_flags & ~0x0F00)
 	errx(1, "%s: Unsupported .xz file (Stream Flags = %#x)",
 	     filename, stream_flags);
-      unsigned int const checktype = (stream_flags >> 8) & 0xF;
-      if (checktype == 0x1)
-	format = FMT_XZ_CRC32;
+      checktype = (stream_flags >> 8) & 0xF;
 
       unsigned int const block_header_size = *(uint8_t *) &buf[12];
 
       if (block_header_size != 0 &&
 	  (insize - 12 - 4) > (block_header_size * 4) &&
-	  crc32(&inbuf[12], block_header_size * 4) == read_aligned_le32(&inbuf[12 + block_header_size * 4]))
+	  crc32(0, &inbuf[12], block_header_size * 4) == read_aligned_le32(&inbuf[12 + block_header_size * 4]))
 	{
 	  /* Found XZ Block Header. */
 	  if ((*(uint8_t *) &inbuf[13] & 0x03) != 0x00)
@@ -266,14 +2102,13 @@ main (int argc, char *argv[])
 	    dbg_printf("Skipping .xz header, %u bytes",
 		       12 + block_header_size * 4 + 4);
 
-	  unsigned int const checksize
-	    = checktype ? (4 << ((checktype - 1) / 3)) : 0;
+	  unsigned int const checksize = check_size(checktype);
 	  if (insize > (8 + 12 + checksize) && (insize & 3) == 0 &&
 	      read_aligned_le16(&inbuf[insize - 2]) == XZ_MAGIC3 &&
 	      /* Footer Stream Flags */
 	      (read_aligned_le16(&inbuf[insize - 4]) ==
 	       read_aligned_le16(&buf[6])) &&
-	      (crc32(&inbuf[insize - 8], 6) ==
+	      (crc32(0, &inbuf[insize - 8], 6) ==
 	       read_aligned_le32(&inbuf[insize - 12])))
 	    {
 	      /* Found Stream Footer. */
@@ -283,13 +2118,13 @@ main (int argc, char *argv[])
 		  backward_size < (insize / 4 - 4) &&
 		  /* Index Indicator */
 		  !inbuf[insize - 16 - backward_size * 4] &&
-		  (crc32(&inbuf[insize - 16 - backward_size * 4],
+		  (crc32(0, &inbuf[insize - 16 - backward_size * 4],
 			 backward_size * 4) ==
 		   read_aligned_le32(&inbuf[insize - 16])))
 		{
 		  /* Found Index. */
 		  if (*(uint8_t *) &inbuf[insize - 16 - backward_size * 4 + 1] != 0x01)
-		    errx(1, "%s: unsupported .xz file (more than one blocks)",
+		    errx(1, "%s: broken .xz file (more than one blocks)",
 			 filename);
 		  size_t const stripsize = 16 + backward_size * 4 + checksize;
 		  insize -= stripsize;
@@ -302,29 +2137,229 @@ main (int argc, char *argv[])
   else if (format == FMT_XZ)
     errx(1, "%s: Not a .xz file", filename);
 
-  size_t outsize = outbufsize;
+  size_t outsize;
   size_t saved_insize = insize;
+  enum uncompress_status status;
+  struct check check;
 
-  enum uncompress_status status = uncompress_lzma2(inbuf, &insize,
-						   outbuf, &outsize);
+  if (validate)
+    {
+      /* Decode into a window only, and output nothing. */
+      size_t const memsize = uncompress_lzma2_stream_size(dict_size);
+      void *const mem
+	= (memsize ?
+	   aligned_alloc(UNCOMPRESS_LZMA2_WORKSPACE_ALIGN,
+			 ((memsize + UNCOMPRESS_LZMA2_WORKSPACE_ALIGN - 1)
+			  & -UNCOMPRESS_LZMA2_WORKSPACE_ALIGN)) :
+	   NULL);
 
-  if (verbosity > 0)
+      check_init_supported(&check, checktype);
+      status = uncompress_lzma2_validate(inbuf, &insize, &outsize, mem,
+					 dict_size, check_hook, &check);
+      free(mem);
+      if (verbosity > 0)
+	dbg_printf("uncompress_lzma2_validate(%p, [%zu -> %zu], [%zu], %zu) = %d (%s)",
+		   inbuf, saved_insize, insize, outsize, dict_size,
+		   (int) status, status_string(status));
+      goto verify;
+    }
+
+  if (stream_bufsize)
+    {
+      /* Feed input and take output STREAM_BUFSIZE bytes at a time. */
+      void *mem;
+      struct uncompress_lzma2_stream *const stream
+	= new_stream(dict_size, &mem);
+      char *const streambuf = malloc(stream_bufsize);
+
+      if (!streambuf)
+	errx(1, "Memory exhausted");
+      check_init_supported(&check, checktype);
+      outsize = 0;
+      status = feed_stream(stream, inbuf, &insize, streambuf, stream_bufsize,
+			   &check, &outsize);
+      free(streambuf);
+      free(mem);
+      if (verbosity > 0)
+	dbg_printf("uncompress_lzma2_stream(%p, [%zu -> %zu], [%zu]) = %d (%s)",
+		   inbuf, saved_insize, insize, outsize,
+		   (int) status, status_string(status));
+      goto verify;
+    }
+
+  if (grow)
+    {
+      /* Start with the size of -b (or a small one) and double it
+	 each time the output buffer fills up */
+      size_t alloc = outbufsize ? outbufsize : 1 << 16;
+      void *const workspace
+	= aligned_alloc(UNCOMPRESS_LZMA2_WORKSPACE_ALIGN,
+			((uncompress_lzma2_workspace_size()
+			  + UNCOMPRESS_LZMA2_WORKSPACE_ALIGN - 1)
+			 & -UNCOMPRESS_LZMA2_WORKSPACE_ALIGN));
+      unsigned int resumes = 0;
+
+      if (!workspace || !(outbuf = malloc(alloc)))
+	errx(1, "Memory exhausted");
+      outsize = alloc;
+      status = uncompress_lzma2_ex(inbuf, &insize, outbuf, &outsize,
+				   workspace);
+      while (status == UNCOMPRESS_OUTLIMIT)
+	{
+	  if (__builtin_mul_overflow(alloc, 2, &alloc) ||
+	      !(outbuf = realloc(outbuf, alloc)))
+	    errx(1, "Memory exhausted");
+	  resumes++;
+	  insize = saved_insize;
+	  outsize = alloc;
+	  status = uncompress_lzma2_resume(inbuf, &insize, outbuf, &outsize,
+					   workspace);
+	}
+      if (verbosity > 0)
+	dbg_printf("uncompress_lzma2_resume: %u times, %zu -> %zu bytes in %zu = %d (%s)",
+		   resumes, insize, outsize, alloc, (int) status,
+		   status_string(status));
+      if (insize > saved_insize)
+	errx(3, "input buffer overrun (insize = %zu -> %zu)",
+	     saved_insize, insize);
+      check_init_supported(&check, checktype);
+      check_update(&check, outbuf, outsize);
+      write_all(outbuf, outsize);
+      free(workspace);
+      goto verify;
+    }
+
+  if (list_chunks || range_length || !outbufsize)
     {
-      char *s;
+      size_t scansize = insize;
+      size_t nchunks = 0;
+      size_t outtotal;
+      struct uncompress_lzma2_chunk *chunks = NULL;
+      enum uncompress_status status
+	= uncompress_lzma2_scan(inbuf, &scansize, NULL, &nchunks, &outtotal);
+
+      if ((list_chunks || range_length) && status == UNCOMPRESS_OUTLIMIT)
+	{
+	  if (!(chunks = malloc(sizeof(*chunks) * nchunks)))
+	    errx(1, "Memory exhausted");
+	  status = uncompress_lzma2_scan(inbuf, &scansize, chunks, &nchunks,
+					 &outtotal);
+	}
+      if (verbosity > 0)
+	dbg_printf("uncompress_lzma2_scan: %zu chunks, %zu -> %zu bytes (%d)",
+		   nchunks, scansize, outtotal, (int) status);
+
+      if (list_chunks)
+	{
+	  for (size_t i = 0; i < nchunks; i++)
+	    {
+	      static const char *const resets[] =
+		{ "none", "state", "props", "dict" };
+
+	      printf("%zu\t%zu+%zu\t%zu+%zu\t%s\t%s",
+		     i, chunks[i].in_offset, chunks[i].in_size,
+		     chunks[i].out_offset, chunks[i].out_size,
+		     (chunks[i].type == UNCOMPRESS_LZMA2_CHUNK_LZMA ?
+		      "lzma" : "stored"),
+		     resets[chunks[i].reset]);
+	      if (chunks[i].type == UNCOMPRESS_LZMA2_CHUNK_LZMA)
+		printf("\tlc=%u,lp=%u,pb=%u",
+		       chunks[i].lc, chunks[i].lp, chunks[i].pb);
+	      putchar('\n');
+	    }
+	  return status == UNCOMPRESS_OK ? 0 : 1;
+	}
 
-      switch (status)
+      if (range_length)
 	{
-	case UNCOMPRESS_OK:		s = "OK";		break;
-	case UNCOMPRESS_NO_MEMORY:	s = "NO_MEMORY";	break;
-	case UNCOMPRESS_DATA_ERROR:	s = "DATA_ERROR";	break;
-	case UNCOMPRESS_INLIMIT:	s = "INLIMIT";		break;
-	case UNCOMPRESS_OUTLIMIT:	s = "OUTLIMIT";		break;
-	default:			s = "???";		break;
+	  if (status != UNCOMPRESS_OK)
+	    errx(1, "%s: Broken chunk headers", filename);
+	  if (!(outbuf = malloc(range_length)))
+	    errx(1, "Memory exhausted");
+
+	  size_t outsize = range_length;
+	  status = uncompress_lzma2_range(inbuf, insize, chunks, nchunks,
+					  range_offset, outbuf, &outsize);
+	  if (verbosity > 0)
+	    dbg_printf("uncompress_lzma2_range(%p, %zu, [%zu chunks], %zu, %p, [%zu -> %zu]) = %d",
+		       inbuf, insize, nchunks, range_offset, outbuf,
+		       range_length, outsize, (int) status);
+	  write_all(outbuf, outsize);
+	  return status == UNCOMPRESS_OK ? 0 : 1;
 	}
 
-      dbg_printf("uncompress_lzma2(%p, [%zu -> %zu], %p, [%zu -> %zu]) = %d (%s)",
+      /* Use exact size if the chunk headers look sane.  Otherwise
+	 the output buffer is allocated for 4 times larger than
+	 the input size (that is, compression ratio is assumed to be 25%)
+	 and the decompressor will tell what is wrong. */
+      if (status == UNCOMPRESS_OK || status == UNCOMPRESS_OUTLIMIT)
+	outbufsize = outtotal;
+      else if (__builtin_mul_overflow(inbufsize, 4, &outbufsize))
+	errx(1, "Output buffer size overflow (input size = %zu)", inbufsize);
+    }
+
+  /* The segments of -g are written with writev(2).  With -S, the
+     output buffer is followed by slack for wide match copies. */
+  if (slack && outbufsize > SIZE_MAX - UNCOMPRESS_LZMA2_OUTPUT_SLACK)
+    errx(1, "Output buffer size overflow");
+  outbuf = map_output(outbufsize + (slack ? UNCOMPRESS_LZMA2_OUTPUT_SLACK : 0),
+		      !gather);
+
+  outsize = outbufsize;
+  check_init_supported(&check, checktype);
+  if (gather)
+    {
+      struct uncompress_lzma2_segment *const segs
+	= malloc(sizeof(*segs) * GATHER_SEGMENTS);
+      size_t nsegs = GATHER_SEGMENTS;
+
+      if (!segs)
+	errx(1, "Memory exhausted");
+      status = uncompress_lzma2_sg(inbuf, &insize, outbuf, &outsize,
+				   segs, &nsegs);
+      if (verbosity > 0)
+	dbg_printf("uncompress_lzma2_sg(%p, [%zu -> %zu], %p, [%zu -> %zu], [%d -> %zu]) = %d (%s)",
+		   inbuf, saved_insize, insize, outbuf, outbufsize, outsize,
+		   GATHER_SEGMENTS, nsegs, (int) status, status_string(status));
+      if (insize > saved_insize)
+	errx(3, "input buffer overrun (insize = %zu -> %zu)",
+	     saved_insize, insize);
+      write_segments(segs, nsegs);
+      for (size_t i = 0; i < nsegs; i++)
+	check_update(&check, segs[i].data, segs[i].size);
+      free(segs);
+      goto verify;
+    }
+  void *const workspace
+    = (!slack ? NULL :
+       aligned_alloc(UNCOMPRESS_LZMA2_WORKSPACE_ALIGN,
+		     ((uncompress_lzma2_workspace_size()
+		       + UNCOMPRESS_LZMA2_WORKSPACE_ALIGN - 1)
+		      & -UNCOMPRESS_LZMA2_WORKSPACE_ALIGN)));
+
+  if (slack && !workspace)
+    errx(1, "Memory exhausted");
+
+  double const start = now();
+  long const faults = page_faults();
+  status = (threads != 1 ?
+	    uncompress_lzma2_mt(inbuf, &insize, outbuf, &outsize, threads) :
+	    slack ?
+	    uncompress_lzma2_slack(inbuf, &insize, outbuf, &outsize,
+				   workspace, UNCOMPRESS_LZMA2_OUTPUT_SLACK) :
+	    uncompress_lzma2_hook(inbuf, &insize, outbuf, &outsize,
+				  check_hook, &check));
+  free(workspace);
+
+  if (verbosity > 0)
+    {
+      dbg_printf("%s(%p, [%zu -> %zu], %p, [%zu -> %zu]) = %d (%s)",
+		 (threads != 1 ? "uncompress_lzma2_mt" :
+		  slack ? "uncompress_lzma2_slack" : "uncompress_lzma2"),
 		 inbuf, saved_insize, insize, outbuf, outbufsize, outsize,
-		 (int) status, s);
+		 (int) status, status_string(status));
+      dbg_printf("Decoded in %.3f ms with %ld page faults",
+		 (now() - start) * 1e3, page_faults() - faults);
     }
 
   /* Sanity check */
@@ -332,33 +2367,28 @@ main (int argc, char *argv[])
     errx(3, "input buffer overrun (insize = %zu -> %zu)",
 	 saved_insize, insize);
 
-  for (size_t offset = 0; offset < outsize; )
-    {
-      ssize_t nwritten
-	= write(STDOUT_FILENO, outbuf + offset, outsize - offset);
-      if (nwritten < 0)
-	err(1, "(standard output)");
-      offset += nwritten;
-    }
+  write_mapped(outbuf, outsize, 1);
+  if (threads != 1 || slack)
+    check_update(&check, outbuf, outsize);
 
+ verify:
   if (status != UNCOMPRESS_OK)
     return 1;
 
-  if (format == FMT_XZ_CRC32)
+  if (format == FMT_XZ && check.type != CHECK_NONE)
     {
       if (saved_insize - insize > 3)
 	errx(1, "invalid block padding (%zu bytes)", saved_insize - insize);
 
-      const uint_least32_t recorded_crc = read_aligned_le32(&inbuf[saved_insize]);
-      const uint_least32_t computed_crc	= crc32(outbuf, outsize);
-      if (recorded_crc != computed_crc)
-	errx(1, "CRC32 mismatch (recorded %.8" PRIxLEAST32 ", computed %.8" PRIxLEAST32 ")",
-	     recorded_crc, computed_crc);
+      if (!check_verify(&check, &inbuf[saved_insize]))
+	errx(1, "%s mismatch", check_name(check.type));
       else if (verbosity)
-	dbg_printf("CRC32 = %.8" PRIxLEAST32 ", OK", computed_crc);
+	dbg_printf("%s OK", check_name(check.type));
     }
-  else if (check_crc)
-    errx(1, "%s: No 32-bit CRC", filename);
+  else if (require_check)
+    errx(1, "%s: No supported integrity check", filename);
+  else if (format == FMT_XZ && checktype != CHECK_NONE && verbosity)
+    dbg_printf("Check type %#x not verified", checktype);
 
   return 0;
 }
@@ -28,6 +28,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef DEBUG
@@ -45,7 +46,20 @@ extern void dbg_printf (const char *, ...)
 
 #include "uncompress_lzma2.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+# include <cpuid.h>
+#endif
+
+/* STAT(Expr) evaluates Expr only when collecting statistics. */
+#ifdef UNCOMPRESS_LZMA2_STATS
+# include <time.h>
+# define STAT(Expr)	((void) (Expr))
+#else
+# define STAT(Expr)	((void) 0)
+#endif
+
 #define UNLIKELY(Cond)	__builtin_expect((Cond), 0)
+#define ALWAYS_INLINE	inline __attribute__((always_inline))
 
 /* Range coder constants */
 #define RC_SHIFT_BITS	8
@@ -114,6 +128,52 @@ struct lzma_len_dec
     probability_t	high[LEN_HIGH_SYMBOLS];
   };
 
+#ifdef UNCOMPRESS_LZMA2_PROBS_GROUPED
+/*
+ * Probabilities of the decisions at the beginning of each symbol
+ * grouped by state: is_match and is_rep0_long of a state fill one
+ * cache line (all position states), and is_rep to is_rep2 of a state
+ * are 8 bytes next to each other, so that a short repeated match of
+ * a state touches 2 lines instead of 4.  Literal coders (of which the
+ * first 1 << (lc + lp) are used) start at a cache line boundary.
+ */
+struct lzma_state_probs
+  {
+    probability_t	is_match[POS_STATES_MAX];
+    probability_t	is_rep0_long[POS_STATES_MAX];
+  };
+
+struct lzma_rep_probs
+  {
+    probability_t	is_rep;
+    probability_t	is_rep0;
+    probability_t	is_rep1;
+    probability_t	is_rep2;
+  };
+
+struct lzma_probabilities
+  {
+    struct lzma_state_probs	state[STATES];
+    struct lzma_rep_probs	rep[STATES];
+    probability_t	dist_slot[DIST_STATES][DIST_SLOTS];
+    probability_t	dist_special[FULL_DISTANCES - DIST_MODEL_END];
+    probability_t	dist_align[ALIGN_SIZE];
+    struct lzma_len_dec	match_len_dec;
+    struct lzma_len_dec	rep_len_dec;
+    _Alignas(64)
+    probability_t	literal[LITERAL_CODERS_MAX][LITERAL_CODER_SIZE];
+  };
+
+# define PROBS_IS_MATCH(P, S, PS)	(&(P)->state[S].is_match[PS])
+# define PROBS_IS_REP0_LONG(P, S, PS)	(&(P)->state[S].is_rep0_long[PS])
+# define PROBS_IS_REP(P, S)		(&(P)->rep[S].is_rep)
+# define PROBS_IS_REP0(P, S)		(&(P)->rep[S].is_rep0)
+# define PROBS_IS_REP1(P, S)		(&(P)->rep[S].is_rep1)
+# define PROBS_IS_REP2(P, S)		(&(P)->rep[S].is_rep2)
+
+_Static_assert(sizeof(struct lzma_state_probs) == 64,
+	       "lzma_state_probs is not a cache line");
+#else
 struct lzma_probabilities
   {
     probability_t	is_match[STATES][POS_STATES_MAX];
@@ -130,11 +190,33 @@ struct lzma_probabilities
     probability_t	literal[LITERAL_CODERS_MAX][LITERAL_CODER_SIZE];
   };
 
-/* Check against PROBS_TOTAL */
-_Static_assert(sizeof(struct lzma_probabilities) ==
-	       sizeof(probability_t) * (1846 + LITERAL_CODERS_MAX * LITERAL_CODER_SIZE),
+# define PROBS_IS_MATCH(P, S, PS)	(&(P)->is_match[S][PS])
+# define PROBS_IS_REP0_LONG(P, S, PS)	(&(P)->is_rep0_long[S][PS])
+# define PROBS_IS_REP(P, S)		(&(P)->is_rep[S])
+# define PROBS_IS_REP0(P, S)		(&(P)->is_rep0[S])
+# define PROBS_IS_REP1(P, S)		(&(P)->is_rep1[S])
+# define PROBS_IS_REP2(P, S)		(&(P)->is_rep2[S])
+#endif
+
+/* Check against PROBS_TOTAL (padding before the literal coders aside) */
+#define PROBS_NONLITERAL_SIZE	(sizeof(probability_t) * 1846)
+_Static_assert(offsetof(struct lzma_probabilities, literal) ==
+	       ((PROBS_NONLITERAL_SIZE
+		 + _Alignof(struct lzma_probabilities) - 1)
+		& -_Alignof(struct lzma_probabilities)) &&
+	       sizeof(struct lzma_probabilities) ==
+	       offsetof(struct lzma_probabilities, literal)
+	       + sizeof(probability_t) * LITERAL_CODERS_MAX * LITERAL_CODER_SIZE,
 	       "size of lzma_probabilities does not match PROBS_TOTAL");
 
+/* Where uncompress_lzma2_resume() continues */
+enum lzma2_resume
+  {
+    RESUME_NONE,		/* Not resumable */
+    RESUME_STORED,		/* In a stored chunk */
+    RESUME_LZMA,		/* In an LZMA chunk */
+  };
+
 struct frame
   {
     const uint8_t *	inbuf;
@@ -146,8 +228,24 @@ struct frame
     uint_least32_t	rc_code;
     uint_least32_t	rc_range;
     size_t		uncompressed, compressed;
+    size_t		dict_origin, dict_start;
     enum lzma_state	state;
     uint_least32_t	rep[4];
+    /* Saved at UNCOMPRESS_OUTLIMIT: UNCOMPRESSED is then what is left
+       of the current chunk, and MATCH_PENDING what is left of the last
+       match (in an LZMA chunk). */
+    enum lzma2_resume	resume;
+    unsigned int	match_pending;
+    /* Bytes writable after the output buffer for wide match copies,
+       promised by the caller (bytes after the data are then not
+       preserved); with 0, nothing after each match is written. */
+    size_t		out_slack;
+    /* Matches must not be farther than this (the dictionary size of
+       the streaming decoder); SIZE_MAX for no limit */
+    size_t		dict_limit;
+    _Bool		need_properties;
+    _Bool		dict_reset_done;
+    _Alignas(UNCOMPRESS_LZMA2_WORKSPACE_ALIGN)
     struct lzma_probabilities probs;
   };
 
@@ -160,11 +258,45 @@ lzma_reset (struct frame *const frame)
   frame->rep[2] = 0;
   frame->rep[3] = 0;
   
-  probability_t *probs = &frame->probs.is_match[0][0];
-  unsigned int i = sizeof(frame->probs) / sizeof(probability_t);
-  do
-    *probs++ = RC_BIT_MODEL_TOTAL  / 2;
-  while (--i);
+  /* Only 1 << (lc + lp) literal coders can be used with current
+     properties; the others are reset when properties change,
+     which always comes with a state reset. */
+  uint8_t *const probs = (uint8_t *) &frame->probs;
+  size_t const size = offsetof(struct lzma_probabilities,
+			       literal[1 << (frame->lc + frame->lp)]);
+  probability_t block[16 / sizeof(probability_t)];
+  size_t i;
+
+  /* Fill in 16-byte blocks (the last one may overlap with others). */
+  for (i = 0; i < sizeof(block) / sizeof(block[0]); i++)
+    block[i] = RC_BIT_MODEL_TOTAL / 2;
+  for (i = 0; i < size - sizeof(block); i += sizeof(block))
+    __builtin_memcpy(&probs[i], block, sizeof(block));
+  __builtin_memcpy(&probs[size - sizeof(block)], block, sizeof(block));
+}
+
+/* Decode LZMA properties byte into lc/lp/pb. */
+static _Bool
+lzma_props (uint_fast8_t props, uint_least8_t *const lcp,
+	    uint_least8_t *const lpp, uint_least8_t *const pbp)
+{
+  uint_fast8_t tmp;
+
+  DBG("Property %u", props);
+  if (UNLIKELY(props > (4 * 5 + 4) * 9 + 8))
+    return 0;
+  for (tmp = 0; props >= 5 * 9; tmp++)
+    props -= 5 * 9;
+  *pbp = tmp;
+  for (tmp = 0; props >= 9; tmp++)
+    props -= 9;
+  *lpp = tmp;
+  *lcp = props;
+  /* LZMA2 limits lc + lp to 4 (LITERAL_CODERS_MAX). */
+  if (UNLIKELY(*lcp + *lpp > 4))
+    return 0;
+  DBG("lc/lp/pb = %u/%u/%u", *lcp, *lpp, *pbp);
+  return 1;
 }
 
 static inline uint_fast32_t
@@ -178,480 +310,1825 @@ read_unaligned_be32 (const void *const vp)
 	  (uint_fast32_t) p[3]);
 }
 
-static inline _Bool
-rc_normalize (struct frame *const frame)
+/*
+ * Range decoder and LZMA decoder state which changes for every symbol.
+ * lzma_chunk() copies them from struct frame into a local variable, so
+ * that they can be kept in registers while decoding (struct frame may
+ * be aliased by stores to the output buffer).
+ */
+#ifdef UNCOMPRESS_LZMA2_RC64
+/*
+ * With UNCOMPRESS_LZMA2_RC64, CODE holds BITS (0 to 32) bits of input
+ * beyond the 32-bit code of the range decoder, which is CODE >> BITS,
+ * so that rc_normalize() loads input once for 4 bytes.  Bounds are
+ * scaled up by BITS instead of scaling CODE down; as
+ * CODE < BOUND << BITS exactly when (CODE >> BITS) < BOUND, results are
+ * the same as the byte-wise decoder.
+ */
+typedef uint_fast64_t rc_code_t;
+# define RC_REFILL_BYTES	4
+# define RC_CODE_SHIFT(L)	((L)->bits)
+#else
+typedef uint_least32_t rc_code_t;
+# define RC_REFILL_BYTES	1
+# define RC_CODE_SHIFT(L)	0
+#endif
+
+struct lzma_local
+  {
+    const uint8_t *	in;		/* Next input byte */
+    const uint8_t *	in_limit;	/* End of the chunk (rc_limit) */
+    uint_least32_t	range;
+    rc_code_t		code;
+#ifdef UNCOMPRESS_LZMA2_RC64
+    unsigned int	bits;		/* Bits of input read ahead in CODE */
+#endif
+    size_t		outcount;
+    enum lzma_state	state;
+    uint_least32_t	rep[4];
+#ifdef UNCOMPRESS_LZMA2_STATS
+    struct uncompress_lzma2_stats *stats;
+#endif
+  };
+
+/*
+ * Maximum number of input bytes a single LZMA symbol can consume
+ * (LZMA_IN_REQUIRED in xz-embedded).  While at least this many bytes
+ * are left in the chunk, the range decoder need not check the limit.
+ */
+#define LZMA_IN_REQUIRED	21
+
+/* Input bytes needed to run the unchecked variants, including bytes
+   read ahead by the last refill of a symbol */
+#define RC_IN_REQUIRED	(LZMA_IN_REQUIRED + RC_REFILL_BYTES - 1)
+
+/* Next input byte not yet shifted into the range decoder */
+#define RC_IN(L)	((L)->in - RC_CODE_SHIFT(L) / 8)
+
+/*
+ * Functions below taking CHECKED argument are always inlined, so that
+ * the unchecked variants (CHECKED == 0, used only while enough input is
+ * left) get neither limit checks nor error propagation.
+ */
+
+static ALWAYS_INLINE _Bool
+rc_normalize (struct lzma_local *const l, _Bool const checked)
 {
-  if (frame->rc_range < RC_TOP_VALUE)
+  if (l->range < RC_TOP_VALUE)
     {
-      frame->rc_range <<= RC_SHIFT_BITS;
-      if (frame->incount >= frame->rc_limit)
+      l->range <<= RC_SHIFT_BITS;
+#ifdef UNCOMPRESS_LZMA2_RC64
+      if (l->bits == 0)
+	{
+	  /* While unchecked, RC_IN_REQUIRED bytes are left for a symbol. */
+	  if (!checked)
+	    {
+	      l->code = (l->code << 32) | read_unaligned_be32(l->in);
+	      l->in += 4;
+	      l->bits = 32;
+	    }
+	  else if (l->in >= l->in_limit)
+	    return 0;
+	  else
+	    {
+	      l->code = (l->code << RC_SHIFT_BITS) | *l->in++;
+	      l->bits = RC_SHIFT_BITS;
+	    }
+	}
+      l->bits -= RC_SHIFT_BITS;
+#else
+      if (checked && l->in >= l->in_limit)
 	return 0;
-      frame->rc_code = (frame->rc_code << RC_SHIFT_BITS) | frame->inbuf[frame->incount++];
-      DBG("rc_normalize: range=%#x, code=%#x", frame->rc_range, frame->rc_code);
+      l->code = (l->code << RC_SHIFT_BITS) | *l->in++;
+#endif
+      STAT(l->stats->normalizes++);
+      DBG("rc_normalize: range=%#x, code=%#x", l->range,
+	  (unsigned int) (l->code >> RC_CODE_SHIFT(l)));
     }
   return 1;
 }
 
-static int
-rc_bit (struct frame *const frame, probability_t *const prob)
+static ALWAYS_INLINE int
+rc_bit (struct lzma_local *const l, probability_t *const prob)
 {
   probability_fast_t p = *prob;
-  uint_fast32_t bound = (frame->rc_range >> RC_BIT_MODEL_TOTAL_BITS) * p;
+  uint_fast32_t bound = (l->range >> RC_BIT_MODEL_TOTAL_BITS) * p;
+  rc_code_t const scaled = (rc_code_t) bound << RC_CODE_SHIFT(l);
   int bit;
 
-  if (frame->rc_code < bound)
+  if (l->code < scaled)
     {
-      frame->rc_range = bound;
+      l->range = bound;
       *prob = p + ((RC_BIT_MODEL_TOTAL - p) >> RC_MOVE_BITS);
       bit = 0;
     }
   else
     {
-      frame->rc_range -= bound;
-      frame->rc_code -= bound;
+      l->range -= bound;
+      l->code -= scaled;
       *prob = p - (p >> RC_MOVE_BITS);
       bit = 1;
     }
   DBG("rc_bit: bound=%#" PRIxFAST32 ", range=%#x, code=%#x, *prob=%#x -> %d",
-      bound, frame->rc_range, frame->rc_code, *prob, bit);
+      bound, l->range, (unsigned int) (l->code >> RC_CODE_SHIFT(l)),
+      *prob, bit);
   return bit;
 }
 
-static unsigned int
-rc_bittree (struct frame *const frame, probability_t *const probs,
-	    unsigned int const limit)
+static ALWAYS_INLINE unsigned int
+rc_bittree (struct lzma_local *const l, probability_t *const probs,
+	    unsigned int const limit, _Bool const checked)
 {
   unsigned int symbol = 1;
 
   do
     {
-      if (!rc_normalize(frame))
+      if (!rc_normalize(l, checked))
 	return 0;
-      symbol = (symbol << 1) | rc_bit(frame, &probs[symbol]);
+      symbol = (symbol << 1) | rc_bit(l, &probs[symbol]);
     }
   while (symbol < limit);
   return symbol;
 }
 
-static unsigned int
-lzma_len (struct frame *const frame, struct lzma_len_dec *const l,
-	  uint32_t pos_state)
+static ALWAYS_INLINE unsigned int
+lzma_len (struct lzma_local *const l, struct lzma_len_dec *const ld,
+	  uint32_t pos_state, _Bool const checked)
 {
   probability_t *probs;
   unsigned int limit;
   unsigned int len;
   unsigned int symbol;
 
-  if (UNLIKELY(!rc_normalize(frame)))
+  if (UNLIKELY(!rc_normalize(l, checked)))
     return 0;
-  if (!rc_bit(frame, &l->choice))
+  if (!rc_bit(l, &ld->choice))
     {
-      probs = l->low[pos_state];
+      probs = ld->low[pos_state];
       limit = LEN_LOW_SYMBOLS;
       len = MATCH_LEN_MIN;
     }
   else
     {
-      if (UNLIKELY(!rc_normalize(frame)))
+      if (UNLIKELY(!rc_normalize(l, checked)))
 	return 0;
-      if (!rc_bit(frame, &l->choice2))
+      if (!rc_bit(l, &ld->choice2))
 	{
-	  probs = l->mid[pos_state];
+	  probs = ld->mid[pos_state];
 	  limit = LEN_MID_SYMBOLS;
 	  len = MATCH_LEN_MIN + LEN_LOW_SYMBOLS;
 	}
       else
 	{
-	  probs = l->high;
+	  probs = ld->high;
 	  limit = LEN_HIGH_SYMBOLS;
 	  len = MATCH_LEN_MIN + LEN_LOW_SYMBOLS + LEN_MID_SYMBOLS;
 	}
     }
-  symbol = rc_bittree(frame, probs, limit);
-  if (UNLIKELY(!symbol))
+  symbol = rc_bittree(l, probs, limit, checked);
+  if (checked && UNLIKELY(!symbol))
     return 0;
   return len + symbol - limit;
 }
 
-enum uncompress_status
-uncompress_lzma2 (const void *const inbuf, size_t *const insizep,
-		  void *const outbuf, size_t *const outsizep)
+/*
+ * Decode a literal (8 bits) with PROBS, unrolled.
+ * Returns 0x100 + the literal byte, or 0 if the input is exhausted.
+ */
+static ALWAYS_INLINE unsigned int
+lzma_literal (struct lzma_local *const l, probability_t *const probs,
+	      _Bool const checked)
 {
-  enum uncompress_status ret = UNCOMPRESS_OK;
-  _Bool need_properties = 0;
-  _Bool dict_reset_done = 0;
-  struct frame frame;
-  size_t dict_origin;
+  unsigned int symbol = 1;
 
-#define outbuf	((uint8_t *) outbuf)
+#define LITERAL_BIT()						\
+  do								\
+    {								\
+      if (UNLIKELY(!rc_normalize(l, checked)))			\
+	return 0;						\
+      symbol = (symbol << 1) | rc_bit(l, &probs[symbol]);	\
+    }								\
+  while (0)
+  LITERAL_BIT(); LITERAL_BIT(); LITERAL_BIT(); LITERAL_BIT();
+  LITERAL_BIT(); LITERAL_BIT(); LITERAL_BIT(); LITERAL_BIT();
+#undef LITERAL_BIT
+  return symbol;
+}
 
-  frame.inbuf = inbuf;
-  frame.incount	= 0;
-  frame.inlimit	= *insizep;
-  frame.outcount = 0;
+/*
+ * Decode a literal after a match, with MATCH_BYTE (the byte at rep0)
+ * as context, unrolled.  Once a decoded bit differs from the one in
+ * MATCH_BYTE, OFFSET becomes 0 and the rest is decoded as a plain literal.
+ * OFFSET is updated without a branch; the bit itself is decoded
+ * with a branch, which turned out to be faster than conditional moves.
+ */
+static ALWAYS_INLINE unsigned int
+lzma_matched_literal (struct lzma_local *const l, probability_t *const probs,
+		      unsigned int match_byte, _Bool const checked)
+{
+  unsigned int symbol = 1;
+  unsigned int offset = 0x100;
 
-#if 0
-#define RETURN(X)	do { ret = (X); goto finish; } while (0)
-#else
-#define RETURN(X)	do { ret = (X); DBG("%s:%u: returning %d", __func__, __LINE__, (int) ret); goto finish; } while (0)
-#endif
+#define MATCHED_LITERAL_BIT()						\
+  do									\
+    {									\
+      unsigned int const match_bit = (match_byte <<= 1) & offset;	\
+      unsigned int bit;							\
+									\
+      if (UNLIKELY(!rc_normalize(l, checked)))				\
+	return 0;							\
+      bit = rc_bit(l, &probs[offset + match_bit + symbol]);		\
+      symbol = (symbol << 1) | bit;					\
+      offset &= match_bit ^ (bit - 1);					\
+    }									\
+  while (0)
+  MATCHED_LITERAL_BIT(); MATCHED_LITERAL_BIT();
+  MATCHED_LITERAL_BIT(); MATCHED_LITERAL_BIT();
+  MATCHED_LITERAL_BIT(); MATCHED_LITERAL_BIT();
+  MATCHED_LITERAL_BIT(); MATCHED_LITERAL_BIT();
+#undef MATCHED_LITERAL_BIT
+  return symbol;
+}
 
-  for (;;)
+/*
+ * Number of bytes copy_match() may write past the end of a match.
+ * Blocks may run past the match only if that many bytes after it
+ * are writable (as promised by frame->out_slack); those bytes are not
+ * yet decoded and will be overwritten by later symbols anyway.
+ */
+#define MATCH_COPY_SLACK	UNCOMPRESS_LZMA2_OUTPUT_SLACK
+
+/* Bytes writable from output offset POS for a match of LEN bytes,
+   up to ROOM_END (or only the match if ROOM_END is 0) */
+#define MATCH_ROOM(Room_end, Pos, Len)					\
+  ((Room_end) ? (Room_end) - (Pos) : (Len))
+
+/* Copy WIDTH bytes as a unit (an unaligned vector load and store).
+   A vector temporary lets variants with AVX2 use 32-byte registers,
+   where GCC would expand a plain memcpy() 16 bytes at a time. */
+#define COPY_BLOCK(Dst, Src, Width)					\
+  do									\
+    {									\
+      uint8_t Block_ __attribute__((vector_size(Width)));		\
+									\
+      __builtin_memcpy(&Block_, (Src), (Width));			\
+      __builtin_memcpy((Dst), &Block_, (Width));			\
+    }									\
+  while (0)
+
+/*
+ * Copy LEN (> 0) bytes from DIST bytes before DST to DST, where ROOM (>= LEN)
+ * bytes from DST are writable.  The source may overlap with the destination
+ * (DIST < LEN), in which case the last DIST bytes are repeated.
+ */
+static ALWAYS_INLINE void
+copy_match (uint8_t *dst, size_t const dist, unsigned int len,
+	    size_t const room)
+{
+  const uint8_t *src = dst - dist;
+  int left = len;
+
+  if (UNLIKELY(room - len < MATCH_COPY_SLACK))
     {
-      uint_fast8_t control;
+      /* Nothing after the match may be written: whole blocks (as far
+	 as DIST allows), then the rest byte by byte */
+      if (dist >= 16)
+	for (; left >= 16; left -= 16, dst += 16, src += 16)
+	  COPY_BLOCK(dst, src, 16);
+      else if (dist >= 8)
+	for (; left >= 8; left -= 8, dst += 8, src += 8)
+	  COPY_BLOCK(dst, src, 8);
+      for (; left > 0; left--)
+	*dst++ = *src++;
+      return;
+    }
 
-      if (UNLIKELY(frame.incount >= frame.inlimit))
-	RETURN(UNCOMPRESS_INLIMIT);
-      control = frame.inbuf[frame.incount++];
-      if (control == 0x00)	/* End marker */
-	RETURN(UNCOMPRESS_OK);
-      else if (control >= 0xE0 || control == 0x01)
+  /* A block of WIDTH <= DIST bytes read from SRC has already been
+     written completely, so copying in blocks gives the same result
+     as copying byte by byte. */
+  if (dist >= 32)
+    {
+      do
 	{
-	  need_properties = 1;
-	  dict_origin = frame.outcount;
-	  dict_reset_done = 1;
+	  COPY_BLOCK(dst, src, 32);
+	  dst += 32;
+	  src += 32;
 	}
-      else if (UNLIKELY(!dict_reset_done))
-	RETURN(UNCOMPRESS_DATA_ERROR);
+      while ((left -= 32) > 0);
+    }
+  else if (dist >= 16)
+    {
+      do
+	{
+	  COPY_BLOCK(dst, src, 16);
+	  dst += 16;
+	  src += 16;
+	}
+      while ((left -= 16) > 0);
+    }
+  else if (dist >= 8)
+    {
+      do
+	{
+	  COPY_BLOCK(dst, src, 8);
+	  dst += 8;
+	  src += 8;
+	}
+      while ((left -= 8) > 0);
+    }
+  else if ((dist & (dist - 1)) == 0)
+    {
+      /* DIST is 1, 2 or 4: broadcast the pattern to 16 bytes. */
+      uint64_t pattern;
+      uint8_t block[16];
 
-      if (control >= 0x80)	/* LZMA compressed chunk */
+      switch (dist)
 	{
-	  uint_least32_t uncompressed, compressed;
-	  uint_least32_t out_limit;
-	  _Bool more_run;
+	case 1:
+	  pattern = *src * UINT64_C(0x0101010101010101);
+	  break;
+	case 2:
+	  {
+	    uint16_t x;
 
-	  if (control >= 0xC0)
-	    need_properties = 0;
-	  else if (UNLIKELY(need_properties))
-	    RETURN(UNCOMPRESS_DATA_ERROR);
+	    __builtin_memcpy(&x, src, sizeof(x));
+	    pattern = x * UINT64_C(0x0001000100010001);
+	  }
+	  break;
+	default:
+	  {
+	    uint32_t x;
 
-	  if ((frame.inlimit - frame.incount) < 4)
-	    RETURN(UNCOMPRESS_INLIMIT);
-	  else
-	    {
-	      const uint8_t *const p = &frame.inbuf[frame.incount];
-	      frame.incount += 4;
+	    __builtin_memcpy(&x, src, sizeof(x));
+	    pattern = x * UINT64_C(0x0000000100000001);
+	  }
+	  break;
+	}
+      __builtin_memcpy(&block[0], &pattern, sizeof(pattern));
+      __builtin_memcpy(&block[8], &pattern, sizeof(pattern));
+      do
+	{
+	  COPY_BLOCK(dst, block, 16);
+	  dst += 16;
+	}
+      while ((left -= 16) > 0);
+    }
+  else
+    do
+      *dst++ = *src++;
+    while (--len);
+}
 
-	      uncompressed = (((control & 0x1F) << 16) |
-			      ((p[0] << 8) | p[1])) + 1;
-	      compressed = ((p[2] << 8) | p[3]) + 1;
-	      DBG("uncompressed = %u, compressed = %u",
-		  uncompressed, compressed);
-	    }
-	  if (control >= 0xC0)
-	    {
-	      uint_fast8_t props;
-	      uint_fast8_t tmp;
+/* Matches at least this far back are likely to miss the L1 cache. */
+#define FAR_MATCH_DISTANCE	(1 << 15)
 
-	      if (frame.incount >= frame.inlimit)
-		RETURN(UNCOMPRESS_INLIMIT);
-	      props = frame.inbuf[frame.incount++];
-	      DBG("Property %u", props);
-	      if (UNLIKELY(props > (4 * 5 + 4) * 9 + 8))
-		RETURN(UNCOMPRESS_DATA_ERROR);
-	      for (tmp = 0; props >= 5 * 9; tmp++)
-		props -= 5 * 9;
-	      frame.pb = tmp;
-	      for (tmp = 0; props >= 9; tmp++)
-		props -= 9;
-	      frame.lp = tmp;
-	      frame.lc = props;
-	      DBG("lc/lp/pb = %u/%u/%u", props, tmp, frame.pb);
-	    }
-	  if (control >= 0xA0)
-	    lzma_reset(&frame);
+/*
+ * Prefetch the source of a far match, which starts at most BACK bytes
+ * before DST (and less than 16 bytes after that while the low bits of
+ * the distance are not decoded yet), if it is within the AVAIL bytes
+ * of the dictionary.  The two lines cover the first 48 bytes at least;
+ * the rest of a long match is left to the hardware prefetcher.
+ */
+static ALWAYS_INLINE void
+prefetch_match (const uint8_t *const dst, size_t const avail,
+		uint_fast32_t const back)
+{
+  if (back >= FAR_MATCH_DISTANCE && back <= avail)
+    {
+      __builtin_prefetch(dst - back, 0, 0);
+      __builtin_prefetch(dst - back + 64, 0, 0);
+    }
+}
 
-	  frame.rc_limit = frame.incount + compressed;
-	  if (frame.rc_limit > frame.inlimit)
-	    frame.rc_limit = frame.inlimit;
+#ifdef UNCOMPRESS_LZMA2_STATS
+/* Statistics of all decompressors so far */
+static struct uncompress_lzma2_stats stats_total;
 
-	  if (UNLIKELY(compressed < RC_INIT_BYTES))
-	    RETURN(UNCOMPRESS_DATA_ERROR);
-	  if (UNLIKELY((frame.inlimit - frame.incount) < RC_INIT_BYTES))
-	    RETURN(UNCOMPRESS_INLIMIT);
-	  frame.rc_range = UINT32_C(0xFFFFFFFF);	/* rc_reset */
-	  frame.rc_code = read_unaligned_be32(&frame.inbuf[frame.incount + 1]);
-	  frame.incount += RC_INIT_BYTES;
-	  DBG("rc_read_init: code=%u", frame.rc_code);	  
-
-	  out_limit = *outsizep;
-	  more_run = 0;
-	  if (out_limit - frame.outcount > uncompressed)
+/* Bucket of match length LEN (>= 2) in match_len[] */
+static inline unsigned int
+stat_len_bucket (unsigned int const len)
+{
+  unsigned int const bucket = 31 - __builtin_clz(len - 1);
+
+  return (bucket < UNCOMPRESS_LZMA2_LEN_BUCKETS ?
+	  bucket : UNCOMPRESS_LZMA2_LEN_BUCKETS - 1);
+}
+
+static unsigned long long
+stat_now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Add STATS to stats_total. */
+static void
+stat_merge (const struct uncompress_lzma2_stats *const stats)
+{
+  const unsigned long long *const src = (const unsigned long long *) stats;
+  unsigned long long *const dst = (unsigned long long *) &stats_total;
+
+  for (size_t i = 0; i < sizeof(*stats) / sizeof(*src); i++)
+    if (src[i])
+      __atomic_fetch_add(&dst[i], src[i], __ATOMIC_RELAXED);
+}
+#endif
+
+int
+uncompress_lzma2_get_stats (struct uncompress_lzma2_stats *const stats,
+			    int const reset)
+{
+#ifdef UNCOMPRESS_LZMA2_STATS
+  unsigned long long *const src = (unsigned long long *) &stats_total;
+  unsigned long long *const dst = (unsigned long long *) stats;
+
+  for (size_t i = 0; i < sizeof(*stats) / sizeof(*src); i++)
+    dst[i] += (reset ?
+	       __atomic_exchange_n(&src[i], 0, __ATOMIC_RELAXED) :
+	       __atomic_load_n(&src[i], __ATOMIC_RELAXED));
+  return 1;
+#else
+  (void) stats;
+  (void) reset;
+  return 0;
+#endif
+}
+
+enum lzma_main_result
+  {
+    MAIN_DONE,			/* Reached OUT_LIMIT */
+    MAIN_NEAR_LIMIT,		/* Less than LZMA_IN_REQUIRED bytes left */
+    MAIN_RC_LIMIT,		/* Reached the end of input */
+    MAIN_DATA_ERROR,
+    MAIN_OUTLIMIT,		/* Match truncated at OUT_LIMIT */
+  };
+
+/*
+ * Decode LZMA symbols until OUT_LIMIT is reached, or (unless CHECKED)
+ * until input left in the chunk becomes less than LZMA_IN_REQUIRED.
+ * Bytes in OUTBUF up to OUTSIZE (>= OUT_LIMIT) may be scribbled.
+ * LC, LP and PB are the LZMA properties, which are constants
+ * in specialized variants below.
+ *
+ * Symbols are decoded and expanded in a single pass.  Splitting them
+ * into a pass producing (literal | length, distance) tokens and another
+ * expanding them does not work for LZMA: the probabilities for each
+ * literal are chosen by the byte before it (the last byte of a match,
+ * if it follows one), and a literal after a match is decoded against
+ * the byte at rep0, both of which are known only after all earlier
+ * matches are copied.  Independent work is found across segments
+ * instead (uncompress_lzma2_mt()).
+ */
+static ALWAYS_INLINE enum lzma_main_result
+lzma_main (struct frame *const frame, struct lzma_local *const l,
+	   uint8_t *const outbuf, size_t const room_end, size_t const out_limit,
+	   _Bool const more_run, _Bool const checked,
+	   unsigned int const lc, unsigned int const lp, unsigned int const pb)
+{
+  unsigned int const lp_mask = (1 << lp) - 1;
+  unsigned int const pb_mask = (1 << pb) - 1;
+  size_t const dict_origin = frame->dict_origin;
+  size_t const dict_start = frame->dict_start;
+
+  for (;;)
+    {
+      unsigned int pos_state;
+
+      if (!checked && UNLIKELY(l->in_limit - l->in < RC_IN_REQUIRED))
+	return MAIN_NEAR_LIMIT;
+      if (UNLIKELY(!rc_normalize(l, checked)))
+	return MAIN_RC_LIMIT;
+      if (l->outcount >= out_limit)
+	return MAIN_DONE;
+      pos_state = (l->outcount - dict_origin) & pb_mask;
+      if (!rc_bit(l, PROBS_IS_MATCH(&frame->probs, l->state, pos_state)))
+	{
+	  /* lzma_literal_probs */
+	  uint_fast8_t prev_byte = (l->outcount > dict_start) ? outbuf[l->outcount - 1] : 0;
+	  probability_t *const probs
+	    = frame->probs.literal[(prev_byte >> (8 - lc)) |
+				   (((l->outcount - dict_origin) & lp_mask) << lc)];
+	  unsigned int symbol;
+	  /* lzma_literal */
+	  if (l->state < LIT_STATES)
 	    {
-	      out_limit = frame.outcount + uncompressed;
-	      more_run = 1;
+	      STAT(l->stats->literals++);
+	      symbol = lzma_literal(l, probs, checked);
 	    }
+	  else if (UNLIKELY(l->outcount - dict_start <= l->rep[0]))
+	    return MAIN_DATA_ERROR;
+	  else
+	    {
+	      STAT(l->stats->matched_literals++);
+	      symbol = lzma_matched_literal(l, probs,
+					    outbuf[l->outcount - l->rep[0] - 1],
+					    checked);
+	    }
+	  if (checked && UNLIKELY(!symbol))
+	    return MAIN_RC_LIMIT;
+	  DBG("lzma_literal: symbol=%#x @%zu", symbol, l->outcount);
+	  outbuf[l->outcount++] = symbol;
+	  /* lzma_state_literal */
+	  if (l->state <= STATE_SHORTREP_LIT_LIT)
+	    l->state = STATE_LIT_LIT;
+	  else if (l->state <= STATE_LIT_SHORTREP)
+	    l->state -= 3;
+	  else
+	    l->state -= 6;
+	}
+      else if (UNLIKELY(!rc_normalize(l, checked)))
+	return MAIN_RC_LIMIT;
+      else
+	{
+	  unsigned int len;
 
-	  /* lzma_main */
-	  for (;;)
+	  if (rc_bit(l, PROBS_IS_REP(&frame->probs, l->state)))
 	    {
-	      unsigned int pos_state;
-	      if (UNLIKELY(!rc_normalize(&frame)))
-		goto rc_limit_reached;
-	      if (frame.outcount >= out_limit)
-		break;
-	      pos_state = (frame.outcount - dict_origin) & ((1 << frame.pb) - 1);
-	      if (!rc_bit(&frame, &frame.probs.is_match[frame.state][pos_state]))
+	      /* lzma_rep_match */
+	      DBG("lzma_rep_match");
+	      if (UNLIKELY(!rc_normalize(l, checked)))
+		return MAIN_RC_LIMIT;
+	      if (!rc_bit(l, PROBS_IS_REP0(&frame->probs, l->state)))
 		{
-		  /* lzma_literal_probs */
-		  uint_fast8_t prev_byte = (frame.outcount > dict_origin) ? outbuf[frame.outcount - 1] : 0;
-		  probability_t *const probs = frame.probs.literal[(prev_byte >> (8 - frame.lc)) |
-								   (((frame.outcount - dict_origin) & ((1 << frame.lp) - 1)) << frame.lc)];
-		  unsigned int symbol;
-		  /* lzma_literal */
-		  if (frame.state < LIT_STATES)
+		  if (UNLIKELY(!rc_normalize(l, checked)))
+		    return MAIN_RC_LIMIT;
+		  if (!rc_bit(l, PROBS_IS_REP0_LONG(&frame->probs, l->state, pos_state)))
 		    {
-		      symbol = rc_bittree(&frame, probs, 0x100);
-		      if (UNLIKELY(!symbol))
-			goto rc_limit_reached;
-		    }
-		  else if (UNLIKELY(frame.outcount - dict_origin <= frame.rep[0]))
-		    RETURN(UNCOMPRESS_DATA_ERROR);
-		  else
-		    {
-		      unsigned int match_byte = outbuf[frame.outcount - frame.rep[0] - 1];
-		      unsigned int offset = 0x100;
-		      
-		      symbol = 1;
-		      do
-			{
-			  unsigned int match_bit = (match_byte <<= 1) & offset;
-			  unsigned int i = offset + match_bit + symbol;
-
-			  if (UNLIKELY(!rc_normalize(&frame)))
-			    goto rc_limit_reached;
-			  symbol <<= 1;
-			  if (rc_bit(&frame, &probs[i]))
-			    {
-			      symbol |= 1;
-			      offset &= match_bit;
-			    }
-			  else
-			    offset &= ~match_bit;
-			}
-		      while (symbol < 0x100);
+		      /* lzma_state_short_rep */
+		      l->state = (l->state < LIT_STATES ?
+				  STATE_LIT_SHORTREP :
+				  STATE_NONLIT_REP);
+		      len = 1;
+		      STAT(l->stats->short_reps++);
+		      goto got_len;
 		    }
-		  DBG("lzma_literal: symbol=%#x @%zu", symbol, frame.outcount);
-		  outbuf[frame.outcount++] = symbol;
-		  /* lzma_state_literal */
-		  if (frame.state <= STATE_SHORTREP_LIT_LIT)
-		    frame.state = STATE_LIT_LIT;
-		  else if (frame.state <= STATE_LIT_SHORTREP)
-		    frame.state -= 3;
-		  else
-		    frame.state -= 6;
+		  STAT(l->stats->reps[0]++);
 		}
-	      else if (UNLIKELY(!rc_normalize(&frame)))
-		goto rc_limit_reached;
 	      else
 		{
-		  unsigned int len;
+		  uint_fast32_t tmp;
 
-		  if (rc_bit(&frame, &frame.probs.is_rep[frame.state]))
+		  if (UNLIKELY(!rc_normalize(l, checked)))
+		    return MAIN_RC_LIMIT;
+		  if (!rc_bit(l, PROBS_IS_REP1(&frame->probs, l->state)))
+		    {
+		      STAT(l->stats->reps[1]++);
+		      tmp = l->rep[1];
+		    }
+		  else
 		    {
-		      /* lzma_rep_match */
-		      DBG("lzma_rep_match");
-		      if (UNLIKELY(!rc_normalize(&frame)))
-			goto rc_limit_reached;
-		      if (!rc_bit(&frame, &frame.probs.is_rep0[frame.state]))
+		      if (UNLIKELY(!rc_normalize(l, checked)))
+			return MAIN_RC_LIMIT;
+		      if (!rc_bit(l, PROBS_IS_REP2(&frame->probs, l->state)))
 			{
-			  if (UNLIKELY(!rc_normalize(&frame)))
-			    goto rc_limit_reached;
-			  if (!rc_bit(&frame, &frame.probs.is_rep0_long[frame.state][pos_state]))
-			    {
-			      /* lzma_state_short_rep */
-			      frame.state = (frame.state < LIT_STATES ?
-					     STATE_LIT_SHORTREP :
-					     STATE_NONLIT_REP);
-			      len = 1;
-			      goto got_len;
-			    }
+			  STAT(l->stats->reps[2]++);
+			  tmp = l->rep[2];
 			}
 		      else
 			{
-			  uint_fast32_t tmp;
-
-			  if (UNLIKELY(!rc_normalize(&frame)))
-			    goto rc_limit_reached;
-			  if (!rc_bit(&frame, &frame.probs.is_rep1[frame.state]))
-			    tmp = frame.rep[1];
-			  else
-			    {
-			      if (UNLIKELY(!rc_normalize(&frame)))
-				goto rc_limit_reached;
-			      if (!rc_bit(&frame, &frame.probs.is_rep2[frame.state]))
-				tmp = frame.rep[2];
-			      else
-				{
-				  tmp = frame.rep[3];
-				  frame.rep[3] = frame.rep[2];
-				}
-			      frame.rep[2] = frame.rep[1];
-			    }
-			  frame.rep[1] = frame.rep[0];
-			  frame.rep[0] = tmp;
+			  STAT(l->stats->reps[3]++);
+			  tmp = l->rep[3];
+			  l->rep[3] = l->rep[2];
 			}
-		      /* lzma_state_long_rep */
-		      frame.state = (frame.state < LIT_STATES ?
-				     STATE_LIT_LONGREP :
-				     STATE_NONLIT_REP);
-
-		      len = lzma_len(&frame, &frame.probs.rep_len_dec, pos_state);
-		      if (UNLIKELY(!len))
-			goto rc_limit_reached;
-		    got_len:
-		      ;
+		      l->rep[2] = l->rep[1];
+		    }
+		  l->rep[1] = l->rep[0];
+		  l->rep[0] = tmp;
+		}
+	      /* The distance is known before the length. */
+	      prefetch_match(&outbuf[l->outcount], l->outcount - dict_start,
+			     l->rep[0] + 1);
+
+	      /* lzma_state_long_rep */
+	      l->state = (l->state < LIT_STATES ?
+			  STATE_LIT_LONGREP :
+			  STATE_NONLIT_REP);
+
+	      len = lzma_len(l, &frame->probs.rep_len_dec, pos_state, checked);
+	      if (checked && UNLIKELY(!len))
+		return MAIN_RC_LIMIT;
+	      STAT(l->stats->match_len[stat_len_bucket(len)]++);
+	    got_len:
+	      ;
+	    }
+	  else
+	    {
+	      /* lzma_match */
+	      probability_t *probs;
+	      unsigned int dist_slot;
+
+	      DBG("lzma_match");
+
+	      /* lzma_state_match */
+	      l->state = (l->state < LIT_STATES ?
+			  STATE_LIT_MATCH :
+			  STATE_NONLIT_MATCH);
+
+	      l->rep[3] = l->rep[2];
+	      l->rep[2] = l->rep[1];
+	      l->rep[1] = l->rep[0];
+
+	      len = lzma_len(l, &frame->probs.match_len_dec, pos_state, checked);
+	      if (checked && UNLIKELY(!len))
+		return MAIN_RC_LIMIT;
+
+	      probs = frame->probs.dist_slot[len < (DIST_STATES + MATCH_LEN_MIN) ?
+					     len - MATCH_LEN_MIN :
+					     DIST_STATES - 1];
+	      dist_slot = rc_bittree(l, probs, DIST_SLOTS, checked);
+	      if (checked && UNLIKELY(!dist_slot))
+		return MAIN_RC_LIMIT;
+	      DBG("dist_slot=%u", dist_slot - DIST_SLOTS);
+	      STAT(l->stats->matches++);
+	      STAT(l->stats->match_len[stat_len_bucket(len)]++);
+	      STAT(l->stats->dist_slot[dist_slot - DIST_SLOTS]++);
+	      if ((dist_slot -= DIST_SLOTS) < DIST_MODEL_START)
+		l->rep[0] = dist_slot;
+	      else
+		{
+		  unsigned int symbol, mask;
+		  unsigned int limit = (dist_slot >> 1) - 1;
+		  l->rep[0] = 2 + (dist_slot & 1);
+
+		  if (dist_slot < DIST_MODEL_END)
+		    {
+		      l->rep[0] <<= limit;
+		      probs = &frame->probs.dist_special[l->rep[0] - dist_slot] - 1;
+		      DBG("lzma_match: rep0=%" PRIuLEAST32 ", dist_slot=%u, probs=dist_special%+td",
+			  l->rep[0], dist_slot, probs - frame->probs.dist_special);
 		    }
 		  else
 		    {
-		      /* lzma_match */
-		      probability_t *probs;
-		      unsigned int dist_slot;
-
-		      DBG("lzma_match");
-
-		      /* lzma_state_match */
-		      frame.state = (frame.state < LIT_STATES ?
-				     STATE_LIT_MATCH :
-				     STATE_NONLIT_MATCH);
-
-		      frame.rep[3] = frame.rep[2];
-		      frame.rep[2] = frame.rep[1];
-		      frame.rep[1] = frame.rep[0];
-
-		      len = lzma_len(&frame, &frame.probs.match_len_dec, pos_state);
-		      if (UNLIKELY(!len))
-			goto rc_limit_reached;
-
-		      probs = frame.probs.dist_slot[len < (DIST_STATES + MATCH_LEN_MIN) ?
-						    len - MATCH_LEN_MIN :
-						    DIST_STATES - 1];
-		      dist_slot = rc_bittree(&frame, probs, DIST_SLOTS);
-		      if (UNLIKELY(!dist_slot))
-			goto rc_limit_reached;
-		      DBG("dist_slot=%u", dist_slot - DIST_SLOTS);
-		      if ((dist_slot -= DIST_SLOTS) < DIST_MODEL_START)
-			frame.rep[0] = dist_slot;
-		      else
+		      /* rc_direct */
+		      limit -= ALIGN_BITS;
+		      do
 			{
-			  unsigned int symbol, mask;
-			  unsigned int limit = (dist_slot >> 1) - 1;
-			  frame.rep[0] = 2 + (dist_slot & 1);
+			  if (UNLIKELY(!rc_normalize(l, checked)))
+			    return MAIN_RC_LIMIT;
+#ifdef UNCOMPRESS_LZMA2_RC64
+			  rc_code_t const scaled
+			    = (rc_code_t) (l->range >>= 1) << l->bits;
 
-			  if (dist_slot < DIST_MODEL_END)
+			  l->rep[0] <<= 1;
+			  if (l->code >= scaled)
 			    {
-			      frame.rep[0] <<= limit;
-			      probs = &frame.probs.dist_special[frame.rep[0] - dist_slot] - 1;
-			      DBG("lzma_match: rep0=%" PRIuLEAST32 ", dist_slot=%u, probs=dist_special%+td",
-				  frame.rep[0], dist_slot, probs - frame.probs.dist_special);
+			      l->code -= scaled;
+			      l->rep[0] |= 1;
 			    }
+#else
+			  l->code -= (l->range >>= 1);
+			  l->rep[0] <<= 1;
+			  if (l->code >> 31)
+			    l->code += l->range;
 			  else
-			    {
-			      /* rc_direct */
-			      limit -= ALIGN_BITS;
-			      do
-				{
-				  if (UNLIKELY(!rc_normalize(&frame)))
-				    goto rc_limit_reached;
-				  frame.rc_code -= (frame.rc_range >>= 1);
-				  frame.rep[0] <<= 1;
-				  if (frame.rc_code >> 31)
-				    frame.rc_code += frame.rc_range;
-				  else
-				    frame.rep[0] |= 1;
-				}
-			      while (--limit > 0);
-
-			      frame.rep[0] <<= ALIGN_BITS;
-			      limit = ALIGN_BITS;
-			      probs = frame.probs.dist_align;
-			    }
-			  /* rc_bittree_reverse */
-			  symbol = 1;
-			  limit = 1 << limit;
-			  mask = 1;
-			  do
-			    {
-			      unsigned int bit;
-
-			      if (UNLIKELY(!rc_normalize(&frame)))
-				goto rc_limit_reached;
-			      bit = rc_bit(&frame, &probs[symbol]);
-			      symbol <<= 1;
-			      if (bit)
-				{
-				  symbol |= 1;
-				  frame.rep[0] += mask;
-				}
-			    }
-			  while ((mask <<= 1) < limit);
+			    l->rep[0] |= 1;
+#endif
 			}
-		    }
+		      while (--limit > 0);
 
-		  /* dict_repeat */
-		  DBG("dict_repeat: len=%u, dist=%u @%zu",
-		      len, frame.rep[0], frame.outcount);
-		  if (UNLIKELY(frame.outcount - dict_origin <= frame.rep[0]))
-		    RETURN(UNCOMPRESS_DATA_ERROR);
-		  else
+		      /* All but ALIGN_BITS of the distance are known. */
+		      l->rep[0] <<= ALIGN_BITS;
+		      prefetch_match(&outbuf[l->outcount],
+				     l->outcount - dict_start,
+				     l->rep[0] + ALIGN_SIZE);
+		      limit = ALIGN_BITS;
+		      probs = frame->probs.dist_align;
+		    }
+		  /* rc_bittree_reverse */
+		  symbol = 1;
+		  limit = 1 << limit;
+		  mask = 1;
+		  do
 		    {
-		      uint8_t *dst = &outbuf[frame.outcount];
-		      const uint8_t *src = dst - frame.rep[0] - 1;
+		      unsigned int bit;
 
-		      if (UNLIKELY((out_limit - frame.outcount) < len))
+		      if (UNLIKELY(!rc_normalize(l, checked)))
+			return MAIN_RC_LIMIT;
+		      bit = rc_bit(l, &probs[symbol]);
+		      symbol <<= 1;
+		      if (bit)
 			{
-			  len = out_limit - frame.outcount;
-			  ret = more_run ? UNCOMPRESS_DATA_ERROR : UNCOMPRESS_OUTLIMIT;
+			  symbol |= 1;
+			  l->rep[0] += mask;
 			}
-		      frame.outcount += len;
-		      do
-			*dst++ = *src++;
-		      while (--len);
-
-		      if (UNLIKELY(ret != UNCOMPRESS_OK))
-			goto finish;
 		    }
+		  while ((mask <<= 1) < limit);
 		}
+	      if (UNLIKELY(l->rep[0] >= frame->dict_limit))
+		return MAIN_DATA_ERROR;
 	    }
 
-	  if (UNLIKELY(frame.incount < frame.rc_limit))
-	    RETURN(UNCOMPRESS_DATA_ERROR);
-	}
-      else if (UNLIKELY(control > 0x02))
-	RETURN(UNCOMPRESS_DATA_ERROR);
-      else if (UNLIKELY((frame.inlimit - frame.incount) < 2))
-	RETURN(UNCOMPRESS_INLIMIT);
-      else
-	{
-	  unsigned int copy_len;
-	  const uint8_t *const p = &frame.inbuf[frame.incount];
-	  frame.incount += 2;
+	  /* dict_repeat */
+	  DBG("dict_repeat: len=%u, dist=%u @%zu",
+	      len, l->rep[0], l->outcount);
+	  if (UNLIKELY(l->outcount - dict_start <= l->rep[0]))
+	    return MAIN_DATA_ERROR;
+	  else
+	    {
+	      enum lzma_main_result result = MAIN_DONE;
+
+	      STAT(l->stats->far_matches += l->rep[0] >= FAR_MATCH_DISTANCE);
+	      STAT(l->stats->far_match_bytes
+		   += l->rep[0] >= FAR_MATCH_DISTANCE ? len : 0);
+	      if (UNLIKELY((out_limit - l->outcount) < len))
+		{
+		  frame->match_pending = len - (out_limit - l->outcount);
+		  len = out_limit - l->outcount;
+		  result = more_run ? MAIN_DATA_ERROR : MAIN_OUTLIMIT;
+		}
+	      copy_match(&outbuf[l->outcount], (size_t) l->rep[0] + 1, len,
+			 MATCH_ROOM(room_end, l->outcount, len));
+	      l->outcount += len;
+
+	      if (UNLIKELY(result != MAIN_DONE))
+		return result;
+	    }
+	}
+    }
+}
+
+/*
+ * Variants of lzma_main() for common properties (xz's default lc=3,lp=0,pb=2
+ * and lc=0,lp=2,pb=2 for 32-bit aligned data), in which masks and shifts
+ * are folded, and the generic one.  Each of them runs the unchecked
+ * lzma_main() first, then the checked one for the end of the chunk.
+ */
+/*
+ * The main loop is compiled for several instruction sets (wider copies
+ * with AVX2, flag-less shifts with BMI2), and the best one the CPU
+ * supports is chosen at the first use.  Environment variable
+ * UNCOMPRESS_LZMA2_ISA can name another one (if supported) for testing.
+ */
+typedef enum lzma_main_result lzma_main_fn (struct frame *,
+					    struct lzma_local *,
+					    uint8_t */* outbuf */,
+					    size_t /* room_end */,
+					    size_t /* out_limit */,
+					    _Bool /* more_run */);
+
+enum lzma_isa
+  {
+    ISA_BASELINE,
+    ISA_BMI2,
+    ISA_AVX2,
+  };
+
+struct lzma_kernels
+  {
+    const char *	name;
+    enum lzma_isa	isa;
+    lzma_main_fn *	main_3_0_2;
+    lzma_main_fn *	main_0_2_2;
+    lzma_main_fn *	main_generic;
+  };
+
+#define LZMA_MAIN_VARIANT(Name, Attr, Lc, Lp, Pb)			\
+static Attr enum lzma_main_result					\
+Name (struct frame *const frame, struct lzma_local *const l,		\
+      uint8_t *const outbuf, size_t const room_end,			\
+      size_t const out_limit, _Bool const more_run)			\
+{									\
+  enum lzma_main_result result						\
+    = lzma_main(frame, l, outbuf, room_end, out_limit, more_run, 0,	\
+		(Lc), (Lp), (Pb));					\
+									\
+  if (result == MAIN_NEAR_LIMIT)					\
+    result = lzma_main(frame, l, outbuf, room_end, out_limit, more_run, 1, \
+		       (Lc), (Lp), (Pb));				\
+  return result;							\
+}
+
+/* Variants for common properties and the generic one, for an ISA */
+#define LZMA_KERNELS(Name, Isa, Attr)					\
+LZMA_MAIN_VARIANT(lzma_main_3_0_2_##Name, Attr, 3, 0, 2)		\
+LZMA_MAIN_VARIANT(lzma_main_0_2_2_##Name, Attr, 0, 2, 2)		\
+LZMA_MAIN_VARIANT(lzma_main_generic_##Name, Attr,			\
+		  frame->lc, frame->lp, frame->pb)			\
+static const struct lzma_kernels lzma_kernels_##Name =			\
+  {									\
+    #Name, (Isa), lzma_main_3_0_2_##Name, lzma_main_0_2_2_##Name,	\
+    lzma_main_generic_##Name,						\
+  };
+
+LZMA_KERNELS(baseline, ISA_BASELINE, )
+#if defined(__x86_64__) && defined(__GNUC__)
+# define HAVE_LZMA_KERNELS_X86 1
+/* lzma_kernels_supported() checks every feature named in these. */
+LZMA_KERNELS(bmi2, ISA_BMI2, __attribute__((target("bmi,bmi2,lzcnt"))))
+LZMA_KERNELS(avx2, ISA_AVX2,
+	     __attribute__((target("avx2,bmi,bmi2,lzcnt,popcnt,"
+				    "tune=haswell"))))
+#endif
+
+#undef LZMA_KERNELS
+#undef LZMA_MAIN_VARIANT
+
+/* All variants, the preferred first */
+static const struct lzma_kernels *const lzma_kernels_all[] =
+  {
+#ifdef HAVE_LZMA_KERNELS_X86
+    &lzma_kernels_avx2,
+    &lzma_kernels_bmi2,
+#endif
+    &lzma_kernels_baseline,
+  };
+
+static const struct lzma_kernels *lzma_kernels_selected;
+
+#ifdef HAVE_LZMA_KERNELS_X86
+/* LZCNT (ABM of AMD), which __builtin_cpu_supports() of older compilers
+   cannot test: CPUID 0x80000001, bit 5 of ECX */
+static _Bool
+cpu_has_lzcnt (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  return (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) &&
+	  (ecx & (1 << 5)));
+}
+#endif
+
+static _Bool
+lzma_kernels_supported (const struct lzma_kernels *const kernels)
+{
+  switch (kernels->isa)
+    {
+#ifdef HAVE_LZMA_KERNELS_X86
+    case ISA_AVX2:
+      __builtin_cpu_init();
+      return (__builtin_cpu_supports("avx2") &&
+	      __builtin_cpu_supports("bmi") &&
+	      __builtin_cpu_supports("bmi2") &&
+	      __builtin_cpu_supports("popcnt") &&
+	      cpu_has_lzcnt());
+    case ISA_BMI2:
+      __builtin_cpu_init();
+      return (__builtin_cpu_supports("bmi") &&
+	      __builtin_cpu_supports("bmi2") &&
+	      cpu_has_lzcnt());
+#endif
+    default:
+      return 1;
+    }
+}
+
+/* Variants of the main loop to be used.  Concurrent first calls may
+   select them more than once, with the same result. */
+static const struct lzma_kernels *
+lzma_kernels (void)
+{
+  const struct lzma_kernels *selected
+    = __atomic_load_n(&lzma_kernels_selected, __ATOMIC_ACQUIRE);
+
+  if (UNLIKELY(!selected))
+    {
+      const char *const name = getenv("UNCOMPRESS_LZMA2_ISA");
+      size_t i;
+
+      for (i = 0; i < sizeof(lzma_kernels_all) / sizeof(lzma_kernels_all[0]);
+	   i++)
+	if (lzma_kernels_supported(lzma_kernels_all[i]))
+	  {
+	    if (!selected)
+	      selected = lzma_kernels_all[i];
+	    if (!name || !strcmp(name, lzma_kernels_all[i]->name))
+	      {
+		selected = lzma_kernels_all[i];
+		break;
+	      }
+	  }
+      __atomic_store_n(&lzma_kernels_selected, selected, __ATOMIC_RELEASE);
+    }
+  return selected;
+}
+
+#if 0
+#define RETURN(X)	do { ret = (X); goto finish; } while (0)
+#else
+#define RETURN(X)	do { ret = (X); DBG("%s:%u: returning %d", __func__, __LINE__, (int) ret); goto finish; } while (0)
+#endif
+
+/*
+ * Decode an LZMA chunk at frame->inbuf[frame->incount] (just after
+ * the chunk header) into OUTBUF[frame->outcount..OUTSIZE).
+ * Bytes in OUTBUF from frame->dict_start are available as dictionary,
+ * and positions are counted from frame->dict_origin.
+ * Bytes after the decoded data are overwritten with garbage only if
+ * frame->out_slack is not 0 (up to that many bytes after OUTSIZE).
+ * If RESUME, decoding continues from the range coder state and the rest
+ * of the last match saved in FRAME when the chunk (with UNCOMPRESSED
+ * bytes left) stopped at the end of the output buffer; frame->incount
+ * is then in the middle of the chunk.  On return, frame->uncompressed
+ * is what is left of the chunk.
+ */
+static enum uncompress_status
+lzma_chunk (struct frame *const frame, uint8_t *const outbuf,
+	    size_t const outsize,
+	    uint_least32_t const uncompressed, uint_least32_t const compressed,
+	    _Bool const resume)
+{
+  enum uncompress_status ret = UNCOMPRESS_OK;
+  struct lzma_local l;
+  size_t out_limit;
+  _Bool more_run;
+  enum lzma_main_result result = MAIN_DONE;
+
+  if (resume)
+    {
+      l.range = frame->rc_range;
+      l.code = frame->rc_code;
+      l.in = &frame->inbuf[frame->incount];
+    }
+  else
+    {
+      frame->rc_limit = frame->incount + compressed;
+      if (frame->rc_limit > frame->inlimit)
+	frame->rc_limit = frame->inlimit;
+
+      if (UNLIKELY(compressed < RC_INIT_BYTES))
+	RETURN(UNCOMPRESS_DATA_ERROR);
+      if (UNLIKELY((frame->inlimit - frame->incount) < RC_INIT_BYTES))
+	RETURN(UNCOMPRESS_INLIMIT);
+      l.range = UINT32_C(0xFFFFFFFF);	/* rc_reset */
+      l.code = read_unaligned_be32(&frame->inbuf[frame->incount + 1]);
+      DBG("rc_read_init: code=%u", (unsigned int) l.code);
+      l.in = &frame->inbuf[frame->incount + RC_INIT_BYTES];
+      frame->match_pending = 0;
+    }
+#ifdef UNCOMPRESS_LZMA2_RC64
+  l.bits = 0;
+#endif
+  l.in_limit = &frame->inbuf[frame->rc_limit];
+  l.outcount = frame->outcount;
+  l.state = frame->state;
+  l.rep[0] = frame->rep[0];
+  l.rep[1] = frame->rep[1];
+  l.rep[2] = frame->rep[2];
+  l.rep[3] = frame->rep[3];
+#ifdef UNCOMPRESS_LZMA2_STATS
+  struct uncompress_lzma2_stats stats = { .lzma_chunks = 1 };
+  unsigned long long const start_ns = stat_now_ns();
+  l.stats = &stats;
+#endif
+
+  /* more_run is set if the whole chunk fits in the output buffer;
+     otherwise decoding stops at the end of the buffer. */
+  size_t const chunk_start = l.outcount;
+  /* End of the bytes copy_match() may write (including the slack after
+     the output buffer), or 0 if nothing after a match may be written */
+  size_t room_end = 0;
+  if (frame->out_slack &&
+      __builtin_add_overflow(outsize, frame->out_slack, &room_end))
+    room_end = SIZE_MAX;
+  out_limit = outsize;
+  more_run = 0;
+  if (out_limit - l.outcount >= uncompressed)
+    {
+      out_limit = l.outcount + uncompressed;
+      more_run = 1;
+    }
+
+  if (UNLIKELY(frame->match_pending) && l.outcount < out_limit)
+    {
+      /* The rest of the match cut off by the last buffer */
+      unsigned int len = frame->match_pending;
+
+      if (len > out_limit - l.outcount)
+	{
+	  len = out_limit - l.outcount;
+	  result = more_run ? MAIN_DATA_ERROR : MAIN_OUTLIMIT;
+	}
+      copy_match(&outbuf[l.outcount], (size_t) l.rep[0] + 1, len,
+		 MATCH_ROOM(room_end, l.outcount, len));
+      l.outcount += len;
+      frame->match_pending -= len;
+    }
+
+  const struct lzma_kernels *const kernels = lzma_kernels();
+  if (result != MAIN_DONE)
+    ;
+  else if (UNLIKELY(frame->match_pending))
+    result = more_run ? MAIN_DATA_ERROR : MAIN_OUTLIMIT;
+  else if (frame->lc == 3 && frame->lp == 0 && frame->pb == 2)
+    result = kernels->main_3_0_2(frame, &l, outbuf, room_end, out_limit,
+				 more_run);
+  else if (frame->lc == 0 && frame->lp == 2 && frame->pb == 2)
+    result = kernels->main_0_2_2(frame, &l, outbuf, room_end, out_limit,
+				 more_run);
+  else
+    result = kernels->main_generic(frame, &l, outbuf, room_end, out_limit,
+				   more_run);
+
+  frame->incount = RC_IN(&l) - frame->inbuf;
+  frame->rc_range = l.range;
+  frame->rc_code = l.code >> RC_CODE_SHIFT(&l);
+  frame->outcount = l.outcount;
+  frame->state = l.state;
+  frame->rep[0] = l.rep[0];
+  frame->rep[1] = l.rep[1];
+  frame->rep[2] = l.rep[2];
+  frame->rep[3] = l.rep[3];
+  frame->uncompressed = uncompressed - (l.outcount - chunk_start);
+#ifdef UNCOMPRESS_LZMA2_STATS
+  stats.lzma_chunk_ns = stat_now_ns() - start_ns;
+  stat_merge(&stats);
+#endif
+
+  switch (result)
+    {
+    case MAIN_DONE:
+      break;
+    case MAIN_RC_LIMIT:
+      RETURN(frame->incount >= frame->inlimit ?
+	     UNCOMPRESS_INLIMIT :
+	     UNCOMPRESS_DATA_ERROR);
+    case MAIN_OUTLIMIT:
+      RETURN(UNCOMPRESS_OUTLIMIT);
+    default:
+      RETURN(UNCOMPRESS_DATA_ERROR);
+    }
+
+  if (UNLIKELY(!more_run))
+    RETURN(UNCOMPRESS_OUTLIMIT);
+  if (UNLIKELY(frame->incount < frame->rc_limit))
+    RETURN(UNCOMPRESS_DATA_ERROR);
+ finish:
+  return ret;
+}
+
+/* Output segments being built by uncompress_lzma2_sg() */
+struct sg
+  {
+    struct uncompress_lzma2_segment *segs;
+    size_t		nsegs, limit;
+    /* Stored chunks starting before input offset KNOWN_UNTIL can
+       (if KNOWN_FREE) or cannot be left in the input buffer. */
+    size_t		known_until;
+    _Bool		known_free;
+  };
+
+/* Append SIZE bytes at DATA to SG, extending the last segment if
+   DATA follows it immediately. */
+static void
+sg_add (struct sg *const sg, const uint8_t *const data, size_t const size)
+{
+  if (size == 0)
+    return;
+  if (sg->nsegs > 0 &&
+      ((const uint8_t *) sg->segs[sg->nsegs - 1].data
+       + sg->segs[sg->nsegs - 1].size) == data)
+    sg->segs[sg->nsegs - 1].size += size;
+  else if (sg->nsegs < sg->limit)
+    {
+      sg->segs[sg->nsegs].data = data;
+      sg->segs[sg->nsegs].size = size;
+      sg->nsegs++;
+    }
+}
+
+/* Whether the stored chunk whose data end at input offset END can be
+   left in the input buffer, i.e. no LZMA chunk refers to it as part
+   of the dictionary: it is followed only by stored chunks up to
+   the end marker or a dictionary reset. */
+static _Bool
+sg_stored_free (struct sg *const sg, const uint8_t *const in,
+		size_t const inlimit, size_t const end)
+{
+  size_t pos = end;
+
+  if (end < sg->known_until)
+    return sg->known_free;
+  for (;;)
+    {
+      uint_fast8_t control;
+
+      /* Not known if truncated; assume it is referred to. */
+      if (pos >= inlimit)
+	{
+	  sg->known_free = 0;
+	  break;
+	}
+      control = in[pos];
+      if (control == 0x00 || control == 0x01 || control >= 0xE0)
+	{
+	  sg->known_free = 1;
+	  break;
+	}
+      if (control != 0x02 || inlimit - pos < 3)
+	{
+	  sg->known_free = 0;
+	  break;
+	}
+      pos += 3 + ((in[pos + 1] << 8) | in[pos + 2]) + 1;
+    }
+  sg->known_until = pos;
+  return sg->known_free;
+}
+
+/* If RESUME, decoding continues in the chunk where the last call
+   (with the same input) stopped at the end of the output buffer.
+   SLACK is the number of bytes writable after the output buffer. */
+static enum uncompress_status
+lzma2_decode (struct frame *const frame,
+	      const void *const inbuf, size_t *const insizep,
+	      void *const outbuf, size_t *const outsizep, size_t const slack,
+	      uncompress_lzma2_hook_fn *const hook, void *const hook_arg,
+	      struct sg *const sg, _Bool const resume)
+{
+  enum uncompress_status ret = UNCOMPRESS_OK;
+  enum lzma2_resume resume_kind = RESUME_NONE;
+  unsigned int copy_len = 0;
+  const uint8_t *copy_src = NULL;
+
+#define outbuf	((uint8_t *) outbuf)
+
+  frame->inbuf = inbuf;
+  frame->inlimit	= *insizep;
+  frame->out_slack = slack;
+  frame->dict_limit = SIZE_MAX;
+  if (resume)
+    {
+      resume_kind = frame->resume;
+      frame->resume = RESUME_NONE;
+      if (resume_kind == RESUME_LZMA)
+	goto resume_lzma;
+      if (resume_kind == RESUME_STORED)
+	{
+	  copy_len = frame->uncompressed;
+	  copy_src = &frame->inbuf[frame->incount];
+	  goto resume_stored;
+	}
+      RETURN(UNCOMPRESS_DATA_ERROR);
+    }
+  frame->incount	= 0;
+  frame->outcount = 0;
+  frame->need_properties = 0;
+  frame->dict_reset_done = 0;
+  frame->resume = RESUME_NONE;
+
+  for (;;)
+    {
+      uint_fast8_t control;
+
+      if (UNLIKELY(frame->incount >= frame->inlimit))
+	RETURN(UNCOMPRESS_INLIMIT);
+      control = frame->inbuf[frame->incount++];
+      if (control == 0x00)	/* End marker */
+	RETURN(UNCOMPRESS_OK);
+      else if (control >= 0xE0 || control == 0x01)
+	{
+	  frame->need_properties = 1;
+	  frame->dict_origin = frame->dict_start = frame->outcount;
+	  frame->dict_reset_done = 1;
+	}
+      else if (UNLIKELY(!frame->dict_reset_done))
+	RETURN(UNCOMPRESS_DATA_ERROR);
+
+      if (control >= 0x80)	/* LZMA compressed chunk */
+	{
+	  uint_least32_t uncompressed, compressed;
+	  _Bool resuming = 0;
+
+	  if (control >= 0xC0)
+	    frame->need_properties = 0;
+	  else if (UNLIKELY(frame->need_properties))
+	    RETURN(UNCOMPRESS_DATA_ERROR);
+
+	  if ((frame->inlimit - frame->incount) < 4)
+	    RETURN(UNCOMPRESS_INLIMIT);
+	  else
+	    {
+	      const uint8_t *const p = &frame->inbuf[frame->incount];
+	      frame->incount += 4;
+
+	      uncompressed = (((control & 0x1F) << 16) |
+			      ((p[0] << 8) | p[1])) + 1;
+	      compressed = ((p[2] << 8) | p[3]) + 1;
+	      DBG("uncompressed = %u, compressed = %u",
+		  uncompressed, compressed);
+	    }
+	  if (control >= 0xC0)
+	    {
+	      if (frame->incount >= frame->inlimit)
+		RETURN(UNCOMPRESS_INLIMIT);
+	      if (UNLIKELY(!lzma_props(frame->inbuf[frame->incount++],
+				       &frame->lc, &frame->lp, &frame->pb)))
+		RETURN(UNCOMPRESS_DATA_ERROR);
+	    }
+	  if (control >= 0xA0)
+	    lzma_reset(frame);
+
+	  if (0)
+	    {
+	    resume_lzma:
+	      uncompressed = frame->uncompressed;
+	      compressed = 0;
+	      resuming = 1;
+	    }
+	  size_t const chunk_start = frame->outcount;
+	  ret = lzma_chunk(frame, outbuf, *outsizep, uncompressed, compressed,
+			   resuming);
+	  /* Even a partially decompressed chunk is a part of the output. */
+	  if (sg)
+	    sg_add(sg, &outbuf[chunk_start], frame->outcount - chunk_start);
+	  if (UNLIKELY(ret != UNCOMPRESS_OK))
+	    {
+	      resume_kind = RESUME_LZMA;
+	      goto finish;
+	    }
+	  if (hook)
+	    hook(hook_arg, &outbuf[chunk_start], frame->outcount - chunk_start);
+	}
+      else if (UNLIKELY(control > 0x02))
+	RETURN(UNCOMPRESS_DATA_ERROR);
+      else if (UNLIKELY((frame->inlimit - frame->incount) < 2))
+	RETURN(UNCOMPRESS_INLIMIT);
+      else
+	{
+	  const uint8_t *const p = &frame->inbuf[frame->incount];
+	  frame->incount += 2;
 	  copy_len = (p[0] << 8) + p[1] + 1;
-	  if (UNLIKELY((frame.inlimit - frame.incount) < copy_len))
+	  copy_src = &p[2];
+	resume_stored:
+	  frame->uncompressed = copy_len;
+	  if (UNLIKELY((frame->inlimit - frame->incount) < copy_len))
 	    {
-	      copy_len = frame.inlimit - frame.incount;
+	      copy_len = frame->inlimit - frame->incount;
 	      ret = UNCOMPRESS_INLIMIT;
 	    }
 
-	  if (UNLIKELY((*outsizep - frame.outcount) < copy_len))
+	  if (UNLIKELY((*outsizep - frame->outcount) < copy_len))
 	    {
-	      copy_len = *outsizep - frame.outcount;
+	      copy_len = *outsizep - frame->outcount;
 	      ret = UNCOMPRESS_OUTLIMIT;
 	    }
-	  frame.incount += copy_len;
-	  memcpy(&outbuf[frame.outcount], &p[2], copy_len);
-	  frame.outcount += copy_len;
+	  frame->incount += copy_len;
+	  if (sg && ret == UNCOMPRESS_OK &&
+	      /* Room for this and the next segment */
+	      sg->limit - sg->nsegs >= 2 &&
+	      sg_stored_free(sg, frame->inbuf, frame->inlimit,
+			     frame->incount))
+	    {
+	      /* Skip the copy; the output buffer is left as is */
+	      sg_add(sg, copy_src, copy_len);
+	      frame->outcount += copy_len;
+	    }
+	  else
+	    {
+	      memcpy(&outbuf[frame->outcount], copy_src, copy_len);
+	      frame->outcount += copy_len;
+	      if (sg)
+		sg_add(sg, &outbuf[frame->outcount - copy_len], copy_len);
+	    }
+	  frame->uncompressed -= copy_len;
 	  if (UNLIKELY(ret != UNCOMPRESS_OK))
-	    goto finish;
+	    {
+	      resume_kind = RESUME_STORED;
+	      goto finish;
+	    }
+	  STAT(__atomic_fetch_add(&stats_total.stored_chunks, 1,
+				  __ATOMIC_RELAXED));
+	  if (hook)
+	    hook(hook_arg, &outbuf[frame->outcount - copy_len], copy_len);
 	}
     }
 
- rc_limit_reached:
-  ret = (frame.incount >= frame.inlimit ?
-	 UNCOMPRESS_INLIMIT :
-	 UNCOMPRESS_DATA_ERROR);
  finish:
-  *insizep = frame.incount;
-  *outsizep = frame.outcount;
+  /* Only the end of the output buffer can be got over. */
+  if (ret == UNCOMPRESS_OUTLIMIT)
+    frame->resume = resume_kind;
+  *insizep = frame->incount;
+  *outsizep = frame->outcount;
   return ret;
 }
+
+#undef outbuf
+
+const char *
+uncompress_lzma2_isa (void)
+{
+  return lzma_kernels()->name;
+}
+
+size_t
+uncompress_lzma2_workspace_size (void)
+{
+  return sizeof(struct frame);
+}
+
+enum uncompress_status
+uncompress_lzma2_ex (const void *const inbuf, size_t *const insizep,
+		     void *const outbuf, size_t *const outsizep,
+		     void *const workspace)
+{
+  if (UNLIKELY(!workspace))
+    return UNCOMPRESS_NO_MEMORY;
+  return lzma2_decode(__builtin_assume_aligned(workspace,
+					       UNCOMPRESS_LZMA2_WORKSPACE_ALIGN),
+		      inbuf, insizep, outbuf, outsizep, 0, NULL, NULL, NULL, 0);
+}
+
+enum uncompress_status
+uncompress_lzma2_slack (const void *const inbuf, size_t *const insizep,
+			void *const outbuf, size_t *const outsizep,
+			void *const workspace, size_t const slack)
+{
+  if (UNLIKELY(!workspace))
+    return UNCOMPRESS_NO_MEMORY;
+  return lzma2_decode(__builtin_assume_aligned(workspace,
+					       UNCOMPRESS_LZMA2_WORKSPACE_ALIGN),
+		      inbuf, insizep, outbuf, outsizep, slack, NULL, NULL,
+		      NULL, 0);
+}
+
+enum uncompress_status
+uncompress_lzma2_resume (const void *const inbuf, size_t *const insizep,
+			 void *const outbuf, size_t *const outsizep,
+			 void *const workspace)
+{
+  if (UNLIKELY(!workspace))
+    return UNCOMPRESS_NO_MEMORY;
+  return lzma2_decode(__builtin_assume_aligned(workspace,
+					       UNCOMPRESS_LZMA2_WORKSPACE_ALIGN),
+		      inbuf, insizep, outbuf, outsizep, 0, NULL, NULL, NULL, 1);
+}
+
+enum uncompress_status
+uncompress_lzma2 (const void *const inbuf, size_t *const insizep,
+		  void *const outbuf, size_t *const outsizep)
+{
+  struct frame frame;
+
+  return lzma2_decode(&frame, inbuf, insizep, outbuf, outsizep, 0, NULL, NULL,
+		      NULL, 0);
+}
+
+enum uncompress_status
+uncompress_lzma2_hook (const void *const inbuf, size_t *const insizep,
+		       void *const outbuf, size_t *const outsizep,
+		       uncompress_lzma2_hook_fn *const hook, void *const arg)
+{
+  struct frame frame;
+
+  return lzma2_decode(&frame, inbuf, insizep, outbuf, outsizep, 0, hook, arg,
+		      NULL, 0);
+}
+
+enum uncompress_status
+uncompress_lzma2_hook_ex (const void *const inbuf, size_t *const insizep,
+			  void *const outbuf, size_t *const outsizep,
+			  uncompress_lzma2_hook_fn *const hook, void *const arg,
+			  void *const workspace)
+{
+  if (UNLIKELY(!workspace))
+    return UNCOMPRESS_NO_MEMORY;
+  return lzma2_decode(__builtin_assume_aligned(workspace,
+					       UNCOMPRESS_LZMA2_WORKSPACE_ALIGN),
+		      inbuf, insizep, outbuf, outsizep, 0, hook, arg, NULL, 0);
+}
+
+enum uncompress_status
+uncompress_lzma2_sg (const void *const inbuf, size_t *const insizep,
+		     void *const outbuf, size_t *const outsizep,
+		     struct uncompress_lzma2_segment *const segs,
+		     size_t *const nsegsp)
+{
+  struct frame frame;
+  struct sg sg = { .segs = segs, .limit = *nsegsp };
+  enum uncompress_status const ret
+    = lzma2_decode(&frame, inbuf, insizep, outbuf, outsizep, 0, NULL, NULL,
+		   &sg, 0);
+
+  *nsegsp = sg.nsegs;
+  return ret;
+}
+
+enum uncompress_status
+uncompress_lzma2_scan (const void *const inbuf, size_t *const insizep,
+		       struct uncompress_lzma2_chunk *const chunks,
+		       size_t *const nchunksp, size_t *const outsizep)
+{
+  enum uncompress_status ret = UNCOMPRESS_OK;
+  const uint8_t *const in = inbuf;
+  size_t const inlimit = *insizep;
+  size_t incount = 0, outcount = 0;
+  size_t nchunks = 0;
+  _Bool need_properties = 0;
+  _Bool dict_reset_done = 0;
+  uint_least8_t lc = 0, lp = 0, pb = 0;
+
+  for (;;)
+    {
+      uint_fast8_t control;
+      struct uncompress_lzma2_chunk chunk;
+
+      if (UNLIKELY(incount >= inlimit))
+	RETURN(UNCOMPRESS_INLIMIT);
+      control = in[incount];
+      if (control == 0x00)	/* End marker */
+	{
+	  incount++;
+	  break;
+	}
+
+      chunk.in_offset = incount;
+      chunk.out_offset = outcount;
+      if (control >= 0xE0 || control == 0x01)
+	{
+	  need_properties = 1;
+	  dict_reset_done = 1;
+	  chunk.reset = UNCOMPRESS_LZMA2_RESET_DICT;
+	}
+      else if (UNLIKELY(!dict_reset_done))
+	RETURN(UNCOMPRESS_DATA_ERROR);
+      else if (control >= 0xC0)
+	chunk.reset = UNCOMPRESS_LZMA2_RESET_PROPS;
+      else if (control >= 0xA0)
+	chunk.reset = UNCOMPRESS_LZMA2_RESET_STATE;
+      else
+	chunk.reset = UNCOMPRESS_LZMA2_RESET_NONE;
+
+      if (control >= 0x80)	/* LZMA compressed chunk */
+	{
+	  unsigned int const header_size = control >= 0xC0 ? 6 : 5;
+
+	  if (control < 0xC0 && UNLIKELY(need_properties))
+	    RETURN(UNCOMPRESS_DATA_ERROR);
+	  if (UNLIKELY((inlimit - incount) < header_size))
+	    RETURN(UNCOMPRESS_INLIMIT);
+	  if (control >= 0xC0)
+	    {
+	      if (UNLIKELY(!lzma_props(in[incount + 5], &lc, &lp, &pb)))
+		RETURN(UNCOMPRESS_DATA_ERROR);
+	      need_properties = 0;
+	    }
+	  chunk.type = UNCOMPRESS_LZMA2_CHUNK_LZMA;
+	  chunk.out_size = (((control & 0x1F) << 16) |
+			    (in[incount + 1] << 8) | in[incount + 2]) + 1;
+	  chunk.in_size = (((in[incount + 3] << 8) | in[incount + 4]) + 1 +
+			   header_size);
+	  if (UNLIKELY(chunk.in_size - header_size < RC_INIT_BYTES))
+	    RETURN(UNCOMPRESS_DATA_ERROR);
+	  chunk.lc = lc;
+	  chunk.lp = lp;
+	  chunk.pb = pb;
+	}
+      else if (UNLIKELY(control > 0x02))
+	RETURN(UNCOMPRESS_DATA_ERROR);
+      else if (UNLIKELY((inlimit - incount) < 3))
+	RETURN(UNCOMPRESS_INLIMIT);
+      else
+	{
+	  chunk.type = UNCOMPRESS_LZMA2_CHUNK_STORED;
+	  chunk.out_size = ((in[incount + 1] << 8) | in[incount + 2]) + 1;
+	  chunk.in_size = chunk.out_size + 3;
+	  chunk.lc = chunk.lp = chunk.pb = 0;
+	}
+      DBG("chunk %zu: control=%#x, in=%zu+%zu, out=%zu+%zu",
+	  nchunks, (unsigned int) control,
+	  chunk.in_offset, chunk.in_size, chunk.out_offset, chunk.out_size);
+
+      if (UNLIKELY((inlimit - incount) < chunk.in_size))
+	RETURN(UNCOMPRESS_INLIMIT);
+      incount += chunk.in_size;
+      outcount += chunk.out_size;
+      if (nchunks < *nchunksp)
+	chunks[nchunks] = chunk;
+      else
+	ret = UNCOMPRESS_OUTLIMIT;
+      nchunks++;
+    }
+
+ finish:
+  *insizep = incount;
+  *nchunksp = nchunks;
+  *outsizep = outcount;
+  return ret;
+}
+
+/*
+ * Streaming decoder
+ *
+ * A compressed chunk is decoded by lzma_chunk() in one go once all of
+ * its compressed data is available, either in the caller's input buffer
+ * or accumulated in stream->inbuf.  A stored chunk is copied as input
+ * arrives.  Either way decoded data go to the window first, which keeps
+ * the last dict_size bytes as dictionary, and are copied out to
+ * the caller's output buffer from there.
+ *
+ * The window is 2 * dict_size + LZMA2_UNCOMPRESSED_MAX bytes, and
+ * the last dict_size bytes are moved to its beginning when there is no
+ * room for the next chunk, so that each decoded byte is moved at most
+ * once on average.
+ */
+
+#define LZMA2_UNCOMPRESSED_MAX	(1 << 21)	/* Chunk size limits */
+#define LZMA2_COMPRESSED_MAX	(1 << 16)
+#define LZMA2_DICT_SIZE_MIN	4096
+
+enum stream_seq
+  {
+    SEQ_CONTROL,
+    SEQ_HEADER,
+    SEQ_STORED,
+    SEQ_COMPRESSED,
+    SEQ_END,
+    SEQ_ERROR,
+  };
+
+struct uncompress_lzma2_stream
+  {
+    struct frame	frame;
+    size_t		dict_size;
+    size_t		window_size;
+    size_t		drained;	/* Bytes in window already copied out */
+    size_t		inbuf_len;	/* Bytes in inbuf */
+    enum stream_seq	seq;
+    _Bool		need_properties;
+    _Bool		dict_reset_done;
+    uint_least8_t	control;
+    uint_least8_t	header_len, header_need;
+    uint8_t		header[5];
+    uint8_t		inbuf[LZMA2_COMPRESSED_MAX];
+    uint8_t		window[];
+  };
+
+static size_t
+stream_dict_size (size_t const dict_size)
+{
+  return dict_size < LZMA2_DICT_SIZE_MIN ? LZMA2_DICT_SIZE_MIN : dict_size;
+}
+
+size_t
+uncompress_lzma2_stream_size (size_t const dict_size)
+{
+  size_t size;
+
+  if (__builtin_mul_overflow(stream_dict_size(dict_size), 2, &size) ||
+      __builtin_add_overflow(size,
+			     (offsetof(struct uncompress_lzma2_stream, window) +
+			      LZMA2_UNCOMPRESSED_MAX + MATCH_COPY_SLACK),
+			     &size))
+    return 0;
+  return size;
+}
+
+struct uncompress_lzma2_stream *
+uncompress_lzma2_stream_init (void *const mem, size_t const dict_size)
+{
+  struct uncompress_lzma2_stream *const stream
+    = __builtin_assume_aligned(mem, UNCOMPRESS_LZMA2_WORKSPACE_ALIGN);
+
+  if (UNLIKELY(!stream || !uncompress_lzma2_stream_size(dict_size)))
+    return NULL;
+  stream->dict_size = stream_dict_size(dict_size);
+  stream->window_size = 2 * stream->dict_size + LZMA2_UNCOMPRESSED_MAX;
+  stream->drained = 0;
+  stream->inbuf_len = 0;
+  stream->seq = SEQ_CONTROL;
+  stream->need_properties = 0;
+  stream->dict_reset_done = 0;
+  stream->frame.outcount = 0;
+  stream->frame.dict_origin = 0;
+  stream->frame.dict_start = 0;
+  /* The window is followed by MATCH_COPY_SLACK spare bytes. */
+  stream->frame.out_slack = MATCH_COPY_SLACK;
+  /* Whatever the window happens to hold beyond the dictionary */
+  stream->frame.dict_limit = stream->dict_size;
+  return stream;
+}
+
+/* Make room for LEN bytes in the window.  All decoded data must have
+   been copied out. */
+static void
+stream_make_room (struct uncompress_lzma2_stream *const stream,
+		  size_t const len)
+{
+  struct frame *const frame = &stream->frame;
+  size_t keep, shift;
+
+  if (stream->window_size - frame->outcount >= len)
+    return;
+  keep = frame->outcount - frame->dict_start;
+  if (keep > stream->dict_size)
+    keep = stream->dict_size;
+  shift = frame->outcount - keep;
+  DBG("stream_make_room: shift=%zu, keep=%zu", shift, keep);
+  memmove(stream->window, &stream->window[shift], keep);
+  frame->outcount -= shift;
+  stream->drained -= shift;
+  /* dict_origin may wrap around, but is only used for
+     positions modulo a power of 2. */
+  frame->dict_origin -= shift;
+  frame->dict_start = (frame->dict_start > shift ?
+		       frame->dict_start - shift : 0);
+}
+
+/* Body of uncompress_lzma2_stream().  If DISCARD (for
+   uncompress_lzma2_validate()), OUTBUF is not used: decoded data of each
+   complete chunk are only passed to HOOK (if not NULL) from the window,
+   without limit on the output size. */
+static enum uncompress_status
+stream_decode (struct uncompress_lzma2_stream *const stream,
+	       const void *const inbuf, size_t *const insizep,
+	       void *const outbuf, size_t *const outsizep, _Bool const discard,
+	       uncompress_lzma2_hook_fn *const hook, void *const hook_arg)
+{
+  enum uncompress_status ret;
+  struct frame *const frame = &stream->frame;
+  const uint8_t *const in = inbuf;
+  uint8_t *const out = outbuf;
+  size_t const inlimit = *insizep, outlimit = discard ? 0 : *outsizep;
+  size_t incount = 0, outcount = 0;
+
+  for (;;)
+    {
+      /* A stored chunk is discarded once it is complete. */
+      if (stream->drained < frame->outcount &&
+	  !(discard && stream->seq == SEQ_STORED))
+	{
+	  size_t len = frame->outcount - stream->drained;
+
+	  if (discard)
+	    {
+	      if (hook)
+		hook(hook_arg, &stream->window[stream->drained], len);
+	      outcount += len;
+	      stream->drained += len;
+	    }
+	  else
+	    {
+	      if (len > outlimit - outcount)
+		len = outlimit - outcount;
+	      memcpy(&out[outcount], &stream->window[stream->drained], len);
+	      outcount += len;
+	      stream->drained += len;
+	      if (stream->drained < frame->outcount)
+		RETURN(UNCOMPRESS_OUTLIMIT);
+	    }
+	}
+
+      switch (stream->seq)
+	{
+	case SEQ_END:
+	  RETURN(UNCOMPRESS_OK);
+
+	case SEQ_ERROR:
+	  RETURN(UNCOMPRESS_DATA_ERROR);
+
+	case SEQ_CONTROL:
+	  if (incount >= inlimit)
+	    RETURN(UNCOMPRESS_INLIMIT);
+	  stream->control = in[incount++];
+	  if (stream->control == 0x00)	/* End marker */
+	    {
+	      stream->seq = SEQ_END;
+	      break;
+	    }
+	  else if (stream->control >= 0xE0 || stream->control == 0x01)
+	    {
+	      stream->need_properties = 1;
+	      stream->dict_reset_done = 1;
+	    }
+	  else if (UNLIKELY(!stream->dict_reset_done))
+	    goto data_error;
+
+	  if (stream->control >= 0x80)
+	    {
+	      if (stream->control >= 0xC0)
+		stream->need_properties = 0;
+	      else if (UNLIKELY(stream->need_properties))
+		goto data_error;
+	      stream->header_need = stream->control >= 0xC0 ? 5 : 4;
+	    }
+	  else if (UNLIKELY(stream->control > 0x02))
+	    goto data_error;
+	  else
+	    stream->header_need = 2;
+	  stream->header_len = 0;
+	  stream->seq = SEQ_HEADER;
+	  break;
+
+	case SEQ_HEADER:
+	  while (stream->header_len < stream->header_need)
+	    {
+	      if (incount >= inlimit)
+		RETURN(UNCOMPRESS_INLIMIT);
+	      stream->header[stream->header_len++] = in[incount++];
+	    }
+
+	  const uint8_t *const p = stream->header;
+	  if (stream->control >= 0x80)
+	    {
+	      frame->uncompressed = (((stream->control & 0x1F) << 16) |
+				     ((p[0] << 8) | p[1])) + 1;
+	      frame->compressed = ((p[2] << 8) | p[3]) + 1;
+	      if (stream->control >= 0xC0 &&
+		  UNLIKELY(!lzma_props(p[4],
+				       &frame->lc, &frame->lp, &frame->pb)))
+		goto data_error;
+	      stream->seq = SEQ_COMPRESSED;
+	    }
+	  else
+	    {
+	      frame->uncompressed = ((p[0] << 8) | p[1]) + 1;
+	      stream->seq = SEQ_STORED;
+	    }
+	  DBG("stream: control=%#x, uncompressed=%zu, compressed=%zu",
+	      (unsigned int) stream->control,
+	      frame->uncompressed, frame->compressed);
+
+	  if (stream->control >= 0xE0 || stream->control == 0x01)
+	    frame->dict_origin = frame->dict_start = frame->outcount;
+	  stream_make_room(stream, frame->uncompressed);
+	  if (stream->control >= 0xA0)
+	    lzma_reset(frame);
+	  stream->inbuf_len = 0;
+	  break;
+
+	case SEQ_STORED:
+	  if (incount >= inlimit)
+	    RETURN(UNCOMPRESS_INLIMIT);
+	  else
+	    {
+	      size_t len = frame->uncompressed;
+
+	      if (len > inlimit - incount)
+		len = inlimit - incount;
+	      memcpy(&stream->window[frame->outcount], &in[incount], len);
+	      incount += len;
+	      frame->outcount += len;
+	      if (!(frame->uncompressed -= len))
+		{
+		  stream->seq = SEQ_CONTROL;
+		  STAT(__atomic_fetch_add(&stats_total.stored_chunks, 1,
+					  __ATOMIC_RELAXED));
+		}
+	    }
+	  break;
+
+	case SEQ_COMPRESSED:
+	  if (stream->inbuf_len == 0 && inlimit - incount >= frame->compressed)
+	    {
+	      /* Whole chunk is available in the caller's buffer. */
+	      frame->inbuf = &in[incount];
+	      incount += frame->compressed;
+	    }
+	  else
+	    {
+	      size_t len = frame->compressed - stream->inbuf_len;
+
+	      if (len > inlimit - incount)
+		len = inlimit - incount;
+	      memcpy(&stream->inbuf[stream->inbuf_len], &in[incount], len);
+	      incount += len;
+	      if ((stream->inbuf_len += len) < frame->compressed)
+		RETURN(UNCOMPRESS_INLIMIT);
+	      frame->inbuf = stream->inbuf;
+	    }
+	  frame->incount = 0;
+	  frame->inlimit = frame->compressed;
+	  if (UNLIKELY(lzma_chunk(frame, stream->window, stream->window_size,
+				  frame->uncompressed, frame->compressed, 0)
+		       != UNCOMPRESS_OK))
+	    goto data_error;
+	  stream->seq = SEQ_CONTROL;
+	  break;
+	}
+    }
+
+ data_error:
+  stream->seq = SEQ_ERROR;
+  ret = UNCOMPRESS_DATA_ERROR;
+ finish:
+  *insizep = incount;
+  *outsizep = outcount;
+  return ret;
+}
+
+enum uncompress_status
+uncompress_lzma2_stream (struct uncompress_lzma2_stream *const stream,
+			 const void *const inbuf, size_t *const insizep,
+			 void *const outbuf, size_t *const outsizep)
+{
+  return stream_decode(stream, inbuf, insizep, outbuf, outsizep, 0,
+		       NULL, NULL);
+}
+
+enum uncompress_status
+uncompress_lzma2_validate (const void *const inbuf, size_t *const insizep,
+			   size_t *const outsizep, void *const mem,
+			   size_t const dict_size,
+			   uncompress_lzma2_hook_fn *const hook,
+			   void *const arg)
+{
+  struct uncompress_lzma2_stream *const stream
+    = uncompress_lzma2_stream_init(mem, dict_size);
+
+  if (UNLIKELY(!stream))
+    return UNCOMPRESS_NO_MEMORY;
+  return stream_decode(stream, inbuf, insizep, NULL, outsizep, 1,
+		       hook, arg);
+}
@@ -41,6 +41,269 @@ extern enum uncompress_status uncompress_lzma2 (const void */* inbuf */,
 						void */* outbuf */,
 						size_t */* outsize_ptr */);
 
+/* Name of the instruction set variant of the decoder in use
+   ("baseline", "bmi2" or "avx2"), chosen for the CPU at the first call,
+   or by environment variable UNCOMPRESS_LZMA2_ISA if it names another
+   supported one. */
+extern const char *uncompress_lzma2_isa (void);
+
+/* Slack for uncompress_lzma2_slack() with which long matches are
+   copied in wide blocks up to the end of the data. */
+#define UNCOMPRESS_LZMA2_OUTPUT_SLACK	32
+
+/* Alignment required for the workspace of uncompress_lzma2_ex(). */
+#define UNCOMPRESS_LZMA2_WORKSPACE_ALIGN	64
+
+/* Size of the workspace for uncompress_lzma2_ex() (about 29KiB). */
+extern size_t uncompress_lzma2_workspace_size (void);
+
+/* Same as uncompress_lzma2(), but uses caller-supplied WORKSPACE
+   instead of the stack.  WORKSPACE must be at least
+   uncompress_lzma2_workspace_size() bytes long and aligned to
+   UNCOMPRESS_LZMA2_WORKSPACE_ALIGN bytes, and can be reused
+   (but not shared between concurrent calls). */
+extern enum uncompress_status uncompress_lzma2_ex (const void */* inbuf */,
+						   size_t */* insize_ptr */,
+						   void */* outbuf */,
+						   size_t */* outsize_ptr */,
+						   void */* workspace */);
+
+/* Same as uncompress_lzma2_ex(), but the caller promises SLACK more
+   writable bytes after OUTBUF[0..*OUTSIZE_PTR), so that long matches
+   can be copied in wide blocks running past their ends.  Any bytes
+   after the decompressed data (up to the end of the slack) may be
+   overwritten then; the other functions leave them untouched. */
+extern enum uncompress_status uncompress_lzma2_slack (const void */* inbuf */,
+						      size_t */* insize_ptr */,
+						      void */* outbuf */,
+						      size_t */* outsize_ptr */,
+						      void */* workspace */,
+						      size_t /* slack */);
+
+/* Continue decompression stopped with UNCOMPRESS_OUTLIMIT by
+   uncompress_lzma2_ex() (or by this function) with WORKSPACE, which
+   holds the state in the middle of the chunk and the rest of the match
+   being copied.  INBUF and *INSIZE_PTR must be the same as before;
+   OUTBUF may have moved (by realloc() for example) but must hold the
+   output so far, and *OUTSIZE_PTR is the size of the whole (larger)
+   buffer.  Sizes returned are totals from the beginning of the stream.
+   Returns UNCOMPRESS_DATA_ERROR if WORKSPACE was not left at
+   UNCOMPRESS_OUTLIMIT. */
+extern enum uncompress_status uncompress_lzma2_resume (const void */* inbuf */,
+						       size_t */* insize_ptr */,
+						       void */* outbuf */,
+						       size_t */* outsize_ptr */,
+						       void */* workspace */);
+
+/* Function called with ARG and decompressed data of each chunk. */
+typedef void uncompress_lzma2_hook_fn (void */* arg */,
+				       const void */* data */,
+				       size_t /* size */);
+
+/* Same as uncompress_lzma2(), but calls HOOK for each chunk as soon as
+   it is completely decompressed (while its data are likely in cache),
+   e.g. to compute checksums on the fly.  A chunk decompressed only
+   partially (when an error is returned) is not passed to HOOK. */
+extern enum uncompress_status uncompress_lzma2_hook (const void */* inbuf */,
+						     size_t */* insize_ptr */,
+						     void */* outbuf */,
+						     size_t */* outsize_ptr */,
+						     uncompress_lzma2_hook_fn */* hook */,
+						     void */* arg */);
+
+/* Same as uncompress_lzma2_hook() (HOOK may be NULL), but uses WORKSPACE
+   as uncompress_lzma2_ex() does. */
+extern enum uncompress_status uncompress_lzma2_hook_ex (const void */* inbuf */,
+							size_t */* insize_ptr */,
+							void */* outbuf */,
+							size_t */* outsize_ptr */,
+							uncompress_lzma2_hook_fn */* hook */,
+							void */* arg */,
+							void */* workspace */);
+
+/* A piece of decompressed data described by uncompress_lzma2_sg() */
+struct uncompress_lzma2_segment
+  {
+    const void *	data;
+    size_t		size;
+  };
+
+/* Same as uncompress_lzma2(), but also describes the decompressed data
+   as *NSEGS_PTR (updated on return) or fewer SEGS, in order, for
+   writev(2)-like consumers.  Stored chunks which are not referred to
+   by later LZMA chunks are not copied: their segments point into
+   INBUF and the corresponding bytes of OUTBUF are left undefined.
+   Other segments point into OUTBUF.  Stored chunks are copied as usual
+   when SEGS would run out, so a single segment is always enough. */
+extern enum uncompress_status uncompress_lzma2_sg (const void */* inbuf */,
+						   size_t */* insize_ptr */,
+						   void */* outbuf */,
+						   size_t */* outsize_ptr */,
+						   struct uncompress_lzma2_segment */* segs */,
+						   size_t */* nsegs_ptr */);
+
+/* Streaming decoder (analogous to zlib's inflate()), which keeps
+   decoding state between calls and needs memory bounded by
+   the dictionary size instead of the whole output. */
+struct uncompress_lzma2_stream;
+
+/* Size of memory needed for a streaming decoder for streams compressed
+   with dictionary size DICT_SIZE (0 on overflow). */
+extern size_t uncompress_lzma2_stream_size (size_t /* dict_size */);
+
+/* Initialize a streaming decoder in MEM, which must be at least
+   uncompress_lzma2_stream_size(DICT_SIZE) bytes long and aligned to
+   UNCOMPRESS_LZMA2_WORKSPACE_ALIGN bytes.  Returns NULL on failure.
+   Matches farther than DICT_SIZE (at least 4KiB) are corrupt data.
+   The decoder can be reinitialized for another stream any time. */
+extern struct uncompress_lzma2_stream *uncompress_lzma2_stream_init (void */* mem */,
+								     size_t /* dict_size */);
+
+/* Decompress as much as possible from INBUF[0..*INSIZE_PTR) into
+   OUTBUF[0..*OUTSIZE_PTR), and store the numbers of bytes consumed
+   and produced into *INSIZE_PTR and *OUTSIZE_PTR.  Returns
+   UNCOMPRESS_OK at the end of the stream, UNCOMPRESS_INLIMIT if all
+   input was consumed, or UNCOMPRESS_OUTLIMIT if the output buffer is
+   full; call again with more input or output space to continue.
+   UNCOMPRESS_DATA_ERROR is returned for corrupt data, and again for
+   any later calls. */
+extern enum uncompress_status uncompress_lzma2_stream (struct uncompress_lzma2_stream */* stream */,
+						       const void */* inbuf */,
+						       size_t */* insize_ptr */,
+						       void */* outbuf */,
+						       size_t */* outsize_ptr */);
+
+/* Check the whole stream INBUF[0..*INSIZE_PTR) as uncompress_lzma2()
+   would, without an output buffer: data are decoded into a window in
+   MEM (of uncompress_lzma2_stream_size(DICT_SIZE) bytes, aligned as
+   for uncompress_lzma2_stream_init()) and passed to HOOK (if not NULL)
+   a chunk at a time, e.g. to compute a checksum.  Matches farther than
+   DICT_SIZE (at least 4KiB) are DATA_ERROR.  On return, *INSIZE_PTR and
+   *OUTSIZE_PTR are the sizes of the stream and of the decompressed data.
+   Returns UNCOMPRESS_OK for a complete valid stream, or
+   UNCOMPRESS_INLIMIT if it is truncated (then only complete chunks are
+   counted in *OUTSIZE_PTR and passed to HOOK). */
+extern enum uncompress_status uncompress_lzma2_validate (const void */* inbuf */,
+							 size_t */* insize_ptr */,
+							 size_t */* outsize_ptr */,
+							 void */* mem */,
+							 size_t /* dict_size */,
+							 uncompress_lzma2_hook_fn */* hook */,
+							 void */* arg */);
+
+enum uncompress_lzma2_chunk_type
+  {
+    UNCOMPRESS_LZMA2_CHUNK_STORED,	/* Uncompressed chunk */
+    UNCOMPRESS_LZMA2_CHUNK_LZMA,	/* LZMA compressed chunk */
+  };
+
+enum uncompress_lzma2_reset
+  {
+    UNCOMPRESS_LZMA2_RESET_NONE,
+    UNCOMPRESS_LZMA2_RESET_STATE,	/* State reset */
+    UNCOMPRESS_LZMA2_RESET_PROPS,	/* State reset using new properties */
+    UNCOMPRESS_LZMA2_RESET_DICT,	/* Dictionary reset (and above) */
+  };
+
+struct uncompress_lzma2_chunk
+  {
+    size_t		in_offset;	/* Offset of the control byte */
+    size_t		in_size;	/* Including chunk header */
+    size_t		out_offset;
+    size_t		out_size;
+    unsigned char	type;		/* enum uncompress_lzma2_chunk_type */
+    unsigned char	reset;		/* enum uncompress_lzma2_reset */
+    unsigned char	lc, lp, pb;	/* Properties in effect (LZMA only) */
+  };
+
+/* Walk chunk headers without decompressing, and store up to *NCHUNKS_PTR
+   entries into CHUNKS.  On return, *INSIZE_PTR is the size of
+   the stream including the end marker, *NCHUNKS_PTR is the number of
+   chunks in the stream and *OUTSIZE_PTR is the total uncompressed size.
+   UNCOMPRESS_OUTLIMIT is returned if CHUNKS is too small to hold
+   all chunks (other values are still valid). */
+extern enum uncompress_status uncompress_lzma2_scan (const void */* inbuf */,
+						     size_t */* insize_ptr */,
+						     struct uncompress_lzma2_chunk */* chunks */,
+						     size_t */* nchunks_ptr */,
+						     size_t */* outsize_ptr */);
+
+/* Decompress *LEN_PTR bytes at OFFSET of the uncompressed data into
+   OUTBUF, using chunk index made by uncompress_lzma2_scan().
+   Decoding starts at the nearest dictionary reset before OFFSET.
+   On return, *LEN_PTR is the number of bytes stored; UNCOMPRESS_INLIMIT
+   is returned if the range extends beyond the end of the stream.
+   May return UNCOMPRESS_NO_MEMORY as it allocates a scratch buffer for
+   bytes decoded before OFFSET. */
+extern enum uncompress_status uncompress_lzma2_range (const void */* inbuf */,
+						      size_t /* insize */,
+						      const struct uncompress_lzma2_chunk */* chunks */,
+						      size_t /* nchunks */,
+						      size_t /* offset */,
+						      void */* outbuf */,
+						      size_t */* len_ptr */);
+
+/* Same as uncompress_lzma2(), but decodes independent segments
+   (split on dictionary resets) with up to THREADS threads.
+   THREADS == 0 means the number of online processors. */
+extern enum uncompress_status uncompress_lzma2_mt (const void */* inbuf */,
+						   size_t */* insize_ptr */,
+						   void */* outbuf */,
+						   size_t */* outsize_ptr */,
+						   unsigned int /* threads */);
+
+/* An independent stream to be decompressed by uncompress_lzma2_batch() */
+struct uncompress_lzma2_batch_item
+  {
+    const void *	inbuf;
+    size_t		insize;		/* Updated as *insize_ptr */
+    void *		outbuf;
+    size_t		outsize;	/* Updated as *outsize_ptr */
+    /* If HOOK is not NULL, it is called as by uncompress_lzma2_hook()
+       (from any of the threads, but only one at a time per item). */
+    uncompress_lzma2_hook_fn *hook;
+    void *		hook_arg;
+    enum uncompress_status status;	/* Set on return */
+  };
+
+/* Decompress each of NITEMS ITEMS as uncompress_lzma2() would, using
+   up to THREADS threads (0 for the number of online processors).
+   Returns the status of the first item which is not UNCOMPRESS_OK,
+   or UNCOMPRESS_OK if all items are decompressed successfully. */
+extern enum uncompress_status uncompress_lzma2_batch (struct uncompress_lzma2_batch_item */* items */,
+						      size_t /* nitems */,
+						      unsigned int /* threads */);
+
+/* Decoder statistics, collected only if the library is built with
+   UNCOMPRESS_LZMA2_STATS defined (make STATS=1). */
+#define UNCOMPRESS_LZMA2_LEN_BUCKETS	9
+
+struct uncompress_lzma2_stats
+  {
+    unsigned long long	literals;	/* Plain literals */
+    unsigned long long	matched_literals; /* Literals after a match */
+    unsigned long long	matches;
+    unsigned long long	reps[4];	/* Long repeated matches with rep0-3 */
+    unsigned long long	short_reps;	/* 1-byte repeats of rep0 */
+    /* Match lengths (both matches and long reps); bucket I counts
+       lengths in [2^I + 1, 2^(I+1)], except the last one which counts
+       all longer ones. */
+    unsigned long long	match_len[UNCOMPRESS_LZMA2_LEN_BUCKETS];
+    unsigned long long	dist_slot[64];	/* Distance slots of matches */
+    unsigned long long	normalizes;	/* Range decoder input bytes */
+    unsigned long long	lzma_chunks, stored_chunks;
+    unsigned long long	lzma_chunk_ns;	/* Time spent in LZMA chunks */
+    /* Matches and reps (including short ones) of distances of 32KiB
+       or more, likely to miss the L1 cache, and bytes copied by them */
+    unsigned long long	far_matches, far_match_bytes;
+  };
+
+/* Add statistics collected by all decompressors (in all threads) to
+   *STATS, and clear them if RESET.  Returns 0 (and does nothing) if
+   the library is built without statistics. */
+extern int uncompress_lzma2_get_stats (struct uncompress_lzma2_stats *,
+				       int /* reset */);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,412 @@
+/*
+ * LZMA2 simplified decompressor, C++ interface
+ *
+ * Copyright 2020 TAKAI Kousuke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Header-only C++20 wrapper of uncompress_lzma2.h:
+ *
+ *   lzma2::decoder		owns a workspace (from a
+ *				std::pmr::memory_resource) reused by
+ *				every decode() call
+ *   lzma2::buffer		output allocated from a memory resource
+ *				at the exact size given by the chunk index
+ *   lzma2::stream		streaming decoder; chunks() iterates over
+ *				decompressed data a buffer at a time
+ *
+ * Functions returning a result never throw; those returning data throw
+ * lzma2::error on failure.
+ */
+
+#ifndef UNCOMPRESS_LZMA2_HPP
+#define UNCOMPRESS_LZMA2_HPP 1
+
+#include <cstddef>
+#include <iterator>
+#include <memory_resource>
+#include <span>
+#include <stdexcept>
+#include <utility>
+
+#include "uncompress_lzma2.h"
+
+namespace lzma2
+{
+  enum class status
+    {
+      ok = UNCOMPRESS_OK,
+      no_memory = UNCOMPRESS_NO_MEMORY,
+      data_error = UNCOMPRESS_DATA_ERROR,
+      inlimit = UNCOMPRESS_INLIMIT,
+      outlimit = UNCOMPRESS_OUTLIMIT,
+    };
+
+  inline const char *
+  status_string (status const s) noexcept
+  {
+    switch (s)
+      {
+      case status::ok:		return "OK";
+      case status::no_memory:	return "out of memory";
+      case status::data_error:	return "corrupt data";
+      case status::inlimit:	return "truncated input";
+      case status::outlimit:	return "output buffer too small";
+      default:			return "unknown status";
+      }
+  }
+
+  class error : public std::runtime_error
+  {
+  public:
+    explicit error (status const s)
+      : std::runtime_error(status_string(s)), code_(s)
+    {
+    }
+
+    status code () const noexcept { return code_; }
+
+  private:
+    status code_;
+  };
+
+  /* Outcome of a call: status and the numbers of bytes consumed from
+     the input and produced into the output */
+  struct result
+  {
+    status	code;
+    std::size_t	in_size;
+    std::size_t	out_size;
+
+    explicit operator bool () const noexcept { return code == status::ok; }
+  };
+
+  namespace detail
+  {
+    inline std::size_t
+    workspace_alloc_size (std::size_t const size) noexcept
+    {
+      return ((size + UNCOMPRESS_LZMA2_WORKSPACE_ALIGN - 1)
+	      & -std::size_t(UNCOMPRESS_LZMA2_WORKSPACE_ALIGN));
+    }
+
+    /* Memory of SIZE bytes from a memory resource, freed on destruction */
+    class block
+    {
+    public:
+      block () noexcept = default;
+
+      block (std::size_t const size, std::size_t const align,
+	     std::pmr::memory_resource *const mr)
+	: mr_(mr), size_(size), align_(align),
+	  data_(mr->allocate(size ? size : 1, align))
+      {
+      }
+
+      block (block &&other) noexcept
+	: mr_(other.mr_), size_(other.size_), align_(other.align_),
+	  data_(std::exchange(other.data_, nullptr))
+      {
+      }
+
+      block &
+      operator= (block &&other) noexcept
+      {
+	if (this != &other)
+	  {
+	    release();
+	    mr_ = other.mr_;
+	    size_ = other.size_;
+	    align_ = other.align_;
+	    data_ = std::exchange(other.data_, nullptr);
+	  }
+	return *this;
+      }
+
+      ~block () { release(); }
+
+      void *data () const noexcept { return data_; }
+      std::size_t size () const noexcept { return size_; }
+      std::pmr::memory_resource *resource () const noexcept { return mr_; }
+
+    private:
+      void
+      release () noexcept
+      {
+	if (data_)
+	  mr_->deallocate(data_, size_ ? size_ : 1, align_);
+	data_ = nullptr;
+      }
+
+      std::pmr::memory_resource *mr_ = nullptr;
+      std::size_t size_ = 0, align_ = 1;
+      void *data_ = nullptr;
+    };
+  }
+
+  /* Decompressed data; memory is not initialized beyond size(). */
+  class buffer
+  {
+  public:
+    buffer () noexcept = default;
+
+    buffer (std::size_t const capacity, std::pmr::memory_resource *const mr)
+      : block_(capacity, alignof(std::max_align_t), mr)
+    {
+    }
+
+    std::byte *
+    data () const noexcept
+    {
+      return static_cast<std::byte *>(block_.data());
+    }
+
+    std::size_t size () const noexcept { return size_; }
+    std::size_t capacity () const noexcept { return block_.size(); }
+    std::span<std::byte> span () const noexcept { return { data(), size_ }; }
+    operator std::span<const std::byte> () const noexcept { return span(); }
+    void resize (std::size_t const size) noexcept { size_ = size; }
+
+  private:
+    detail::block block_;
+    std::size_t size_ = 0;
+  };
+
+  /* Total decompressed size of the stream IN (from chunk headers) */
+  inline std::size_t
+  decompressed_size (std::span<const std::byte> const in)
+  {
+    std::size_t insize = in.size(), nchunks = 0, outsize;
+    status const s
+      = status(uncompress_lzma2_scan(in.data(), &insize, nullptr, &nchunks,
+				     &outsize));
+
+    if (s != status::ok && s != status::outlimit)
+      throw error(s);
+    return outsize;
+  }
+
+  /* Single-call decoder with a reusable workspace (one per thread) */
+  class decoder
+  {
+  public:
+    explicit decoder (std::pmr::memory_resource *const mr
+		      = std::pmr::get_default_resource())
+      : workspace_(detail::workspace_alloc_size(uncompress_lzma2_workspace_size()),
+		   UNCOMPRESS_LZMA2_WORKSPACE_ALIGN, mr)
+    {
+    }
+
+    /* Decompress IN into OUT; bytes of OUT after the data are left
+       untouched. */
+    result
+    decode (std::span<const std::byte> const in,
+	    std::span<std::byte> const out) noexcept
+    {
+      std::size_t insize = in.size(), outsize = out.size();
+      status const s
+	= status(uncompress_lzma2_ex(in.data(), &insize, out.data(), &outsize,
+				     workspace_.data()));
+
+      return { s, insize, outsize };
+    }
+
+    /* Decompress IN into a buffer allocated from MR (the resource of
+       the decoder by default) at the exact size plus slack, which lets
+       uncompress_lzma2_slack() copy long matches in wide blocks. */
+    buffer
+    decode (std::span<const std::byte> const in,
+	    std::pmr::memory_resource *mr = nullptr)
+    {
+      std::size_t const size = decompressed_size(in);
+      buffer out(size + UNCOMPRESS_LZMA2_OUTPUT_SLACK,
+		 mr ? mr : workspace_.resource());
+      std::size_t insize = in.size(), outsize = size;
+      status const s
+	= status(uncompress_lzma2_slack(in.data(), &insize, out.data(),
+					&outsize, workspace_.data(),
+					UNCOMPRESS_LZMA2_OUTPUT_SLACK));
+
+      if (s != status::ok)
+	throw error(s);
+      out.resize(outsize);
+      return out;
+    }
+
+  private:
+    detail::block workspace_;
+  };
+
+  class stream;
+
+  /* Input iterator over spans of decompressed data, each filling
+     (a part of) the buffer given to stream::chunks(). */
+  class chunk_iterator
+  {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = std::span<const std::byte>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type *;
+    using reference = const value_type &;
+
+    chunk_iterator () noexcept = default;
+
+    reference operator* () const noexcept { return chunk_; }
+    pointer operator-> () const noexcept { return &chunk_; }
+
+    inline chunk_iterator &operator++ ();
+    void operator++ (int) { ++*this; }
+
+    friend bool
+    operator== (chunk_iterator const &a, chunk_iterator const &b) noexcept
+    {
+      return a.stream_ == b.stream_;
+    }
+
+  private:
+    friend class chunk_range;
+
+    chunk_iterator (stream *const s, std::span<const std::byte> const in,
+		    std::span<std::byte> const buf)
+      : stream_(s), in_(in), buf_(buf)
+    {
+      ++*this;
+    }
+
+    stream *stream_ = nullptr;		/* nullptr at the end */
+    std::span<const std::byte> in_;
+    std::span<std::byte> buf_;
+    std::span<const std::byte> chunk_;
+    bool done_ = false;
+  };
+
+  class chunk_range
+  {
+  public:
+    chunk_iterator begin () const { return { stream_, in_, buf_ }; }
+    chunk_iterator end () const noexcept { return {}; }
+
+  private:
+    friend class stream;
+
+    chunk_range (stream *const s, std::span<const std::byte> const in,
+		 std::span<std::byte> const buf) noexcept
+      : stream_(s), in_(in), buf_(buf)
+    {
+    }
+
+    stream *stream_;
+    std::span<const std::byte> in_;
+    std::span<std::byte> buf_;
+  };
+
+  /* Streaming decoder with a window for DICT_SIZE bytes of dictionary */
+  class stream
+  {
+  public:
+    explicit stream (std::size_t const dict_size,
+		     std::pmr::memory_resource *const mr
+		     = std::pmr::get_default_resource())
+      : dict_size_(dict_size)
+    {
+      std::size_t const size = uncompress_lzma2_stream_size(dict_size);
+
+      if (!size)
+	throw error(status::no_memory);
+      mem_ = detail::block(detail::workspace_alloc_size(size),
+			   UNCOMPRESS_LZMA2_WORKSPACE_ALIGN, mr);
+      reset();
+    }
+
+    /* Start decoding another stream. */
+    void
+    reset () noexcept
+    {
+      stream_ = uncompress_lzma2_stream_init(mem_.data(), dict_size_);
+    }
+
+    /* As uncompress_lzma2_stream() */
+    result
+    decode (std::span<const std::byte> const in,
+	    std::span<std::byte> const out) noexcept
+    {
+      std::size_t insize = in.size(), outsize = out.size();
+      status const s
+	= status(uncompress_lzma2_stream(stream_, in.data(), &insize,
+					 out.data(), &outsize));
+
+      return { s, insize, outsize };
+    }
+
+    /* Range of decompressed data of the whole stream IN, each element
+       being a part of BUF valid until the next one is taken.
+       Throws std::invalid_argument if BUF is empty; taking elements
+       throws error if the stream is corrupt or truncated. */
+    chunk_range
+    chunks (std::span<const std::byte> const in,
+	    std::span<std::byte> const buf)
+    {
+      if (buf.empty())
+	throw std::invalid_argument("lzma2::stream::chunks: empty buffer");
+      return { this, in, buf };
+    }
+
+  private:
+    std::size_t dict_size_;
+    detail::block mem_;
+    struct ::uncompress_lzma2_stream *stream_ = nullptr;
+  };
+
+  inline chunk_iterator &
+  chunk_iterator::operator++ ()
+  {
+    for (;;)
+      {
+	if (done_)
+	  {
+	    stream_ = nullptr;
+	    return *this;
+	  }
+
+	result const r = stream_->decode(in_, buf_);
+
+	in_ = in_.subspan(r.in_size);
+	switch (r.code)
+	  {
+	  case status::ok:
+	    done_ = true;
+	    break;
+	  case status::outlimit:
+	    break;
+	  case status::inlimit:
+	    if (!in_.empty())
+	      break;
+	    [[fallthrough]];
+	  default:
+	    throw error(r.code);
+	  }
+	if (r.out_size)
+	  {
+	    chunk_ = buf_.first(r.out_size);
+	    return *this;
+	  }
+      }
+  }
+}
+
+#endif /* UNCOMPRESS_LZMA2_HPP */
@@ -0,0 +1,110 @@
+/*
+ * LZMA2 simplified decompressor, batch driver
+ *
+ * Copyright 2020 TAKAI Kousuke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * uncompress_lzma2_batch() decodes many independent streams with
+ * a pool of threads.  Workers take the next undecoded item from
+ * a shared counter, so that a worker stuck with a large item does not
+ * hold up the others, and each worker reuses one workspace (allocated
+ * once) for all items it takes, which stays warm in its cache.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "uncompress_lzma2.h"
+
+struct batch
+  {
+    struct uncompress_lzma2_batch_item *items;
+    size_t		nitems;
+    size_t		next;		/* Next item to be taken */
+  };
+
+static void *
+worker (void *const arg)
+{
+  struct batch *const batch = arg;
+  void *const workspace
+    = aligned_alloc(UNCOMPRESS_LZMA2_WORKSPACE_ALIGN,
+		    ((uncompress_lzma2_workspace_size()
+		      + UNCOMPRESS_LZMA2_WORKSPACE_ALIGN - 1)
+		     & -UNCOMPRESS_LZMA2_WORKSPACE_ALIGN));
+  size_t i;
+
+  while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED))
+	 < batch->nitems)
+    {
+      struct uncompress_lzma2_batch_item *const item = &batch->items[i];
+
+      item->status = (workspace ?
+		      uncompress_lzma2_hook_ex(item->inbuf, &item->insize,
+					       item->outbuf, &item->outsize,
+					       item->hook, item->hook_arg,
+					       workspace) :
+		      uncompress_lzma2_hook(item->inbuf, &item->insize,
+					    item->outbuf, &item->outsize,
+					    item->hook, item->hook_arg));
+    }
+  free(workspace);
+  return NULL;
+}
+
+enum uncompress_status
+uncompress_lzma2_batch (struct uncompress_lzma2_batch_item *const items,
+			size_t const nitems, unsigned int threads)
+{
+  struct batch batch;
+  size_t i;
+
+  if (threads == 0)
+    {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = n > 0 ? n : 1;
+    }
+  if (threads > nitems)
+    threads = nitems ? nitems : 1;
+
+  batch.items = items;
+  batch.nitems = nitems;
+  batch.next = 0;
+
+  /* Fewer threads (down to the calling one alone) are used if
+     thread IDs cannot be allocated or threads cannot be created. */
+  pthread_t *const tids = malloc(sizeof(pthread_t) * (threads - 1));
+  unsigned int nthreads = 0;
+
+  if (tids)
+    for (; nthreads < threads - 1; nthreads++)
+      if (pthread_create(&tids[nthreads], NULL, worker, &batch) != 0)
+	break;
+  worker(&batch);
+  while (nthreads > 0)
+    pthread_join(tids[--nthreads], NULL);
+  free(tids);
+
+  for (i = 0; i < nitems; i++)
+    if (items[i].status != UNCOMPRESS_OK)
+      return items[i].status;
+  return UNCOMPRESS_OK;
+}
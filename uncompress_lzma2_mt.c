@@ -0,0 +1,223 @@
+/*
+ * LZMA2 simplified decompressor, multi-threaded driver
+ *
+ * Copyright 2020 TAKAI Kousuke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * A chunk with control byte 0x01 or >= 0xE0 resets the dictionary,
+ * so it and the following chunks up to the next such chunk ("segment")
+ * can be decoded without anything decoded before.
+ * uncompress_lzma2_mt() scans chunk headers with uncompress_lzma2_scan()
+ * to find segment boundaries and their input/output offsets, then lets
+ * worker threads decode segments with uncompress_lzma2_ex() directly
+ * into their own slices of the output buffer.  Each worker reuses
+ * its own workspace for all segments it decodes.  Before decoding,
+ * a worker faults in the whole pages of its slice at once, so that they
+ * are allocated from the NUMA node of the writing thread (and as huge
+ * pages where the buffer is advised so) without a fault per page.
+ *
+ * Anything unusual (malformed headers, truncated input, too small
+ * output buffer, or a segment failing to decode) is left to the
+ * sequential decoder, so that the returned status and sizes are
+ * exactly the same as what uncompress_lzma2() would report.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "uncompress_lzma2.h"
+
+struct segment
+  {
+    size_t		in_offset, in_size;
+    size_t		out_offset, out_size;
+    enum uncompress_status status;
+  };
+
+struct job
+  {
+    const uint8_t *	inbuf;
+    uint8_t *		outbuf;
+    struct segment *	segments;
+    size_t		nsegments;
+    size_t		next;		/* Next segment to be taken */
+    long		page_size;	/* 0 if not known */
+  };
+
+/* Populate the pages entirely within BUF[0..SIZE) for writing;
+   the partial pages at the ends may belong to other segments. */
+static void
+prefault (uint8_t *const buf, size_t const size, long const page_size)
+{
+#ifdef MADV_POPULATE_WRITE
+  if (page_size <= 0)
+    return;
+
+  uintptr_t const start = ((uintptr_t) buf + page_size - 1) & -page_size;
+  uintptr_t const end = ((uintptr_t) buf + size) & -page_size;
+
+  /* Fails on kernels before 5.14; pages are faulted in as written then. */
+  if (start < end)
+    madvise((void *) start, end - start, MADV_POPULATE_WRITE);
+#else
+  (void) buf;
+  (void) size;
+  (void) page_size;
+#endif
+}
+
+static void *
+worker (void *const arg)
+{
+  struct job *const job = arg;
+  void *const workspace
+    = aligned_alloc(UNCOMPRESS_LZMA2_WORKSPACE_ALIGN,
+		    ((uncompress_lzma2_workspace_size()
+		      + UNCOMPRESS_LZMA2_WORKSPACE_ALIGN - 1)
+		     & -UNCOMPRESS_LZMA2_WORKSPACE_ALIGN));
+  size_t i;
+
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+	 < job->nsegments)
+    {
+      struct segment *const seg = &job->segments[i];
+      size_t insize = seg->in_size;
+      size_t outsize = seg->out_size;
+
+      prefault(&job->outbuf[seg->out_offset], seg->out_size,
+	       job->page_size);
+      /* A segment is not terminated by an end marker, so successful
+	 decoding ends up with UNCOMPRESS_INLIMIT just at its end. */
+      seg->status = (workspace ?
+		     uncompress_lzma2_ex(&job->inbuf[seg->in_offset], &insize,
+					 &job->outbuf[seg->out_offset],
+					 &outsize, workspace) :
+		     uncompress_lzma2(&job->inbuf[seg->in_offset], &insize,
+				      &job->outbuf[seg->out_offset], &outsize));
+      if (seg->status == UNCOMPRESS_INLIMIT &&
+	  insize == seg->in_size && outsize == seg->out_size)
+	seg->status = UNCOMPRESS_OK;
+    }
+  free(workspace);
+  return NULL;
+}
+
+enum uncompress_status
+uncompress_lzma2_mt (const void *const inbuf, size_t *const insizep,
+		     void *const outbuf, size_t *const outsizep,
+		     unsigned int threads)
+{
+  struct job job;
+  struct uncompress_lzma2_chunk *chunks;
+  size_t intotal = *insizep, outtotal, nchunks = 0;
+  size_t i;
+
+  if (threads == 0)
+    {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = n > 0 ? n : 1;
+    }
+  if (threads < 2 ||
+      uncompress_lzma2_scan(inbuf, &intotal, NULL, &nchunks,
+			    &outtotal) != UNCOMPRESS_OUTLIMIT ||
+      outtotal > *outsizep ||
+      !(chunks = malloc(sizeof(*chunks) * nchunks)))
+    return uncompress_lzma2(inbuf, insizep, outbuf, outsizep);
+  uncompress_lzma2_scan(inbuf, &intotal, chunks, &nchunks, &outtotal);
+
+  job.nsegments = 0;
+  for (i = 0; i < nchunks; i++)
+    if (chunks[i].reset == UNCOMPRESS_LZMA2_RESET_DICT)
+      job.nsegments++;
+  if (job.nsegments < 2 ||
+      !(job.segments = malloc(sizeof(struct segment) * job.nsegments)))
+    {
+      free(chunks);
+      return uncompress_lzma2(inbuf, insizep, outbuf, outsizep);
+    }
+
+  /* The first chunk is always a dictionary reset. */
+  struct segment *seg = job.segments;
+  for (i = 0; i < nchunks; i++)
+    {
+      if (chunks[i].reset == UNCOMPRESS_LZMA2_RESET_DICT)
+	{
+	  if (i > 0)
+	    seg++;
+	  seg->in_offset = chunks[i].in_offset;
+	  seg->in_size = 0;
+	  seg->out_offset = chunks[i].out_offset;
+	  seg->out_size = 0;
+	}
+      seg->in_size += chunks[i].in_size;
+      seg->out_size += chunks[i].out_size;
+    }
+  free(chunks);
+
+  job.inbuf = inbuf;
+  job.outbuf = outbuf;
+  job.next = 0;
+  job.page_size = sysconf(_SC_PAGESIZE);
+  if (threads > job.nsegments)
+    threads = job.nsegments;
+
+  /* Fewer threads (down to the calling one alone) are used if
+     thread IDs cannot be allocated or threads cannot be created. */
+  pthread_t *const tids = malloc(sizeof(pthread_t) * (threads - 1));
+  unsigned int nthreads = 0;
+
+  if (tids)
+    for (; nthreads < threads - 1; nthreads++)
+      if (pthread_create(&tids[nthreads], NULL, worker, &job) != 0)
+	break;
+  worker(&job);
+  while (nthreads > 0)
+    pthread_join(tids[--nthreads], NULL);
+  free(tids);
+
+  for (i = 0; i < job.nsegments; i++)
+    if (job.segments[i].status != UNCOMPRESS_OK)
+      break;
+  if (i < job.nsegments)
+    {
+      /* Redo the failed segment sequentially to get the exact
+	 status and sizes.  Every segment starts with a dictionary reset,
+	 so this is what uncompress_lzma2() would see from the start. */
+      size_t const in_offset = job.segments[i].in_offset;
+      size_t const out_offset = job.segments[i].out_offset;
+      size_t insize = *insizep - in_offset;
+      size_t outsize = *outsizep - out_offset;
+      enum uncompress_status const ret
+	= uncompress_lzma2(&job.inbuf[in_offset], &insize,
+			   &job.outbuf[out_offset], &outsize);
+
+      free(job.segments);
+      *insizep = in_offset + insize;
+      *outsizep = out_offset + outsize;
+      return ret;
+    }
+
+  free(job.segments);
+  *insizep = intotal;
+  *outsizep = outtotal;
+  return UNCOMPRESS_OK;
+}
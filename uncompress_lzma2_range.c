@@ -0,0 +1,193 @@
+/*
+ * LZMA2 simplified decompressor, random access driver
+ *
+ * Copyright 2020 TAKAI Kousuke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * uncompress_lzma2_range() decodes only a part of the stream, using
+ * the chunk index made by uncompress_lzma2_scan().
+ *
+ * Decoding of a segment (a dictionary-reset chunk and the following
+ * chunks up to the next one) needs nothing before it, so decoding starts
+ * at the nearest dictionary reset at or before the requested range.
+ * Only chunks up to the last LZMA chunk overlapping the range need to be
+ * decoded, as stored chunks before it may be referred to as dictionary;
+ * stored chunks after it are copied directly from the input.
+ * Decoded bytes before the range go to a scratch buffer, which
+ * is not needed if the range starts at a segment boundary.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uncompress_lzma2.h"
+
+#define UNLIKELY(Cond)	__builtin_expect((Cond), 0)
+
+/* Returns the index of the chunk containing output offset POS. */
+static size_t
+find_chunk (const struct uncompress_lzma2_chunk *const chunks,
+	    size_t const nchunks, size_t const pos)
+{
+  size_t lo = 0, hi = nchunks;
+
+  while (hi - lo > 1)
+    {
+      size_t const mid = lo + (hi - lo) / 2;
+
+      if (chunks[mid].out_offset <= pos)
+	lo = mid;
+      else
+	hi = mid;
+    }
+  return lo;
+}
+
+enum uncompress_status
+uncompress_lzma2_range (const void *const inbuf, size_t const insize,
+			const struct uncompress_lzma2_chunk *const chunks,
+			size_t const nchunks, size_t const offset,
+			void *const outbuf, size_t *const lenp)
+{
+  enum uncompress_status ret = UNCOMPRESS_OK;
+  const uint8_t *const in = inbuf;
+  uint8_t *const out = outbuf;
+  size_t const total = (nchunks == 0 ? 0 :
+			chunks[nchunks - 1].out_offset +
+			chunks[nchunks - 1].out_size);
+  size_t end;
+  size_t pos = offset;
+  size_t c;
+  uint8_t *scratch = NULL;
+  size_t scratch_size = 0;
+
+  if (offset >= total || *lenp == 0)
+    {
+      ret = *lenp == 0 ? UNCOMPRESS_OK : UNCOMPRESS_INLIMIT;
+      *lenp = 0;
+      return ret;
+    }
+  if (total - offset < *lenp)
+    {
+      end = total;
+      ret = UNCOMPRESS_INLIMIT;
+    }
+  else
+    end = offset + *lenp;
+
+  for (c = find_chunk(chunks, nchunks, offset); pos < end; )
+    {
+      size_t s, e, last_lzma, i;
+
+      /* Segment containing chunk C is chunks[S..E). */
+      for (s = c; chunks[s].reset != UNCOMPRESS_LZMA2_RESET_DICT; s--)
+	if (s == 0)
+	  {
+	    /* The first chunk must be a dictionary reset. */
+	    ret = UNCOMPRESS_DATA_ERROR;
+	    goto finish;
+	  }
+      for (e = c + 1; e < nchunks; e++)
+	if (chunks[e].reset == UNCOMPRESS_LZMA2_RESET_DICT)
+	  break;
+
+      /* LAST_LZMA == S - 1 (may wrap around) if there is none. */
+      last_lzma = s - 1;
+      for (i = c; i < e && chunks[i].out_offset < end; i++)
+	if (chunks[i].type == UNCOMPRESS_LZMA2_CHUNK_LZMA)
+	  last_lzma = i;
+
+      if (UNLIKELY(chunks[s].in_offset >= insize))
+	{
+	  ret = UNCOMPRESS_INLIMIT;
+	  goto finish;
+	}
+
+      if (last_lzma + 1 != s)
+	{
+	  size_t const seg_start = chunks[s].out_offset;
+	  size_t decode_end = (chunks[last_lzma].out_offset +
+			       chunks[last_lzma].out_size);
+	  uint8_t *dst;
+	  size_t insize_seg = insize - chunks[s].in_offset;
+	  size_t outsize;
+
+	  if (decode_end > end)
+	    decode_end = end;
+	  outsize = decode_end - seg_start;
+	  if (seg_start == pos)
+	    dst = &out[pos - offset];
+	  else
+	    {
+	      if (scratch_size < outsize)
+		{
+		  free(scratch);
+		  if (!(scratch = malloc(outsize)))
+		    {
+		      ret = UNCOMPRESS_NO_MEMORY;
+		      goto finish;
+		    }
+		  scratch_size = outsize;
+		}
+	      dst = scratch;
+	    }
+
+	  /* This stops at the end of DST (with UNCOMPRESS_OUTLIMIT) unless
+	     the stream ends there. */
+	  enum uncompress_status const status
+	    = uncompress_lzma2(&in[chunks[s].in_offset], &insize_seg,
+			       dst, &outsize);
+	  if (dst == scratch && outsize > pos - seg_start)
+	    memcpy(&out[pos - offset], &scratch[pos - seg_start],
+		   outsize - (pos - seg_start));
+	  if (outsize != decode_end - seg_start)
+	    {
+	      if (seg_start + outsize > pos)
+		pos = seg_start + outsize;
+	      ret = status;
+	      goto finish;
+	    }
+	  pos = decode_end;
+	  c = last_lzma + 1;
+	}
+
+      /* Stored chunks following the last LZMA chunk */
+      for (; c < e && pos < end; c++)
+	{
+	  size_t const skip = pos - chunks[c].out_offset;
+	  size_t len = chunks[c].out_size - skip;
+
+	  if (len > end - pos)
+	    len = end - pos;
+	  if (UNLIKELY(insize - chunks[c].in_offset < chunks[c].in_size))
+	    {
+	      ret = UNCOMPRESS_INLIMIT;
+	      goto finish;
+	    }
+	  memcpy(&out[pos - offset], &in[chunks[c].in_offset + 3 + skip], len);
+	  pos += len;
+	}
+    }
+
+ finish:
+  free(scratch);
+  *lenp = pos - offset;
+  return ret;
+}